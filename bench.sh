@@ -0,0 +1,28 @@
+#!/bin/sh
+# Benchmark the proxy on localhost: start the origin stub and a caching
+# proxy, then drive hit-only, miss-only and mixed Zipf workloads through it.
+# Ports, duration, connections, proxy threads and the cache's replacement
+# policy can be set from the environment, e.g. POLICY=s3fifo make bench
+
+PROXY_PORT=${PROXY_PORT:-18080}
+ORIGIN_PORT=${ORIGIN_PORT:-19000}
+DURATION=${DURATION:-10}
+CONNECTIONS=${CONNECTIONS:-32}
+THREADS=${THREADS:-4}
+POLICY=${POLICY:-lru}
+
+./benchorigin -p "$ORIGIN_PORT" &
+ORIGIN=$!
+# the proxy logs every request, which would only measure the terminal
+./htproxy -p "$PROXY_PORT" -c -t "$THREADS" -m 64M -P "$POLICY" > /dev/null &
+PROXY=$!
+trap 'kill $PROXY $ORIGIN 2> /dev/null' EXIT INT TERM
+sleep 1
+
+LOAD="./benchload -p $PROXY_PORT -o $ORIGIN_PORT -c $CONNECTIONS -d $DURATION"
+# 1000 small objects, all cached before the run
+$LOAD -l hit -k 1000 -w -q size=1024
+# a new key for every request, so each one goes to the origin
+$LOAD -l miss -u -q size=1024
+# 100000 objects of 4K (400M) over a 64M cache, requested by popularity
+$LOAD -l mixed -k 100000 -s 0.99 -q size=4096
@@ -0,0 +1,421 @@
+/*
+Load generator for benchmarking the proxy on localhost. Each connection runs
+in its own thread and sends keep-alive GETs through the proxy for objects of
+the origin stub, picking keys from a Zipf distribution (or a fresh key per
+request for a miss-only load). After the run it reports requests per second,
+p50/p99/p999 latency and the hit ratio, taken as the share of requests the
+origin stub never saw.
+Usage: benchload [-l label] [-p proxy port] [-o origin port] [-c conns]
+                 [-d secs] [-k keys] [-s zipf exponent] [-q query] [-w] [-u]
+*/
+
+#define _GNU_SOURCE
+#include <math.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "httpParser.h"
+
+#define RESPONSE_BUFFER 65536
+#define REQUEST_LINE 512
+#define INITIAL_SAMPLES 4096
+#define CONTENT "Content-Length"
+#define CONNECTION "Connection"
+
+typedef struct loadOptions loadOptions_t;
+struct loadOptions {
+    const char *label;
+    int proxyPort;
+    int originPort;
+    int connections;
+    int seconds;
+    long keys;
+    double exponent;
+    const char *query;
+    int warm;
+    int unique;
+};
+
+// one connection's thread and the latencies it measured, in nanoseconds
+typedef struct loadWorker loadWorker_t;
+struct loadWorker {
+    pthread_t thread;
+    uint64_t random;
+    long *samples;
+    long nSamples;
+    long maxSamples;
+    unsigned long errors;
+};
+
+static loadOptions_t options = {.label = "load",
+                                .proxyPort = 8080,
+                                .originPort = 9000,
+                                .connections = 16,
+                                .seconds = 10,
+                                .keys = 1000,
+                                .exponent = 0.99,
+                                .query = "",
+                                .warm = 0,
+                                .unique = 0};
+// cumulative Zipf probabilities of keys 0 .. keys-1
+static double *zipfCdf;
+// keys of this run are /obj/<nonce>/<key> so runs do not share cache entries
+static long nonce;
+static atomic_long uniqueKey;
+static struct timespec deadline;
+
+/*****************************************************************************/
+static long elapsed_ns(struct timespec *start, struct timespec *end) {
+    return (end->tv_sec - start->tv_sec) * 1000000000L +
+           (end->tv_nsec - start->tv_nsec);
+}
+
+// xorshift64*, one state per thread
+static double next_random(loadWorker_t *worker) {
+    worker->random ^= worker->random >> 12;
+    worker->random ^= worker->random << 25;
+    worker->random ^= worker->random >> 27;
+    return (worker->random * 2685821657736338717ULL >> 11) * 0x1.0p-53;
+}
+
+// cumulative probabilities of a Zipf distribution over the keys; an
+// exponent of 0 makes every key equally likely
+static void build_zipf(void) {
+    zipfCdf = malloc(options.keys * sizeof(double));
+    if (!zipfCdf) {
+        perror("Error: Cannot allocate key distribution\n");
+        exit(EXIT_FAILURE);
+    }
+    double total = 0;
+    for (long i = 0; i < options.keys; i++) {
+        total += 1.0 / pow(i + 1, options.exponent);
+        zipfCdf[i] = total;
+    }
+    for (long i = 0; i < options.keys; i++) {
+        zipfCdf[i] /= total;
+    }
+}
+
+// next key to request: a new one for miss-only loads, otherwise a Zipf draw
+static long pick_key(loadWorker_t *worker) {
+    if (options.unique) {
+        return atomic_fetch_add(&uniqueKey, 1);
+    }
+    double u = next_random(worker);
+    long low = 0, high = options.keys - 1;
+    while (low < high) {
+        long middle = (low + high) / 2;
+        if (zipfCdf[middle] < u) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    return low;
+}
+
+// connect to a localhost port, -1 on failure
+static int connect_local(int port) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0), enable = 1;
+    struct sockaddr_in address = {.sin_family = AF_INET,
+                                  .sin_port = htons(port),
+                                  .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable));
+    return fd;
+}
+
+// send a request and read its whole response into buffer, where a body
+// that fits starts at *bodyStart; returns the body length or -1 if the
+// exchange failed, and clears keepAlive if the connection cannot be reused
+static long exchange(int fd, const char *request, int requestLength,
+                     char *buffer, int *bodyStart, int *keepAlive) {
+    if (send(fd, request, requestLength, MSG_NOSIGNAL) != requestLength) {
+        return -1;
+    }
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    int length = 0, headerEnd = 0;
+    while (!headerEnd) {
+        if (length == RESPONSE_BUFFER) {
+            return -1;
+        }
+        ssize_t got = recv(fd, buffer + length, RESPONSE_BUFFER - length, 0);
+        if (got <= 0) {
+            return -1;
+        }
+        length += got;
+        headerEnd = feed_http_parser(&parser, buffer, length);
+    }
+    long contentLength = -1;
+    for (int i = 0; i < parser.nHeaders; i++) {
+        httpHeader_t *header = &parser.headers[i];
+        if (http_header_is(buffer, header, CONTENT)) {
+            contentLength =
+                http_to_long(buffer + header->value, header->valueLength);
+        } else if (http_header_is(buffer, header, CONNECTION) &&
+                   http_find(buffer + header->value, header->valueLength,
+                             "close") > -1) {
+            *keepAlive = 0;
+        }
+    }
+    if (contentLength < 0) {
+        return -1;
+    }
+    *bodyStart = headerEnd;
+    // a body that fits is kept after the header, a larger one is read
+    // over the start of the buffer and dropped
+    long remaining = contentLength - (length - headerEnd);
+    int keep = headerEnd + contentLength <= RESPONSE_BUFFER;
+    while (remaining > 0) {
+        char *target =
+            keep ? buffer + headerEnd + contentLength - remaining : buffer;
+        ssize_t got = recv(fd, target, (remaining < RESPONSE_BUFFER)
+                                           ? remaining
+                                           : RESPONSE_BUFFER,
+                           0);
+        if (got <= 0) {
+            return -1;
+        }
+        remaining -= got;
+    }
+    return contentLength;
+}
+
+// request one key through the proxy on *fd, reconnecting as needed;
+// returns 1 on success
+static int request_key(loadWorker_t *worker, int *fd, long key) {
+    char request[REQUEST_LINE];
+    static __thread char *buffer;
+    if (!buffer) {
+        buffer = malloc(RESPONSE_BUFFER);
+        if (!buffer) {
+            perror("Error: Cannot allocate response buffer\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    int length = snprintf(request, sizeof(request),
+                          "GET http://127.0.0.1:%d/obj/%ld/%ld%s%s HTTP/1.1\r\n"
+                          "Host: 127.0.0.1:%d\r\n\r\n",
+                          options.originPort, nonce, key,
+                          options.query[0] ? "?" : "", options.query,
+                          options.originPort);
+    if (*fd < 0) {
+        *fd = connect_local(options.proxyPort);
+        if (*fd < 0) {
+            worker->errors++;
+            return 0;
+        }
+    }
+    int keepAlive = 1, bodyStart;
+    long body = exchange(*fd, request, length, buffer, &bodyStart, &keepAlive);
+    if (body < 0 || !keepAlive) {
+        close(*fd);
+        *fd = -1;
+    }
+    if (body < 0) {
+        worker->errors++;
+        return 0;
+    }
+    return 1;
+}
+
+// request keys until the deadline, recording each latency
+static void *run_worker(void *arg) {
+    loadWorker_t *worker = arg;
+    int fd = -1;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    while (now.tv_sec < deadline.tv_sec ||
+           (now.tv_sec == deadline.tv_sec && now.tv_nsec < deadline.tv_nsec)) {
+        struct timespec sent = now;
+        int ok = request_key(worker, &fd, pick_key(worker));
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if (!ok) {
+            continue;
+        }
+        if (worker->nSamples == worker->maxSamples) {
+            worker->maxSamples *= 2;
+            worker->samples =
+                realloc(worker->samples, worker->maxSamples * sizeof(long));
+            if (!worker->samples) {
+                perror("Error: Cannot record latencies\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        worker->samples[worker->nSamples++] = elapsed_ns(&sent, &now);
+    }
+    if (fd >= 0) {
+        close(fd);
+    }
+    return NULL;
+}
+
+// objects the origin stub has served so far, -1 if it cannot be asked
+static long origin_served(void) {
+    int fd = connect_local(options.originPort);
+    if (fd < 0) {
+        return -1;
+    }
+    char request[REQUEST_LINE], *buffer = malloc(RESPONSE_BUFFER);
+    if (!buffer) {
+        perror("Error: Cannot allocate response buffer\n");
+        exit(EXIT_FAILURE);
+    }
+    int length = sprintf(request, "GET /stats HTTP/1.1\r\nHost: 127.0.0.1\r\n"
+                                  "Connection: close\r\n\r\n");
+    int keepAlive = 1, bodyStart;
+    long body = exchange(fd, request, length, buffer, &bodyStart, &keepAlive);
+    long count = -1;
+    if (body > 0 && bodyStart + body <= RESPONSE_BUFFER) {
+        count = http_to_long(buffer + bodyStart, body);
+    }
+    free(buffer);
+    close(fd);
+    return count;
+}
+
+static int compare_longs(const void *a, const void *b) {
+    long x = *(const long *)a, y = *(const long *)b;
+    return (x > y) - (x < y);
+}
+
+/*****************************************************************************/
+static void get_options(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            options.label = argv[++i];
+        } else if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            options.proxyPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-o") == 0 && i + 1 < argc) {
+            options.originPort = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            options.connections = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-d") == 0 && i + 1 < argc) {
+            options.seconds = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            options.keys = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-s") == 0 && i + 1 < argc) {
+            options.exponent = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-q") == 0 && i + 1 < argc) {
+            options.query = argv[++i];
+        } else if (strcmp(argv[i], "-w") == 0) {
+            options.warm = 1;
+        } else if (strcmp(argv[i], "-u") == 0) {
+            options.unique = 1;
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [-l label] [-p proxy port] [-o origin port] "
+                    "[-c conns] [-d secs] [-k keys] [-s zipf exponent] "
+                    "[-q query] [-w] [-u]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    if (options.connections < 1 || options.seconds < 1 || options.keys < 1) {
+        fprintf(stderr, "Error: -c, -d and -k must be positive\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+int main(int argc, char **argv) {
+    get_options(argc, argv);
+    build_zipf();
+    struct timespec start;
+    clock_gettime(CLOCK_REALTIME, &start);
+    nonce = start.tv_sec * 1000 + start.tv_nsec / 1000000;
+
+    loadWorker_t *workers = calloc(options.connections, sizeof(loadWorker_t));
+    if (!workers) {
+        perror("Error: Cannot allocate workers\n");
+        exit(EXIT_FAILURE);
+    }
+    for (int i = 0; i < options.connections; i++) {
+        loadWorker_t *worker = &workers[i];
+        worker->random = (nonce + 1) * 0x9E3779B97F4A7C15ULL + i;
+        worker->maxSamples = INITIAL_SAMPLES;
+        worker->samples = malloc(worker->maxSamples * sizeof(long));
+        if (!worker->samples) {
+            perror("Error: Cannot record latencies\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    // request every key once so the measured run starts from a warm cache
+    if (options.warm && !options.unique) {
+        int fd = -1;
+        for (long key = 0; key < options.keys; key++) {
+            request_key(&workers[0], &fd, key);
+        }
+        if (fd >= 0) {
+            close(fd);
+        }
+        workers[0].errors = 0;
+    }
+
+    long servedBefore = origin_served();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    deadline = start;
+    deadline.tv_sec += options.seconds;
+    for (int i = 0; i < options.connections; i++) {
+        if (pthread_create(&workers[i].thread, NULL, run_worker,
+                           &workers[i]) != 0) {
+            perror("Error: Cannot start load worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    long total = 0;
+    unsigned long errors = 0;
+    for (int i = 0; i < options.connections; i++) {
+        pthread_join(workers[i].thread, NULL);
+        total += workers[i].nSamples;
+        errors += workers[i].errors;
+    }
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    long servedAfter = origin_served();
+
+    long *samples = malloc((total ? total : 1) * sizeof(long));
+    if (!samples) {
+        perror("Error: Cannot sort latencies\n");
+        exit(EXIT_FAILURE);
+    }
+    long count = 0;
+    for (int i = 0; i < options.connections; i++) {
+        memcpy(samples + count, workers[i].samples,
+               workers[i].nSamples * sizeof(long));
+        count += workers[i].nSamples;
+    }
+    qsort(samples, total, sizeof(long), compare_longs);
+
+    double seconds = elapsed_ns(&start, &end) / 1e9;
+    printf("%-8s %9.0f req/s", options.label, total / seconds);
+    if (total > 0) {
+        printf("  p50 %8.3f ms  p99 %8.3f ms  p999 %8.3f ms",
+               samples[(long)(total * 0.50)] / 1e6,
+               samples[(long)(total * 0.99)] / 1e6,
+               samples[(long)(total * 0.999)] / 1e6);
+    }
+    if (total > 0 && servedBefore >= 0 && servedAfter >= 0) {
+        long misses = servedAfter - servedBefore;
+        misses = (misses < total) ? misses : total;
+        printf("  hit ratio %5.1f%%", 100.0 * (total - misses) / total);
+    }
+    printf("  errors %lu\n", errors);
+    fflush(stdout);
+    return 0;
+}
@@ -0,0 +1,239 @@
+/*
+Origin server stub for benchmarking the proxy on localhost. Every path is an
+object; its size, the delay before answering and its Cache-Control come from
+the command line and can be overridden per request with ?size=, &delay= (ms)
+and &cc= (where '_' stands for '='). GET /stats answers with the number of
+objects served so far, so a load generator can tell hits from misses.
+Usage: benchorigin [-p port] [-b bytes] [-l ms] [-c cache-control]
+*/
+
+#define _GNU_SOURCE
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "httpParser.h"
+
+#define DEFAULT_PORT 9000
+#define DEFAULT_OBJECT_SIZE 1024
+#define DEFAULT_CACHE_CONTROL "max-age=3600"
+#define MAX_OBJECT_SIZE (64 << 20)
+#define REQUEST_BUFFER 8192
+#define MAX_CACHE_CONTROL 128
+#define STATS_PATH "/stats"
+
+// defaults for every object, from the command line
+typedef struct originOptions originOptions_t;
+struct originOptions {
+    int port;
+    long objectSize;
+    long delayMs;
+    const char *cacheControl;
+};
+
+static originOptions_t options = {.port = DEFAULT_PORT,
+                                  .objectSize = DEFAULT_OBJECT_SIZE,
+                                  .delayMs = 0,
+                                  .cacheControl = DEFAULT_CACHE_CONTROL};
+// every body is a prefix of this
+static char *objectBytes;
+static atomic_ulong served;
+
+/*****************************************************************************/
+// send all of a buffer, returning 0 if the client went away
+static int send_all(int fd, const char *data, long length) {
+    while (length > 0) {
+        ssize_t sent = send(fd, data, length, MSG_NOSIGNAL);
+        if (sent <= 0) {
+            return 0;
+        }
+        data += sent;
+        length -= sent;
+    }
+    return 1;
+}
+
+// value of query parameter name in the request line's target, copied into
+// value; returns 0 if it is absent
+static int query_value(const char *target, int length, const char *name,
+                       char *value, int size) {
+    const char *query = memchr(target, '?', length);
+    int nameLength = strlen(name);
+    while (query && query < target + length) {
+        query++;
+        const char *end = memchr(query, '&', target + length - query);
+        end = end ? end : target + length;
+        if (end - query > nameLength && query[nameLength] == '=' &&
+            strncmp(query, name, nameLength) == 0) {
+            int copy = end - query - nameLength - 1;
+            copy = (copy < size - 1) ? copy : size - 1;
+            memcpy(value, query + nameLength + 1, copy);
+            value[copy] = '\0';
+            return 1;
+        }
+        query = (end < target + length) ? end : NULL;
+    }
+    return 0;
+}
+
+// answer one request whose start line is line
+static int answer(int fd, const char *line, int length) {
+    const char *target = memchr(line, ' ', length);
+    if (!target) {
+        return 0;
+    }
+    target++;
+    const char *targetEnd = memchr(target, ' ', line + length - target);
+    int targetLength = targetEnd ? targetEnd - target : line + length - target;
+    // requests through a proxy name the origin in an absolute target
+    const char *path = target;
+    if (targetLength > 7 && strncmp(target, "http://", 7) == 0) {
+        path = memchr(target + 7, '/', targetLength - 7);
+        path = path ? path : target + targetLength;
+    }
+    int pathLength = target + targetLength - path;
+
+    char header[256 + MAX_CACHE_CONTROL];
+    if (pathLength >= (int)strlen(STATS_PATH) &&
+        strncmp(path, STATS_PATH, strlen(STATS_PATH)) == 0) {
+        char body[32];
+        int bodyLength = sprintf(body, "%lu\n", atomic_load(&served));
+        int headerLength = sprintf(header,
+                                   "HTTP/1.1 200 OK\r\nContent-Length: %d\r\n"
+                                   "Cache-Control: no-store\r\n\r\n",
+                                   bodyLength);
+        return send_all(fd, header, headerLength) &&
+               send_all(fd, body, bodyLength);
+    }
+
+    char value[MAX_CACHE_CONTROL];
+    long size = options.objectSize, delayMs = options.delayMs;
+    char cacheControl[MAX_CACHE_CONTROL];
+    snprintf(cacheControl, sizeof(cacheControl), "%s", options.cacheControl);
+    if (query_value(path, pathLength, "size", value, sizeof(value))) {
+        size = atol(value);
+    }
+    if (query_value(path, pathLength, "delay", value, sizeof(value))) {
+        delayMs = atol(value);
+    }
+    if (query_value(path, pathLength, "cc", cacheControl,
+                    sizeof(cacheControl))) {
+        for (char *c = cacheControl; *c; c++) {
+            *c = (*c == '_') ? '=' : *c;
+        }
+    }
+    size = (size < 0) ? 0 : (size > MAX_OBJECT_SIZE) ? MAX_OBJECT_SIZE : size;
+    if (delayMs > 0) {
+        struct timespec delay = {.tv_sec = delayMs / 1000,
+                                 .tv_nsec = (delayMs % 1000) * 1000000};
+        nanosleep(&delay, NULL);
+    }
+    atomic_fetch_add(&served, 1);
+    int headerLength = sprintf(header,
+                               "HTTP/1.1 200 OK\r\nContent-Length: %ld\r\n"
+                               "Content-Type: application/octet-stream\r\n"
+                               "Cache-Control: %s\r\n\r\n",
+                               size, cacheControl);
+    return send_all(fd, header, headerLength) &&
+           send_all(fd, objectBytes, size);
+}
+
+// serve one keep-alive client connection until it closes
+static void *serve_client(void *arg) {
+    int fd = (int)(long)arg;
+    char buffer[REQUEST_BUFFER];
+    int length = 0;
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    while (1) {
+        int headerEnd = feed_http_parser(&parser, buffer, length);
+        if (headerEnd > 0) {
+            if (!answer(fd, buffer, parser.startLineLength)) {
+                break;
+            }
+            // pipelined bytes start the next request
+            memmove(buffer, buffer + headerEnd, length - headerEnd);
+            length -= headerEnd;
+            reset_http_parser(&parser);
+            continue;
+        }
+        if (length == REQUEST_BUFFER) {
+            break;
+        }
+        ssize_t got = recv(fd, buffer + length, REQUEST_BUFFER - length, 0);
+        if (got <= 0) {
+            break;
+        }
+        length += got;
+    }
+    close(fd);
+    return NULL;
+}
+
+/*****************************************************************************/
+int main(int argc, char **argv) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            options.port = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-b") == 0 && i + 1 < argc) {
+            options.objectSize = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-l") == 0 && i + 1 < argc) {
+            options.delayMs = atol(argv[++i]);
+        } else if (strcmp(argv[i], "-c") == 0 && i + 1 < argc) {
+            options.cacheControl = argv[++i];
+        } else {
+            fprintf(stderr,
+                    "Usage: %s [-p port] [-b bytes] [-l ms] "
+                    "[-c cache-control]\n",
+                    argv[0]);
+            exit(EXIT_FAILURE);
+        }
+    }
+    objectBytes = malloc(MAX_OBJECT_SIZE);
+    if (!objectBytes) {
+        perror("Error: Cannot allocate objects\n");
+        exit(EXIT_FAILURE);
+    }
+    memset(objectBytes, 'x', MAX_OBJECT_SIZE);
+    signal(SIGPIPE, SIG_IGN);
+
+    int listenfd = socket(AF_INET, SOCK_STREAM, 0), enable = 1;
+    struct sockaddr_in address = {.sin_family = AF_INET,
+                                  .sin_port = htons(options.port),
+                                  .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    if (listenfd < 0 ||
+        setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &enable,
+                   sizeof(enable)) < 0 ||
+        bind(listenfd, (struct sockaddr *)&address, sizeof(address)) < 0 ||
+        listen(listenfd, SOMAXCONN) < 0) {
+        perror("Error: Cannot listen\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // one detached thread per client connection
+    pthread_attr_t detached;
+    pthread_attr_init(&detached);
+    pthread_attr_setdetachstate(&detached, PTHREAD_CREATE_DETACHED);
+    while (1) {
+        int clientfd = accept(listenfd, NULL, NULL);
+        if (clientfd < 0) {
+            continue;
+        }
+        setsockopt(clientfd, IPPROTO_TCP, TCP_NODELAY, &enable,
+                   sizeof(enable));
+        pthread_t thread;
+        if (pthread_create(&thread, &detached, serve_client,
+                           (void *)(long)clientfd) != 0) {
+            close(clientfd);
+        }
+    }
+    return 0;
+}
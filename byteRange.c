@@ -0,0 +1,258 @@
+/*
+Byte ranges served from cached objects. A Range header is parsed into at
+most MAX_RANGES ranges, which are resolved against the length of a stored
+200 once it is known and turned into a plan: a 206 header followed by the
+stored bytes of one range, or a multipart/byteranges body whose part
+headers are kept in the plan's text, or a 416 when none of them can be
+satisfied. The event loop sends the plan's pieces in order, from the cache
+or from a fetch of the whole object as it arrives.
+*/
+
+#define _DEFAULT_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "byteRange.h"
+#include "memPool.h"
+#include "sockets.h"
+
+#define RANGE_UNIT "bytes="
+#define CONTENT_LENGTH "Content-Length"
+#define CONTENT_TYPE "Content-Type"
+#define CONTENT_RANGE "Content-Range"
+#define PARTIAL_CONTENT "HTTP/1.1 206 Partial Content"
+#define NOT_SATISFIABLE                                                        \
+    "HTTP/1.1 416 Range Not Satisfiable\r\nContent-Range: bytes */%ld\r\n"     \
+    "Content-Length: 0\r\n\r\n"
+// room for the header lines added to a 206, and for one part's header
+// besides its Content-Type
+#define RANGE_HEADER 160
+#define PART_HEADER 128
+
+/*****************************************************************************/
+// skip blanks in value from *at
+static void skip_blanks(const char *value, int length, int *at) {
+    while (*at < length && (value[*at] == ' ' || value[*at] == '\t')) {
+        (*at)++;
+    }
+}
+
+// the number starting at *at, moving past it; -1 if there are no digits
+// and LONG_MAX if it is larger than that
+static long read_number(const char *value, int length, int *at) {
+    long number = -1;
+    while (*at < length && value[*at] >= '0' && value[*at] <= '9') {
+        int digit = value[(*at)++] - '0';
+        if (number < 0) {
+            number = 0;
+        }
+        number = (number > (LONG_MAX - digit) / 10) ? LONG_MAX
+                                                     : number * 10 + digit;
+    }
+    return number;
+}
+
+// the ranges of a Range header value, 0 if it is not a bytes range set
+// of at most MAX_RANGES ranges
+int parse_ranges(const char *value, int length, byteRange_t *ranges) {
+    int at = 0, count = 0;
+    skip_blanks(value, length, &at);
+    int unit = strlen(RANGE_UNIT);
+    if (length - at < unit || strncasecmp(value + at, RANGE_UNIT, unit) != 0) {
+        return 0;
+    }
+    at += unit;
+    while (1) {
+        skip_blanks(value, length, &at);
+        long first = read_number(value, length, &at);
+        skip_blanks(value, length, &at);
+        if (at == length || value[at++] != '-') {
+            return 0;
+        }
+        skip_blanks(value, length, &at);
+        long last = read_number(value, length, &at);
+        if ((first < 0 && last < 0) || (first >= 0 && last >= 0 &&
+                                        last < first) ||
+            count == MAX_RANGES) {
+            return 0;
+        }
+        ranges[count].first = first;
+        ranges[count++].last = last;
+        skip_blanks(value, length, &at);
+        if (at == length) {
+            return count;
+        }
+        if (value[at++] != ',') {
+            return 0;
+        }
+    }
+}
+
+// true if an If-Range value still names entry: its strong ETag or its
+// exact Last-Modified date
+int if_range_matches(cacheEntry_t *entry, const char *value, int length) {
+    if (length > 0 && (value[0] == '"' || value[0] == 'W')) {
+        return entry->etagLength == length && value[0] == '"' &&
+               memcmp(entry->response + entry->etag, value, length) == 0;
+    }
+    return entry->lastModifiedLength == length && length > 0 &&
+           memcmp(entry->response + entry->lastModified, value, length) == 0;
+}
+
+/*****************************************************************************/
+// the ranges that overlap a body of size bytes, clipped to it
+static int resolve_ranges(byteRange_t *ranges, int nRanges, long size,
+                          byteRange_t *resolved) {
+    int count = 0;
+    for (int i = 0; i < nRanges; i++) {
+        long first = ranges[i].first, last = ranges[i].last;
+        if (first < 0) {
+            if (last == 0) {
+                continue;
+            }
+            first = (size > last) ? size - last : 0;
+            last = size - 1;
+        } else if (last < 0 || last >= size) {
+            last = size - 1;
+        }
+        if (first >= size) {
+            continue;
+        }
+        resolved[count].first = first;
+        resolved[count++].last = last;
+    }
+    return count;
+}
+
+// add a piece to a plan
+static void add_piece(rangePlan_t *plan, long offset, long length,
+                      int stored) {
+    rangePiece_t *piece = &plan->pieces[plan->nPieces++];
+    piece->offset = offset;
+    piece->length = length;
+    piece->stored = stored;
+}
+
+// the part headers and closing boundary of a multipart/byteranges body,
+// one after another in a pooled buffer; offsets[i] is where part i's
+// header starts and offsets[count] where the closing boundary does
+static char *write_parts(byteRange_t *ranges, int count, long size,
+                         const char *boundary, const char *type,
+                         int typeLength, int *offsets, int *length) {
+    char *parts = pool_alloc(count * (PART_HEADER + typeLength) +
+                             PART_HEADER);
+    int used = 0;
+    for (int i = 0; i < count; i++) {
+        offsets[i] = used;
+        used += sprintf(parts + used, "%s--%s\r\n", i ? "\r\n" : "",
+                        boundary);
+        if (type) {
+            used += sprintf(parts + used, "%s: %.*s\r\n", CONTENT_TYPE,
+                            typeLength, type);
+        }
+        used += sprintf(parts + used, "%s: bytes %ld-%ld/%ld\r\n\r\n",
+                        CONTENT_RANGE, ranges[i].first, ranges[i].last, size);
+    }
+    offsets[count] = used;
+    used += sprintf(parts + used, "\r\n--%s--\r\n", boundary);
+    *length = used;
+    return parts;
+}
+
+// plan the response to ranges of entry's stored 200; returns 0 if the
+// entry is not one ranges can be served from
+int plan_ranges(cacheEntry_t *entry, byteRange_t *ranges, int nRanges,
+                rangePlan_t *plan) {
+    long headerBytes = entry->responseHeaderLength + strlen(EMPTY_LINE);
+    long size = entry->responseContentLength;
+    if (entry->statusCode != 200 || !entry->hasContentLength ||
+        entry->isChunked) {
+        return 0;
+    }
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    if (feed_http_parser(&parser, entry->response, headerBytes) <= 0 ||
+        parser.overflowed) {
+        return 0;
+    }
+    plan->nPieces = 0;
+
+    byteRange_t resolved[MAX_RANGES];
+    int count = resolve_ranges(ranges, nRanges, size, resolved);
+    if (count == 0) {
+        plan->text = pool_alloc(sizeof(NOT_SATISFIABLE) + 20);
+        add_piece(plan, 0, sprintf(plan->text, NOT_SATISFIABLE, size), 0);
+        plan->statusCode = 416;
+        return 1;
+    }
+    plan->statusCode = 206;
+
+    char extra[RANGE_HEADER];
+    int headerLength;
+    if (count == 1) {
+        long first = resolved[0].first, last = resolved[0].last;
+        snprintf(extra, sizeof(extra),
+                 "%s: bytes %ld-%ld/%ld\r\n%s: %ld\r\n", CONTENT_RANGE, first,
+                 last, size, CONTENT_LENGTH, last - first + 1);
+        const char *drop[] = {CONTENT_LENGTH, CONTENT_RANGE, NULL};
+        plan->text = rewrite_header(entry->response, &parser,
+                                    PARTIAL_CONTENT, drop, extra,
+                                    &headerLength);
+        add_piece(plan, 0, headerLength, 0);
+        add_piece(plan, headerBytes + first, last - first + 1, 1);
+        return 1;
+    }
+
+    // each part says what the whole object's Content-Type was
+    const char *type = NULL;
+    int typeLength = 0;
+    for (int i = 0; i < parser.nHeaders; i++) {
+        if (http_header_is(entry->response, &parser.headers[i],
+                           CONTENT_TYPE)) {
+            type = entry->response + parser.headers[i].value;
+            typeLength = parser.headers[i].valueLength;
+        }
+    }
+    char boundary[32];
+    snprintf(boundary, sizeof(boundary), "htproxy-%016lx", entry->hash);
+    int offsets[MAX_RANGES + 1], partsLength;
+    char *parts = write_parts(resolved, count, size, boundary, type,
+                              typeLength, offsets, &partsLength);
+    long total = partsLength;
+    for (int i = 0; i < count; i++) {
+        total += resolved[i].last - resolved[i].first + 1;
+    }
+    snprintf(extra, sizeof(extra),
+             "%s: multipart/byteranges; boundary=%s\r\n%s: %ld\r\n",
+             CONTENT_TYPE, boundary, CONTENT_LENGTH, total);
+    const char *drop[] = {CONTENT_LENGTH, CONTENT_RANGE, CONTENT_TYPE, NULL};
+    char *header = rewrite_header(entry->response, &parser, PARTIAL_CONTENT,
+                                  drop, extra, &headerLength);
+    plan->text = pool_alloc(headerLength + partsLength);
+    memcpy(plan->text, header, headerLength);
+    memcpy(plan->text + headerLength, parts, partsLength);
+    pool_free(header);
+    pool_free(parts);
+
+    add_piece(plan, 0, headerLength, 0);
+    for (int i = 0; i < count; i++) {
+        add_piece(plan, headerLength + offsets[i], offsets[i + 1] - offsets[i],
+                  0);
+        add_piece(plan, headerBytes + resolved[i].first,
+                  resolved[i].last - resolved[i].first + 1, 1);
+    }
+    add_piece(plan, headerLength + offsets[count], partsLength - offsets[count],
+              0);
+    return 1;
+}
+
+// forget a plan, returning its text to the pool
+void free_range_plan(rangePlan_t *plan) {
+    pool_free(plan->text);
+    plan->text = NULL;
+    plan->nPieces = 0;
+}
+
+/*****************************************************************************/
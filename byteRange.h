@@ -0,0 +1,50 @@
+#ifndef BYTERANGE
+#define BYTERANGE
+
+#include "dataStruct.h"
+
+// ranges served from one request; a Range asking for more is ignored and
+// the whole object sent
+#define MAX_RANGES 8
+
+// one range of a Range header: first -1 asks for the last `last` bytes,
+// last -1 for everything from first on
+typedef struct byteRange byteRange_t;
+struct byteRange {
+    long first;
+    long last;
+};
+
+// a part of a range response: bytes of the plan's own text, or bytes of
+// the stored response
+typedef struct rangePiece rangePiece_t;
+struct rangePiece {
+    long offset;
+    long length;
+    int stored;
+};
+
+// what a range request is sent in place of the stored response: a 206 (or
+// 416) header and, for several ranges, the multipart headers around each
+typedef struct rangePlan rangePlan_t;
+struct rangePlan {
+    char *text;
+    rangePiece_t pieces[2 * MAX_RANGES + 2];
+    int nPieces;
+    int statusCode;
+};
+
+// the ranges of a Range header value, 0 if it is not a bytes range set
+// of at most MAX_RANGES ranges
+int parse_ranges(const char *value, int length, byteRange_t *ranges);
+// true if an If-Range value still names entry: its strong ETag or its
+// exact Last-Modified date
+int if_range_matches(cacheEntry_t *entry, const char *value, int length);
+// plan the response to ranges of entry's stored 200; returns 0 if the
+// entry is not one ranges can be served from
+int plan_ranges(cacheEntry_t *entry, byteRange_t *ranges, int nRanges,
+                rangePlan_t *plan);
+// forget a plan, returning its text to the pool
+void free_range_plan(rangePlan_t *plan);
+
+#endif
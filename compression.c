@@ -0,0 +1,338 @@
+/*
+Compressed storage. With -g, a complete text response is gzipped as it is
+cached, its header rewritten to say so, and it is served as stored to
+clients whose Accept-Encoding takes gzip. Every other client gets a copy
+inflated for it on the way out, so one stored representation covers both
+sides of Vary: Accept-Encoding. Its strong ETag is made weak, as the two
+encodings differ byte for byte. Bodies the origin gzipped itself are
+inflated the same way.
+*/
+
+#define _XOPEN_SOURCE 500
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include "compression.h"
+#include "memPool.h"
+#include "sockets.h"
+
+#define CONTENT_LENGTH "Content-Length"
+#define CONTENT_ENCODING "Content-Encoding"
+#define CONTENT_TYPE "Content-Type"
+#define CACHE_CONTROL "Cache-Control"
+#define VARY "Vary"
+#define ACCEPT_ENCODING "Accept-Encoding"
+#define ETAG "ETag"
+// window bits asking zlib for a gzip wrapper rather than a zlib one
+#define GZIP_WINDOW_BITS (15 + 16)
+// room for the header lines added to a rewritten header
+#define EXTRA_HEADER 128
+
+/*****************************************************************************/
+// true if the value of a request's Accept-Encoding takes gzip, that is
+// names it without a q of 0
+int accepts_gzip(const char *value, int length) {
+    int offset = http_find(value, length, "gzip");
+    if (offset < 0) {
+        return 0;
+    }
+    const char *rest = value + offset;
+    int restLength = length - offset;
+    int comma = http_find(rest, restLength, ",");
+    int quality = http_find(rest, restLength, "q=");
+    if (quality < 0 || (comma > -1 && comma < quality)) {
+        return 1;
+    }
+    for (int i = quality + 2; i < restLength && rest[i] != ','; i++) {
+        if (rest[i] >= '1' && rest[i] <= '9') {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// true if a Content-Type is text that compresses well
+static int is_text_type(const char *value, int length) {
+    const char *types[] = {"text/", "json", "javascript", "xml"};
+    for (size_t i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+        if (http_find(value, length, types[i]) > -1) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// return a list of segments to the pool
+static void free_segments(responseSegment_t *segment) {
+    while (segment) {
+        responseSegment_t *next = segment->next;
+        pool_free(segment);
+        segment = next;
+    }
+}
+
+/*****************************************************************************/
+// the next run of from's stored body at offset: the rest of the first
+// block, then one segment at a time, or what a memfd body holds read into
+// scratch. Sets data and returns its length, 0 if nothing is left.
+static long next_run(cacheEntry_t *from, long offset, long bodyEnd,
+                     responseSegment_t **source, char *scratch,
+                     const char **data) {
+    long blockEnd = (from->blockLength < bodyEnd) ? from->blockLength : bodyEnd;
+    long left = bodyEnd - offset;
+    if (offset < blockEnd) {
+        *data = from->response + offset;
+        return blockEnd - offset;
+    }
+    if (from->bodyFd >= 0 && left > 0) {
+        ssize_t got = pread(from->bodyFd, scratch,
+                            (left < SEGMENT_DATA) ? left : SEGMENT_DATA,
+                            offset - from->blockLength);
+        *data = scratch;
+        return (got > 0) ? got : 0;
+    }
+    if (*source && left > 0) {
+        *data = (*source)->data;
+        long length = ((*source)->length < left) ? (*source)->length : left;
+        *source = (*source)->next;
+        return length;
+    }
+    return 0;
+}
+
+// run the stored body of from through a deflate or inflate stream into the
+// segments of to. Returns 0 if the stream failed, its input ended early, or
+// it produced more than limit bytes.
+static int transcode_body(z_stream *stream, int deflating, cacheEntry_t *from,
+                          cacheEntry_t *to, long limit) {
+    long headerBytes = from->responseHeaderLength + strlen(EMPTY_LINE);
+    long bodyEnd = headerBytes + from->responseContentLength;
+    responseSegment_t *source = from->segments;
+    char *scratch = (from->bodyFd >= 0) ? pool_alloc(SEGMENT_DATA) : NULL;
+    long offset = headerBytes;
+    int result = Z_OK;
+    while (result == Z_OK) {
+        const char *data = NULL;
+        long length =
+            next_run(from, offset, bodyEnd, &source, scratch, &data);
+        offset += length;
+        int last = offset >= bodyEnd;
+        if (length == 0 && !last) {
+            break;
+        }
+        stream->next_in = (Bytef *)data;
+        stream->avail_in = length;
+        do {
+            responseSegment_t *segment = writable_segment(to);
+            int room = SEGMENT_DATA - segment->length;
+            stream->next_out = (Bytef *)segment->data + segment->length;
+            stream->avail_out = room;
+            result = deflating
+                         ? deflate(stream, last ? Z_FINISH : Z_NO_FLUSH)
+                         : inflate(stream, Z_NO_FLUSH);
+            int produced = room - stream->avail_out;
+            segment->length += produced;
+            to->segmentBytes += produced;
+            if (to->segmentBytes > limit) {
+                result = Z_BUF_ERROR;
+            }
+        } while (result == Z_OK && stream->avail_out == 0);
+        if (last) {
+            break;
+        }
+    }
+    pool_free(scratch);
+    // the last pass may have found nothing more to write
+    responseSegment_t **link = &to->segments;
+    while (*link && *link != to->lastSegment) {
+        link = &(*link)->next;
+    }
+    if (*link && (*link)->length == 0) {
+        pool_free(*link);
+        *link = NULL;
+        to->lastSegment = NULL;
+        for (responseSegment_t *curr = to->segments; curr; curr = curr->next) {
+            to->lastSegment = curr;
+        }
+    }
+    return result == Z_STREAM_END;
+}
+
+// make header the entry's first block, ahead of the segments it already
+// has, and take framing and validators from it again
+static void set_header(cacheEntry_t *entry, char *header, int length) {
+    pool_free(entry->response);
+    entry->response = header;
+    entry->blockLength = length;
+    entry->responseHeaderLength = length - strlen(EMPTY_LINE);
+    entry->responseTotalBytes = length + entry->segmentBytes;
+    entry->isEncoded = entry->isGzip = 0;
+    entry->etagLength = entry->lastModifiedLength = 0;
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    feed_http_parser(&parser, header, length);
+    extract_headers(entry, &parser, 0);
+}
+
+/*****************************************************************************/
+// replace the stored body of a complete text response about to be cached
+// with its gzip at level, rewriting the header to match; returns 1 if it
+// was compressed. Bodies that shrink by less than a tenth are left alone.
+// Nothing else may be reading the entry.
+int compress_entry(cacheEntry_t *entry, int level) {
+    long headerBytes = entry->responseHeaderLength + strlen(EMPTY_LINE);
+    if (level <= 0 || entry->statusCode != 200 || !entry->hasContentLength ||
+        entry->isChunked || entry->isEncoded ||
+        entry->responseContentLength < GZIP_MIN_BODY ||
+        entry->responseContentLength > GZIP_MAX_BODY ||
+        entry->responseTotalBytes !=
+            headerBytes + entry->responseContentLength) {
+        return 0;
+    }
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    if (feed_http_parser(&parser, entry->response, headerBytes) <= 0 ||
+        parser.overflowed) {
+        return 0;
+    }
+    int isText = 0, varies = 0;
+    httpHeader_t *etag = NULL;
+    for (int i = 0; i < parser.nHeaders; i++) {
+        httpHeader_t *header = &parser.headers[i];
+        const char *value = entry->response + header->value;
+        if (http_header_is(entry->response, header, CONTENT_TYPE)) {
+            isText = is_text_type(value, header->valueLength);
+        } else if (http_header_is(entry->response, header, VARY)) {
+            varies |= http_find(value, header->valueLength,
+                                ACCEPT_ENCODING) > -1;
+        } else if (http_header_is(entry->response, header, ETAG) &&
+                   header->valueLength > 0 && value[0] == '"') {
+            etag = header;
+        } else if (http_header_is(entry->response, header, CACHE_CONTROL) &&
+                   http_find(value, header->valueLength, "no-transform") >
+                       -1) {
+            return 0;
+        }
+    }
+    if (!isText) {
+        return 0;
+    }
+
+    z_stream stream = {0};
+    if (deflateInit2(&stream, level, Z_DEFLATED, GZIP_WINDOW_BITS, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+        return 0;
+    }
+    cacheEntry_t *packed = create_cache_entry();
+    int done = transcode_body(&stream, 1, entry, packed,
+                              entry->responseContentLength / 10 * 9);
+    deflateEnd(&stream);
+    if (!done) {
+        release_cache_entry(packed);
+        return 0;
+    }
+
+    // the gzip and the identity bytes inflated from it are the same
+    // resource but not the same octets, so they may only share a weak ETag:
+    // If-Range never matches it, and If-None-Match compares weakly anyway
+    int etagLength = etag ? etag->valueLength : 0;
+    char *extra = pool_alloc(EXTRA_HEADER + etagLength);
+    int used = sprintf(extra, "%s: gzip\r\n%s: %ld\r\n%s", CONTENT_ENCODING,
+                       CONTENT_LENGTH, packed->segmentBytes,
+                       varies ? "" : VARY ": " ACCEPT_ENCODING "\r\n");
+    if (etag) {
+        sprintf(extra + used, "%s: W/%.*s\r\n", ETAG, etagLength,
+                entry->response + etag->value);
+    }
+    const char *drop[] = {CONTENT_LENGTH, etag ? ETAG : NULL, NULL};
+    int length;
+    char *header =
+        rewrite_header(entry->response, &parser, NULL, drop, extra, &length);
+    pool_free(extra);
+    // the gzip is small enough to keep in segments, even for a body that
+    // was teed into a memfd
+    free_segments(entry->segments);
+    if (entry->bodyFd >= 0) {
+        close(entry->bodyFd);
+        entry->bodyFd = -1;
+        entry->bodyLength = 0;
+    }
+    entry->segments = packed->segments;
+    entry->lastSegment = packed->lastSegment;
+    entry->segmentBytes = packed->segmentBytes;
+    packed->segments = packed->lastSegment = NULL;
+    release_cache_entry(packed);
+    set_header(entry, header, length);
+    return 1;
+}
+
+// true if a gzip entry's body inflates to at most GZIP_MAX_BODY bytes, as
+// the size in its gzip trailer (the last four bytes, little-endian) says.
+// A trailer split across segments is not looked for.
+int inflates_inline(cacheEntry_t *entry) {
+    long bodyEnd = entry->responseHeaderLength + strlen(EMPTY_LINE) +
+                   entry->responseContentLength;
+    unsigned char trailer[4];
+    if (!entry->hasContentLength || entry->responseContentLength < 4 ||
+        entry->responseTotalBytes != bodyEnd) {
+        return 0;
+    }
+    if (bodyEnd <= entry->blockLength) {
+        memcpy(trailer, entry->response + bodyEnd - 4, 4);
+    } else if (entry->bodyFd >= 0) {
+        if (pread(entry->bodyFd, trailer, 4,
+                  bodyEnd - 4 - entry->blockLength) != 4) {
+            return 0;
+        }
+    } else if (entry->lastSegment && entry->lastSegment->length >= 4) {
+        memcpy(trailer,
+               entry->lastSegment->data + entry->lastSegment->length - 4, 4);
+    } else {
+        return 0;
+    }
+    unsigned long size = trailer[0] | trailer[1] << 8 | trailer[2] << 16 |
+                         (unsigned long)trailer[3] << 24;
+    return size <= GZIP_MAX_BODY;
+}
+
+// a copy of a gzip entry with its body inflated, for a client that does
+// not take gzip, or NULL if its body cannot be inflated within limit bytes
+cacheEntry_t *inflate_entry(cacheEntry_t *entry, long limit) {
+    long headerBytes = entry->responseHeaderLength + strlen(EMPTY_LINE);
+    if (!entry->isGzip || !entry->hasContentLength || entry->isChunked ||
+        entry->responseTotalBytes <
+            headerBytes + entry->responseContentLength) {
+        return NULL;
+    }
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    if (feed_http_parser(&parser, entry->response, headerBytes) <= 0) {
+        return NULL;
+    }
+
+    z_stream stream = {0};
+    if (inflateInit2(&stream, GZIP_WINDOW_BITS) != Z_OK) {
+        return NULL;
+    }
+    cacheEntry_t *copy = create_cache_entry();
+    int done = transcode_body(&stream, 0, entry, copy, limit);
+    inflateEnd(&stream);
+    if (!done) {
+        release_cache_entry(copy);
+        return NULL;
+    }
+
+    char extra[EXTRA_HEADER];
+    snprintf(extra, sizeof(extra), "%s: %ld\r\n", CONTENT_LENGTH,
+             copy->segmentBytes);
+    const char *drop[] = {CONTENT_LENGTH, CONTENT_ENCODING, NULL};
+    int length;
+    char *header =
+        rewrite_header(entry->response, &parser, NULL, drop, extra, &length);
+    set_header(copy, header, length);
+    return copy;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,27 @@
+#ifndef COMPRESSION
+#define COMPRESSION
+
+#include "dataStruct.h"
+
+// gzip levels accepted by -g, 0 leaving bodies as the origin sent them
+#define MAX_GZIP_LEVEL 9
+// bodies smaller than this gain too little to be worth compressing
+#define GZIP_MIN_BODY 256
+// bodies are deflated and inflated on the worker's event loop, so ones
+// larger than this are stored and sent as the origin encoded them
+#define GZIP_MAX_BODY (4L << 20)
+
+// true if the value of a request's Accept-Encoding takes gzip
+int accepts_gzip(const char *value, int length);
+// replace the stored body of a complete text response about to be cached
+// with its gzip at level, rewriting the header to match; returns 1 if it
+// was compressed. Nothing else may be reading the entry.
+int compress_entry(cacheEntry_t *entry, int level);
+// true if a gzip entry's body inflates to at most GZIP_MAX_BODY bytes,
+// as its gzip trailer records
+int inflates_inline(cacheEntry_t *entry);
+// a copy of a gzip entry with its body inflated, for a client that does
+// not take gzip, or NULL if its body cannot be inflated within limit bytes
+cacheEntry_t *inflate_entry(cacheEntry_t *entry, long limit);
+
+#endif
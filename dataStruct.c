@@ -4,134 +4,695 @@ SEMESTER 1 2025.
 */
 
 #include <assert.h>
+#include <ctype.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #include "dataStruct.h"
+#include "diskTier.h"
+#include "logger.h"
+#include "memPool.h"
 
-#define CACHE_CAPACITY 10
-#define DEFAULT_HOST_PORT "80"
+#define CACHE_METHOD "GET"
+#define INITIAL_BUCKETS 64
+#define SHARDS_PER_WORKER 4
+#define MIN_SHARD_BYTES (4UL * MAX_RESPONSE_BUFFER)
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+// S3-FIFO keeps about a tenth of the budget for keys seen only recently
+#define S3FIFO_SMALL_PERCENT 10
+#define S3FIFO_MAX_FREQUENCY 3
+#define WHEEL_MASK (WHEEL_SLOTS - 1)
+#define WHEEL_SPAN (1L << (WHEEL_BITS * WHEEL_LEVELS))
+// entries reclaimed (or moved down the wheel) per shard per call, so one
+// pass never holds a shard lock for long
+#define EXPIRY_BATCH 256
+
+// seconds since the epoch, shared by every worker
+static _Atomic time_t cacheClock;
 
 /*****************************************************************************/
-// malloc and initialise a cache entry
+// get an initialised cache entry from the pool
 cacheEntry_t *create_cache_entry() {
-    cacheEntry_t *entry = calloc(1, sizeof(cacheEntry_t));
-    assert(entry);
-    entry->responseContentLength = 0;
-    entry->next = NULL;
+    cacheEntry_t *entry = pool_alloc(sizeof(cacheEntry_t));
+    *entry = (cacheEntry_t){0};
     entry->isCachable = 1;
-    entry->maxAge = 0;
-    entry->cachedTime = 0;
-    entry->isStalable = 0;
-    strcpy(entry->targetPort, DEFAULT_HOST_PORT);
-    memset(entry->path, 0, sizeof(entry->path));
-    memset(entry->host, 0, sizeof(entry->host));
-    memset(entry->request_lastLine, 0, sizeof(entry->request_lastLine));
-    memset(entry->request, 0, sizeof(entry->request));
-    memset(entry->response, 0, sizeof(entry->response));
+    entry->bodyFd = -1;
+    entry->refCount = 1;
     return entry;
 }
 
-// malloc and initialise a cache linked list
-cache_t *create_cache() {
+// return an entry and all of its buffers to the pool
+void free_cache_entry(cacheEntry_t *entry) {
+    if (!entry) {
+        return;
+    }
+    pool_free(entry->request);
+    pool_free(entry->strings);
+    pool_free(entry->response);
+    while (entry->segments) {
+        responseSegment_t *next = entry->segments->next;
+        pool_free(entry->segments);
+        entry->segments = next;
+    }
+    if (entry->bodyFd >= 0) {
+        close(entry->bodyFd);
+    }
+    pool_free(entry);
+}
+
+// take another reference on an entry so eviction cannot free it
+void hold_cache_entry(cacheEntry_t *entry) {
+    atomic_fetch_add(&entry->refCount, 1);
+}
+
+// drop a reference, freeing the entry once nobody holds it
+void release_cache_entry(cacheEntry_t *entry) {
+    if (entry && atomic_fetch_sub(&entry->refCount, 1) == 1) {
+        free_cache_entry(entry);
+    }
+}
+
+// malloc and initialise a cache holding at most maxBytes of entries
+cache_t *create_cache(size_t maxBytes, const cachePolicy_t *policy) {
     cache_t *cache = malloc(sizeof(cache_t));
     assert(cache);
-    cache->head = cache->tail = NULL;
+    memset(cache->queues, 0, sizeof(cache->queues));
+    cache->policy = policy;
+    cache->inflight = NULL;
     cache->count = 0;
+    cache->usedBytes = 0;
+    cache->maxBytes = maxBytes;
+    cache->evictions = 0;
+    memset(&cache->wheel, 0, sizeof(cache->wheel));
+    cache->wheel.current = cache_clock();
+    cache->expirations = 0;
+    cache->disk = NULL;
+    cache->nBuckets = INITIAL_BUCKETS;
+    cache->buckets = calloc(cache->nBuckets, sizeof(cacheEntry_t *));
+    cache->ghosts = calloc(cache->nBuckets, sizeof(unsigned long));
+    assert(cache->buckets && cache->ghosts);
+    pthread_mutex_init(&cache->lock, NULL);
+    return cache;
+}
+
+// split maxBytes over enough shards for the given number of workers, but
+// never so many that a shard cannot hold a few full-size responses
+shardedCache_t *create_sharded_cache(size_t maxBytes, int workers,
+                                     const cachePolicy_t *policy) {
+    shardedCache_t *cache = malloc(sizeof(shardedCache_t));
+    assert(cache);
+    cache->policy = policy;
+    cache->disk = NULL;
+    cache->nShards = 1;
+    tick_cache_clock();
+    if (workers > 1) {
+        while (cache->nShards < (unsigned long)workers * SHARDS_PER_WORKER) {
+            cache->nShards <<= 1;
+        }
+        while (cache->nShards > 1 &&
+               maxBytes / cache->nShards < MIN_SHARD_BYTES) {
+            cache->nShards >>= 1;
+        }
+    }
+    cache->shards = malloc(cache->nShards * sizeof(cache_t *));
+    assert(cache->shards);
+    for (unsigned long i = 0; i < cache->nShards; i++) {
+        cache->shards[i] = create_cache(maxBytes / cache->nShards, policy);
+    }
     return cache;
 }
 
+// shard responsible for an entry's key, picked from the high hash bits so
+// it stays independent of the bucket index inside the shard
+cache_t *cache_shard(shardedCache_t *cache, cacheEntry_t *entry) {
+    return cache->shards[(entry->hash >> 32) & (cache->nShards - 1)];
+}
+
+// free every shard
+void free_sharded_cache(shardedCache_t *cache) {
+    if (!cache) {
+        return;
+    }
+    for (unsigned long i = 0; i < cache->nShards; i++) {
+        free_cache(cache->shards[i]);
+    }
+    free(cache->shards);
+    free(cache);
+}
+
 // free all malloced spaces
 void free_cache(cache_t *cache) {
     if (!cache) {
         return;
     }
-    cacheEntry_t *curr = cache->head;
-    while (curr) {
-        curr = curr->next;
-        free(cache->head);
-        cache->head = curr;
+    for (int queue = 0; queue < NUM_QUEUES; queue++) {
+        cacheEntry_t *curr = cache->queues[queue].head;
+        while (curr) {
+            cacheEntry_t *next = curr->next;
+            release_cache_entry(curr);
+            curr = next;
+        }
     }
+    free(cache->buckets);
+    free(cache->ghosts);
+    pthread_mutex_destroy(&cache->lock);
     free(cache);
 }
 
+// parse a byte count such as 512M, 64K or 1G, 0 if malformed
+size_t parse_byte_size(const char *text) {
+    char *end;
+    unsigned long long value = strtoull(text, &end, 10);
+    switch (toupper((unsigned char)*end)) {
+    case 'G':
+        value <<= 10;
+        /* fall through */
+    case 'M':
+        value <<= 10;
+        /* fall through */
+    case 'K':
+        value <<= 10;
+        end++;
+        break;
+    }
+    if (end == text || *end != '\0') {
+        return 0;
+    }
+    return (size_t)value;
+}
+
+// last segment of an entry's response if it has room, otherwise a new one
+responseSegment_t *writable_segment(cacheEntry_t *entry) {
+    responseSegment_t *segment = entry->lastSegment;
+    if (segment && segment->length < SEGMENT_DATA) {
+        return segment;
+    }
+    segment = pool_alloc(RESPONSE_SEGMENT);
+    segment->next = NULL;
+    segment->length = 0;
+    if (entry->lastSegment) {
+        entry->lastSegment->next = segment;
+    } else {
+        entry->segments = segment;
+    }
+    entry->lastSegment = segment;
+    return segment;
+}
+
 /**************************************************************************/
-// least recently updated algorithm to update most recently accessed cache
-void perform_lru(cache_t *cache, cacheEntry_t *newEntry, cacheEntry_t *isStale,
-                 int *inCache) {
+// store host, port and path of a parsed request and build its cache key
+void set_cache_key(cacheEntry_t *entry, const char *host, int hostLength,
+                   const char *port, int portLength, const char *path,
+                   int pathLength) {
+    // host\0port\0path\0key\0 where key is "GET host:port path"
+    int methodLength = strlen(CACHE_METHOD);
+    int keyLength = methodLength + hostLength + portLength + pathLength + 3;
+    int total = 2 * (hostLength + portLength + pathLength) + methodLength + 7;
+    pool_free(entry->strings);
+    char *curr = entry->strings = pool_alloc(total);
 
-    if (!cache->head) {
-        return;
+    entry->host = curr;
+    memcpy(curr, host, hostLength);
+    curr[hostLength] = '\0';
+    curr += hostLength + 1;
+    entry->targetPort = curr;
+    memcpy(curr, port, portLength);
+    curr[portLength] = '\0';
+    curr += portLength + 1;
+    entry->path = curr;
+    memcpy(curr, path, pathLength);
+    curr[pathLength] = '\0';
+    curr += pathLength + 1;
+
+    entry->key = curr;
+    entry->keyLength = keyLength;
+    sprintf(curr, "%s %s:%s %s", CACHE_METHOD, entry->host, entry->targetPort,
+            entry->path);
+
+    // FNV-1a over the key bytes
+    entry->hash = FNV_OFFSET;
+    for (int i = 0; i < keyLength; i++) {
+        entry->hash ^= (unsigned char)entry->key[i];
+        entry->hash *= FNV_PRIME;
     }
-    cacheEntry_t *curr = cache->head;
-    cacheEntry_t *prev = NULL;
-    int staleCache = 0;
+}
+
+// true if two entries have the same cache key
+static int same_key(cacheEntry_t *a, cacheEntry_t *b) {
+    return a->hash == b->hash && a->keyLength == b->keyLength &&
+           memcmp(a->key, b->key, a->keyLength) == 0;
+}
 
-    // loop through cache linked list to find existing cached request
+// find the cached entry with the same key as newEntry, NULL if none
+cacheEntry_t *lookup_cache(cache_t *cache, cacheEntry_t *newEntry) {
+    if (!newEntry->key) {
+        return NULL;
+    }
+    cacheEntry_t *curr =
+        cache->buckets[newEntry->hash & (cache->nBuckets - 1)];
     while (curr) {
-        if (strcmp(curr->request, newEntry->request) == 0) {
-            // if cache is stale, enqueue this cache at the head
-            if (isStale) {
-                if (curr->next == NULL && curr != cache->head) {
-                    prev->next = NULL;
-                    cache->tail = prev;
-                } else if (curr != cache->head) {
-                    prev->next = curr->next;
-                    curr->next = cache->head;
-                    cache->head = curr;
-                }
-                staleCache = 1;
-
-            } else {
-                // if not stale, enqueue the matched cache at the tail
-                if (curr == cache->head) {
-                    cache->head = cache->head->next;
-                } else if (curr->next != NULL) {
-                    prev->next = curr->next;
-                }
-                *inCache = 1;
-                if (cache->tail != curr) {
-                    cache->tail->next = curr;
-                    cache->tail = curr;
-                    curr->next = NULL;
-                }
-                if (!cache->head) {
-                    cache->head = cache->tail;
-                }
+        if (same_key(curr, newEntry)) {
+            return curr;
+        }
+        curr = curr->hashNext;
+    }
+    return NULL;
+}
+
+// the entry being fetched for the same key as newEntry, NULL if none; only
+// a few fetches are in flight per shard, so a list is enough
+cacheEntry_t *lookup_inflight(cache_t *cache, cacheEntry_t *newEntry) {
+    if (!newEntry->key) {
+        return NULL;
+    }
+    for (cacheEntry_t *curr = cache->inflight; curr;
+         curr = curr->inflightNext) {
+        if (same_key(curr, newEntry)) {
+            return curr;
+        }
+    }
+    return NULL;
+}
+
+// let later requests for an entry's key coalesce onto its fetch
+void add_inflight(cache_t *cache, cacheEntry_t *entry) {
+    entry->inflightNext = cache->inflight;
+    cache->inflight = entry;
+}
+
+// stop coalescing requests onto an entry's fetch
+void remove_inflight(cache_t *cache, cacheEntry_t *entry) {
+    cacheEntry_t **link = &cache->inflight;
+    while (*link && *link != entry) {
+        link = &(*link)->inflightNext;
+    }
+    if (*link) {
+        *link = entry->inflightNext;
+    }
+    entry->inflightNext = NULL;
+}
+
+// double the hash table (and the ghost slots that go with it) once chains
+// grow past one entry per bucket
+static void grow_buckets(cache_t *cache) {
+    unsigned long nBuckets = cache->nBuckets << 1;
+    cacheEntry_t **buckets = calloc(nBuckets, sizeof(cacheEntry_t *));
+    unsigned long *ghosts = calloc(nBuckets, sizeof(unsigned long));
+    assert(buckets && ghosts);
+    for (unsigned long i = 0; i < cache->nBuckets; i++) {
+        cacheEntry_t *curr = cache->buckets[i];
+        while (curr) {
+            cacheEntry_t *next = curr->hashNext;
+            unsigned long bucket = curr->hash & (nBuckets - 1);
+            curr->hashNext = buckets[bucket];
+            buckets[bucket] = curr;
+            curr = next;
+        }
+        unsigned long ghost = cache->ghosts[i];
+        ghosts[ghost & (nBuckets - 1)] = ghost;
+    }
+    free(cache->buckets);
+    free(cache->ghosts);
+    cache->buckets = buckets;
+    cache->ghosts = ghosts;
+    cache->nBuckets = nBuckets;
+}
+
+// add an entry at the tail of one of the cache's queues
+static void queue_append(cache_t *cache, int queue, cacheEntry_t *entry) {
+    cacheQueue_t *list = &cache->queues[queue];
+    entry->queue = queue;
+    entry->next = NULL;
+    entry->prev = list->tail;
+    if (list->tail) {
+        list->tail->next = entry;
+    } else {
+        list->head = entry;
+    }
+    list->tail = entry;
+    list->bytes += entry->size;
+}
+
+// unlink an entry from the queue it is in
+static void queue_remove(cache_t *cache, cacheEntry_t *entry) {
+    cacheQueue_t *list = &cache->queues[entry->queue];
+    if (entry->prev) {
+        entry->prev->next = entry->next;
+    } else {
+        list->head = entry->next;
+    }
+    if (entry->next) {
+        entry->next->prev = entry->prev;
+    } else {
+        list->tail = entry->prev;
+    }
+    entry->prev = entry->next = NULL;
+    list->bytes -= entry->size;
+}
+
+/**************************************************************************/
+// seconds since the epoch as of the last tick_cache_clock(), for freshness
+// checks on the request path
+time_t cache_clock(void) {
+    return atomic_load_explicit(&cacheClock, memory_order_relaxed);
+}
+
+// bring cache_clock() up to date, once per batch of events
+void tick_cache_clock(void) {
+    atomic_store_explicit(&cacheClock, time(NULL), memory_order_relaxed);
+}
+
+// set cache_clock() to a simulated time, for replaying a trace
+void set_cache_clock(time_t now) {
+    atomic_store_explicit(&cacheClock, now, memory_order_relaxed);
+}
+
+// when an entry with a max-age stops being worth keeping: once it is past
+// the windows it may still be served stale in, and a little later if the
+// origin could confirm it with a 304
+time_t reclaim_time(cacheEntry_t *entry) {
+    unsigned int window = entry->staleWhileRevalidate;
+    if (entry->staleIfError > window) {
+        window = entry->staleIfError;
+    }
+    if ((entry->etagLength > 0 || entry->lastModifiedLength > 0) &&
+        window < REVALIDATE_GRACE) {
+        window = REVALIDATE_GRACE;
+    }
+    return entry->cachedTime + (time_t)entry->maxAge + window;
+}
+
+// list an entry in the slot its deadline falls in: the lowest level whose
+// turn still reaches it, and level 0 if it is already due. Deadlines
+// beyond the last level wait in its furthest slot and are placed again
+// when it comes round.
+static void wheel_insert(timerWheel_t *wheel, cacheEntry_t *entry) {
+    time_t due = entry->expires;
+    if (due < wheel->current) {
+        due = wheel->current;
+    } else if (due - wheel->current >= WHEEL_SPAN) {
+        due = wheel->current + WHEEL_SPAN - 1;
+    }
+    int level = 0;
+    while (due - wheel->current >= 1L << (WHEEL_BITS * (level + 1))) {
+        level++;
+    }
+    cacheEntry_t **slot =
+        &wheel->slots[level][(due >> (WHEEL_BITS * level)) & WHEEL_MASK];
+    entry->timerSlot = slot;
+    entry->timerPrev = NULL;
+    entry->timerNext = *slot;
+    if (*slot) {
+        (*slot)->timerPrev = entry;
+    }
+    *slot = entry;
+}
+
+// unlink an entry from its slot, if it is in the wheel
+static void wheel_remove(cacheEntry_t *entry) {
+    if (!entry->timerSlot) {
+        return;
+    }
+    if (entry->timerPrev) {
+        entry->timerPrev->timerNext = entry->timerNext;
+    } else {
+        *entry->timerSlot = entry->timerNext;
+    }
+    if (entry->timerNext) {
+        entry->timerNext->timerPrev = entry->timerPrev;
+    }
+    entry->timerSlot = NULL;
+    entry->timerPrev = entry->timerNext = NULL;
+}
+
+// on entering a new second, move the entries of every higher-level slot
+// whose span starts now down to the levels below
+static void wheel_cascade(timerWheel_t *wheel) {
+    for (int level = 1; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        if (wheel->current & ((1L << shift) - 1)) {
+            return;
+        }
+        cacheEntry_t **slot =
+            &wheel->slots[level][(wheel->current >> shift) & WHEEL_MASK];
+        cacheEntry_t *curr = *slot;
+        *slot = NULL;
+        while (curr) {
+            cacheEntry_t *next = curr->timerNext;
+            curr->timerSlot = NULL;
+            wheel_insert(wheel, curr);
+            curr = next;
+        }
+    }
+}
+
+// first second after current, and no later than limit, that has entries
+// due in level 0 or a higher-level slot to cascade, so the seconds between
+// can be skipped. Entries of a level sit 1 to 64 of its slots ahead.
+static time_t wheel_next_event(timerWheel_t *wheel, time_t limit) {
+    time_t next = limit;
+    for (int level = 0; level < WHEEL_LEVELS; level++) {
+        int shift = WHEEL_BITS * level;
+        time_t span = wheel->current >> shift;
+        for (int ahead = 1; ahead <= WHEEL_SLOTS; ahead++) {
+            time_t start = (span + ahead) << shift;
+            if (start >= next) {
+                break;
+            }
+            if (wheel->slots[level][(span + ahead) & WHEEL_MASK]) {
+                next = start;
+                break;
             }
-            break;
         }
-        prev = curr;
-        curr = curr->next;
     }
+    return next;
+}
+
+// list an entry in the timer wheel if it has a max-age
+static void schedule_expiry(cache_t *cache, cacheEntry_t *entry) {
+    if (entry->isStalable) {
+        entry->expires = reclaim_time(entry);
+        wheel_insert(&cache->wheel, entry);
+    }
+}
+
+// list an entry in the timer wheel again after its freshness changed, if
+// it is still cached
+void reschedule_expiry(cache_t *cache, cacheEntry_t *entry) {
+    if (lookup_cache(cache, entry) == entry) {
+        wheel_remove(entry);
+        schedule_expiry(cache, entry);
+    }
+}
+
+// unlink an entry from its policy queue, its hash chain and the wheel
+void remove_cache_entry(cache_t *cache, cacheEntry_t *entry) {
+    cacheEntry_t **link = &cache->buckets[entry->hash & (cache->nBuckets - 1)];
+    while (*link && *link != entry) {
+        link = &(*link)->hashNext;
+    }
+    if (*link) {
+        *link = entry->hashNext;
+    }
+    queue_remove(cache, entry);
+    wheel_remove(entry);
+    entry->hashNext = NULL;
+    (cache->count)--;
+    cache->usedBytes -= entry->size;
+}
+
+/**************************************************************************/
+// LRU: one queue in recency order, a hit moves its entry to the tail and
+// the least recently used entry at the head goes first
+static void lru_admit(cache_t *cache, cacheEntry_t *entry) {
+    queue_append(cache, QUEUE_MAIN, entry);
+}
+
+static void lru_touch(cache_t *cache, cacheEntry_t *entry) {
+    if (cache->queues[QUEUE_MAIN].tail != entry) {
+        queue_remove(cache, entry);
+        queue_append(cache, QUEUE_MAIN, entry);
+    }
+}
 
-    // evict head of cache if count capacity is reached or cache is stale
-    if ((!(*inCache) && cache->count == CACHE_CAPACITY) || staleCache) {
-        cacheEntry_t *evicted = cache->head;
-        cache->head = cache->head->next;
-        printf("Evicting %s %s from cache\n", evicted->host, evicted->path);
-        fflush(stdout);
-        free(evicted);
-        (cache->count)--;
-        // removed stale cache
-        if (staleCache) {
-            *inCache = 0;
+static cacheEntry_t *lru_victim(cache_t *cache) {
+    return cache->queues[QUEUE_MAIN].head;
+}
+
+// S3-FIFO: new keys enter a small FIFO queue, and only those hit while in
+// it move on to the main FIFO queue, so a scan of one-off keys only churns
+// the small queue. Main entries that were hit go around again, once per
+// hit counted. Keys evicted from the small queue without a hit leave a
+// ghost, and come back straight to the main queue if asked for again soon.
+static void s3fifo_admit(cache_t *cache, cacheEntry_t *entry) {
+    unsigned long *ghost = &cache->ghosts[entry->hash & (cache->nBuckets - 1)];
+    int seen = entry->hash != 0 && *ghost == entry->hash;
+    if (seen) {
+        *ghost = 0;
+    }
+    entry->frequency = 0;
+    queue_append(cache, seen ? QUEUE_MAIN : QUEUE_SMALL, entry);
+}
+
+static void s3fifo_touch(cache_t *cache, cacheEntry_t *entry) {
+    (void)cache;
+    if (entry->frequency < S3FIFO_MAX_FREQUENCY) {
+        entry->frequency++;
+    }
+}
+
+static cacheEntry_t *s3fifo_victim(cache_t *cache) {
+    cacheQueue_t *small = &cache->queues[QUEUE_SMALL];
+    cacheQueue_t *mainQueue = &cache->queues[QUEUE_MAIN];
+    size_t smallShare = cache->maxBytes / 100 * S3FIFO_SMALL_PERCENT;
+    while (1) {
+        if (small->head && (small->bytes > smallShare || !mainQueue->head)) {
+            cacheEntry_t *oldest = small->head;
+            if (oldest->frequency == 0) {
+                cache->ghosts[oldest->hash & (cache->nBuckets - 1)] =
+                    oldest->hash;
+                return oldest;
+            }
+            queue_remove(cache, oldest);
+            oldest->frequency = 0;
+            queue_append(cache, QUEUE_MAIN, oldest);
+            continue;
+        }
+        cacheEntry_t *oldest = mainQueue->head;
+        if (!oldest || oldest->frequency == 0) {
+            return oldest;
         }
+        oldest->frequency--;
+        queue_remove(cache, oldest);
+        queue_append(cache, QUEUE_MAIN, oldest);
     }
 }
 
-// enqueue new entry to cache linked list
-void enqueue_cache(cache_t *cache, cacheEntry_t *newEntry) {
-    if (!cache->head) {
-        cache->head = cache->tail = newEntry;
-        (cache->count)++;
+static const cachePolicy_t cachePolicies[] = {
+    {"lru", lru_admit, lru_touch, lru_victim},
+    {"s3fifo", s3fifo_admit, s3fifo_touch, s3fifo_victim},
+};
+
+// replacement policy called name ("lru" or "s3fifo"), NULL if unknown
+const cachePolicy_t *find_cache_policy(const char *name) {
+    for (size_t i = 0; i < sizeof(cachePolicies) / sizeof(cachePolicies[0]);
+         i++) {
+        if (strcmp(cachePolicies[i].name, name) == 0) {
+            return &cachePolicies[i];
+        }
+    }
+    return NULL;
+}
+
+// drop an entry from the cache, it goes back to the pool once no
+// connection is still sending it
+static void evict_cache_entry(cache_t *cache, cacheEntry_t *evicted) {
+    log_line("Evicting %s %s from cache\n", evicted->host, evicted->path);
+    remove_cache_entry(cache, evicted);
+    release_cache_entry(evicted);
+}
+
+/**************************************************************************/
+// tell the replacement policy a request found its entry cached
+void perform_policy(cache_t *cache, cacheEntry_t *newEntry,
+                    cacheEntry_t *isStale, int *inCache) {
+
+    if (cache->count == 0) {
         return;
     }
-    // enqueue at tail
-    cache->tail->next = newEntry;
-    cache->tail = newEntry;
+    // removed stale cache
+    if (isStale) {
+        evict_cache_entry(cache, isStale);
+        *inCache = 0;
+        return;
+    }
+
+    // if found, let the policy count the hit
+    cacheEntry_t *found = lookup_cache(cache, newEntry);
+    if (found) {
+        cache->policy->touch(cache, found);
+        *inCache = 1;
+    }
+}
+
+// enqueue new entry where its policy admits it and index it by key,
+// evicting the entries the policy picks until it fits in the byte budget;
+// with a disk tier they are demoted to it rather than dropped. Returns 0
+// without caching if the entry alone is larger than the budget.
+int enqueue_cache(cache_t *cache, cacheEntry_t *newEntry) {
+    // the request is not needed once cached
+    pool_free(newEntry->request);
+    newEntry->request = NULL;
+    newEntry->size = pool_block_size(newEntry) +
+                     pool_block_size(newEntry->strings) +
+                     pool_block_size(newEntry->response) +
+                     newEntry->bodyLength;
+    for (responseSegment_t *segment = newEntry->segments; segment;
+         segment = segment->next) {
+        newEntry->size += pool_block_size(segment);
+    }
+    if (newEntry->size > cache->maxBytes) {
+        return 0;
+    }
+    while (cache->usedBytes + newEntry->size > cache->maxBytes) {
+        cacheEntry_t *victim = cache->policy->victim(cache);
+        if (cache->disk) {
+            demote_entry(cache->disk, victim);
+        }
+        evict_cache_entry(cache, victim);
+        cache->evictions++;
+    }
+
+    if ((unsigned long)cache->count >= cache->nBuckets) {
+        grow_buckets(cache);
+    }
+    unsigned long bucket = newEntry->hash & (cache->nBuckets - 1);
+    newEntry->hashNext = cache->buckets[bucket];
+    cache->buckets[bucket] = newEntry;
+    cache->policy->admit(cache, newEntry);
+    schedule_expiry(cache, newEntry);
     (cache->count)++;
+    cache->usedBytes += newEntry->size;
+    return 1;
+}
+
+// reclaim the entries due by now, at most a batch of them, jumping over
+// seconds with nothing to do (each jump is charged to the batch too, so a
+// large clock jump cannot keep the shard locked); returns 1 if more were
+// left for the next call
+int expire_cache(cache_t *cache, time_t now) {
+    timerWheel_t *wheel = &cache->wheel;
+    int budget = EXPIRY_BATCH;
+    while (1) {
+        cacheEntry_t **slot = &wheel->slots[0][wheel->current & WHEEL_MASK];
+        while (*slot) {
+            if (budget-- == 0) {
+                return 1;
+            }
+            cacheEntry_t *entry = *slot;
+            wheel_remove(entry);
+            // waited in the furthest slot for a deadline past the wheel
+            if (entry->expires > wheel->current) {
+                wheel_insert(wheel, entry);
+                continue;
+            }
+            log_line("Expiring %s %s from cache\n", entry->host, entry->path);
+            remove_cache_entry(cache, entry);
+            release_cache_entry(entry);
+            cache->expirations++;
+        }
+        if (wheel->current >= now) {
+            return 0;
+        }
+        if (budget-- == 0) {
+            return 1;
+        }
+        wheel->current = wheel_next_event(wheel, now);
+        wheel_cascade(wheel);
+    }
 }
 
 /**************************************************************************/
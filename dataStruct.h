@@ -1,56 +1,281 @@
 #ifndef DATASTRUCT
 #define DATASTRUCT
 
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
 #include <time.h>
 
 #define BUFFER_SIZE 4096
 #define MAX_RESPONSE_BUFFER 102400
 #define MAX_REQUEST_BUFFER 8193 // Ed #200
+#define DEFAULT_CACHE_BUDGET (1UL << 20)
+#define DEFAULT_CACHE_POLICY "lru"
 
-// cache entry stores both request and response and most of their headers
+// queues a replacement policy keeps cached entries in; LRU only uses the
+// main one, S3-FIFO admits new keys to the small one first
+#define QUEUE_SMALL 0
+#define QUEUE_MAIN 1
+#define NUM_QUEUES 2
+
+// expiry deadlines are kept in a hierarchical timer wheel of one-second
+// ticks: each level has 64 slots, each slot of a level spanning a whole
+// turn of the one below, so four levels cover about 194 days
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS 4
+// entries that can be revalidated are kept this many seconds past their
+// stale windows, for a 304 to refresh instead of a full fetch
+#define REVALIDATE_GRACE 60
+
+// progress of the origin fetch that fills an entry, for requests coalesced
+// onto it
+#define FETCH_NONE 0
+#define FETCH_RUNNING 1
+#define FETCH_DONE 2
+#define FETCH_FAILED 3
+
+// response bytes past the first block are kept in a list of fixed-size
+// segments, so large objects are stored as they stream in and never need
+// one contiguous buffer
+#define RESPONSE_SEGMENT 65536
+typedef struct responseSegment responseSegment_t;
+struct responseSegment {
+    responseSegment_t *next;
+    int length;
+    char data[];
+};
+#define SEGMENT_DATA (RESPONSE_SEGMENT - (int)sizeof(responseSegment_t))
+
+// cache entry stores both request and response and most of their headers.
+// All buffers come from the size-class pool and are sized to their content.
 typedef struct cacheEntry cacheEntry_t;
 struct cacheEntry {
-    // for request
-    char path[MAX_REQUEST_BUFFER];
-    char host[MAX_REQUEST_BUFFER];
-    char request_lastLine[MAX_REQUEST_BUFFER];
-    char request[MAX_REQUEST_BUFFER];
+    // for request, only kept while the request is in flight
+    char *request;
     int requestLength;
-    char targetPort[BUFFER_SIZE];
 
-    // for response
-    char response[MAX_RESPONSE_BUFFER];
-    int responseContentLength;
+    // host, port, path and the normalised cache key (method, host, port,
+    // path) share one pooled block
+    char *strings;
+    char *host;
+    char *targetPort;
+    char *path;
+    char *key;
+    int keyLength;
+    unsigned long hash;
+
+    // for response, stored in order in response, then segments, then a
+    // memfd holding a spliced body (response then only holds the header)
+    char *response;
+    responseSegment_t *segments;
+    responseSegment_t *lastSegment;
+    long segmentBytes;
+    int bodyFd;
+    long bodyLength;
+    // bytes response holds before segments or the memfd take over, fixed
+    // once the header has been parsed
+    int blockLength;
+    long responseContentLength;
     int responseHeaderLength;
-    int responseTotalBytes;
+    long responseTotalBytes;
+    // validators, as offsets into the response header, 0 length if absent
+    int etag;
+    int etagLength;
+    int lastModified;
+    int lastModifiedLength;
+    // Range and If-Range, as offsets into the request, 0 length if absent
+    int range;
+    int rangeLength;
+    int ifRange;
+    int ifRangeLength;
+
+    // framing and persistence of the request and response
+    int requestKeepAlive;
+    int statusCode;
+    int hasContentLength;
+    // a Content-Length that is not a number a long holds, which leaves the
+    // message without a trustworthy end
+    int badContentLength;
+    int isChunked;
+    int responseKeepAlive;
+    // whether the response has a Content-Encoding, whether that is gzip
+    // (the one the proxy can undo), and whether the request takes gzip
+    int isEncoded;
+    int isGzip;
+    int acceptsGzip;
+    // a CONNECT, whose host and port name the far end of a tunnel
+    int isTunnel;
 
     // for tasks 3-4
     int isCachable;
     time_t cachedTime;
     unsigned int maxAge;
     int isStalable;
+    // how old the response already was when it arrived, from its Age and
+    // Date, taken off cachedTime when it is stored
+    unsigned int initialAge;
+    // seconds past max-age a stale copy may still be served, while it is
+    // refreshed in the background or when the origin fails
+    unsigned int staleWhileRevalidate;
+    unsigned int staleIfError;
+    // set while a background refresh of this entry is running
+    atomic_int refreshing;
+
+    // while fetching: response bytes that coalesced followers may send,
+    // the state of the fetch, and how many followers hold the entry
+    atomic_long published;
+    atomic_int fetchState;
+    atomic_int followers;
+    cacheEntry_t *inflightNext;
+
+    // bytes charged against the cache budget while cached
+    size_t size;
+    // the cache and every connection still sending it hold a reference
+    atomic_int refCount;
 
+    // place in its policy queue (towards head is evicted first), hits while
+    // cached as far as the policy counts them, and hash chain
+    int queue;
+    int frequency;
+    cacheEntry_t *prev;
     cacheEntry_t *next;
+    cacheEntry_t *hashNext;
+
+    // when a cached entry with a max-age is reclaimed, and its place in
+    // the timer wheel (the slot it is listed in, NULL if none)
+    time_t expires;
+    cacheEntry_t **timerSlot;
+    cacheEntry_t *timerPrev;
+    cacheEntry_t *timerNext;
 };
 
-// storing all caches to perform least recently updated algorithm
-typedef struct cache cache_t;
-struct cache {
+// entries listed by the second they are due to be reclaimed; current is
+// the second whose level 0 slot is being drained
+typedef struct timerWheel timerWheel_t;
+struct timerWheel {
+    cacheEntry_t *slots[WHEEL_LEVELS][WHEEL_SLOTS];
+    time_t current;
+};
+
+// entries of one queue, in the order they are considered for eviction
+typedef struct cacheQueue cacheQueue_t;
+struct cacheQueue {
     cacheEntry_t *head;
     cacheEntry_t *tail;
+    size_t bytes;
+};
+
+typedef struct cache cache_t;
+// second tier that evicted entries are demoted to, see diskTier.h
+typedef struct diskTier diskTier_t;
+
+// replacement policy of a cache: where a new entry goes, what a request
+// finding an entry does to it, and which entry goes next to make room
+typedef struct cachePolicy cachePolicy_t;
+struct cachePolicy {
+    const char *name;
+    void (*admit)(cache_t *cache, cacheEntry_t *entry);
+    void (*touch)(cache_t *cache, cacheEntry_t *entry);
+    cacheEntry_t *(*victim)(cache_t *cache);
+};
+
+// storing all caches, in queues ordered by their replacement policy
+struct cache {
+    cacheQueue_t queues[NUM_QUEUES];
+    const cachePolicy_t *policy;
+    cacheEntry_t **buckets;
+    unsigned long nBuckets;
+    // hashes of keys recently evicted without a hit, one slot per bucket,
+    // so S3-FIFO can admit them straight to its main queue when they return
+    unsigned long *ghosts;
+    // entries whose response is still being fetched, by key
+    cacheEntry_t *inflight;
     int count;
+    size_t usedBytes;
+    size_t maxBytes;
+    // entries evicted to make room for new ones
+    unsigned long evictions;
+    // entries with a max-age, by when they are reclaimed, and how many
+    // have been reclaimed so far
+    timerWheel_t wheel;
+    unsigned long expirations;
+    // where evicted entries go, NULL if they are dropped
+    diskTier_t *disk;
+    // held by a worker for the whole lookup-or-insert of one request
+    pthread_mutex_t lock;
+};
+
+// cache split into independently locked shards selected by key hash, so
+// workers on different keys rarely wait for each other
+typedef struct shardedCache shardedCache_t;
+struct shardedCache {
+    cache_t **shards;
+    unsigned long nShards;
+    const cachePolicy_t *policy;
+    diskTier_t *disk;
 };
 
-// malloc and initialise a cache entry
+// get an initialised cache entry from the pool
 cacheEntry_t *create_cache_entry();
-// malloc and initialise a cache linked list
-cache_t *create_cache();
-// enqueue new entry to cache linked list
-void enqueue_cache(cache_t *cache, cacheEntry_t *newEntry);
-// least recently updated algorithm to update most recently accessed cache
-void perform_lru(cache_t *cache, cacheEntry_t *newEntry, cacheEntry_t *isStale,
-                 int *inCache);
+// return an entry and all of its buffers to the pool
+void free_cache_entry(cacheEntry_t *entry);
+// take another reference on an entry so eviction cannot free it
+void hold_cache_entry(cacheEntry_t *entry);
+// drop a reference, freeing the entry once nobody holds it
+void release_cache_entry(cacheEntry_t *entry);
+// replacement policy called name ("lru" or "s3fifo"), NULL if unknown
+const cachePolicy_t *find_cache_policy(const char *name);
+// malloc and initialise a cache holding at most maxBytes of entries
+cache_t *create_cache(size_t maxBytes, const cachePolicy_t *policy);
+// split maxBytes over enough shards for the given number of workers
+shardedCache_t *create_sharded_cache(size_t maxBytes, int workers,
+                                     const cachePolicy_t *policy);
+// shard responsible for an entry's key
+cache_t *cache_shard(shardedCache_t *cache, cacheEntry_t *entry);
+// free every shard
+void free_sharded_cache(shardedCache_t *cache);
+// last segment of an entry's response if it has room, otherwise a new one
+responseSegment_t *writable_segment(cacheEntry_t *entry);
+// store host, port and path of a parsed request and build its cache key
+void set_cache_key(cacheEntry_t *entry, const char *host, int hostLength,
+                   const char *port, int portLength, const char *path,
+                   int pathLength);
+// find the cached entry with the same key as newEntry, NULL if none
+cacheEntry_t *lookup_cache(cache_t *cache, cacheEntry_t *newEntry);
+// enqueue new entry, evicting what the policy picks until it fits (and
+// demoting it to the disk tier, if there is one)
+int enqueue_cache(cache_t *cache, cacheEntry_t *newEntry);
+// the entry being fetched for the same key as newEntry, NULL if none
+cacheEntry_t *lookup_inflight(cache_t *cache, cacheEntry_t *newEntry);
+// let later requests for an entry's key coalesce onto its fetch
+void add_inflight(cache_t *cache, cacheEntry_t *entry);
+// stop coalescing requests onto an entry's fetch
+void remove_inflight(cache_t *cache, cacheEntry_t *entry);
+// unlink an entry from its policy queue, its hash chain and the wheel
+void remove_cache_entry(cache_t *cache, cacheEntry_t *entry);
+// tell the replacement policy a request found its entry cached
+void perform_policy(cache_t *cache, cacheEntry_t *newEntry,
+                    cacheEntry_t *isStale, int *inCache);
+// seconds since the epoch as of the last tick_cache_clock(), for freshness
+// checks on the request path
+time_t cache_clock(void);
+// bring cache_clock() up to date, once per batch of events
+void tick_cache_clock(void);
+// set cache_clock() to a simulated time, for replaying a trace
+void set_cache_clock(time_t now);
+// when an entry with a max-age stops being worth keeping, as the timer
+// wheel reclaims it: past its stale windows, and a grace for a 304
+time_t reclaim_time(cacheEntry_t *entry);
+// list an entry in the timer wheel again after its freshness changed, if
+// it is still cached
+void reschedule_expiry(cache_t *cache, cacheEntry_t *entry);
+// reclaim the entries due by now, at most a batch of them; returns 1 if
+// more were left for the next call
+int expire_cache(cache_t *cache, time_t now);
+// parse a byte count such as 512M, 64K or 1G, 0 if malformed
+size_t parse_byte_size(const char *text);
 // free all malloced
 void free_cache(cache_t *cache);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,391 @@
+/*
+Second cache tier on local disk. Entries the replacement policy evicts from
+memory are demoted here instead of being dropped: a disk thread packs each
+one as a snapshot record and appends it to a log file used as a ring, so
+writes are sequential and the oldest records are the ones overwritten. An
+in-memory index maps keys to records. Lookups never block the workers: a
+hit queues a read for a disk thread and returns DISK_PENDING, the worker is
+woken through its eventfd once the entry is back in memory, and the entry
+is then promoted into the memory tier and leaves the log.
+*/
+
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "diskTier.h"
+#include "snapshot.h"
+
+#define INITIAL_DISK_BUCKETS 1024
+// entries larger than this share of the log would overwrite too much of it
+#define DISK_MAX_SHARE 8
+// demoted entries waiting to be written are still in memory; past this
+// many bytes of them, evictions are dropped instead
+#define DISK_MAX_PENDING (64UL << 20)
+
+/*****************************************************************************/
+// return a slot that left the index and that no disk thread is using
+static void free_slot(diskSlot_t *slot) {
+    release_cache_entry(slot->entry);
+    free(slot->key);
+    free(slot);
+}
+
+// the slot for the key of entry, NULL if none; caller holds the lock
+static diskSlot_t *find_slot(diskTier_t *tier, cacheEntry_t *entry) {
+    diskSlot_t *curr = tier->buckets[entry->hash & (tier->nBuckets - 1)];
+    while (curr && !(curr->hash == entry->hash &&
+                     curr->keyLength == entry->keyLength &&
+                     memcmp(curr->key, entry->key, entry->keyLength) == 0)) {
+        curr = curr->next;
+    }
+    return curr;
+}
+
+// double the index once chains grow past one slot per bucket
+static void grow_buckets(diskTier_t *tier) {
+    unsigned long nBuckets = tier->nBuckets << 1;
+    diskSlot_t **buckets = calloc(nBuckets, sizeof(diskSlot_t *));
+    assert(buckets);
+    for (unsigned long i = 0; i < tier->nBuckets; i++) {
+        diskSlot_t *curr = tier->buckets[i];
+        while (curr) {
+            diskSlot_t *next = curr->next;
+            curr->next = buckets[curr->hash & (nBuckets - 1)];
+            buckets[curr->hash & (nBuckets - 1)] = curr;
+            curr = next;
+        }
+    }
+    free(tier->buckets);
+    tier->buckets = buckets;
+    tier->nBuckets = nBuckets;
+}
+
+// take a slot out of the index and its record out of the log; it is freed
+// now unless a disk thread still has it. Caller holds the lock.
+static void drop_slot(diskTier_t *tier, diskSlot_t *slot) {
+    diskSlot_t **link = &tier->buckets[slot->hash & (tier->nBuckets - 1)];
+    while (*link && *link != slot) {
+        link = &(*link)->next;
+    }
+    if (*link) {
+        *link = slot->next;
+    }
+    if (slot->length > 0) {
+        if (slot->logPrev) {
+            slot->logPrev->logNext = slot->logNext;
+        } else {
+            tier->logHead = slot->logNext;
+        }
+        if (slot->logNext) {
+            slot->logNext->logPrev = slot->logPrev;
+        } else {
+            tier->logTail = slot->logPrev;
+        }
+        tier->usedBytes -= slot->length;
+    }
+    if (slot->state == SLOT_WRITING) {
+        tier->pendingBytes -= slot->entry->size;
+    }
+    tier->count--;
+    slot->dropped = 1;
+    if (!slot->busy) {
+        free_slot(slot);
+    }
+}
+
+// queue a slot for a disk thread, caller holds the lock
+static void queue_job(diskTier_t *tier, diskSlot_t *slot) {
+    slot->busy = 1;
+    slot->nextJob = NULL;
+    if (tier->jobsTail) {
+        tier->jobsTail->nextJob = slot;
+    } else {
+        tier->jobsHead = slot;
+    }
+    tier->jobsTail = slot;
+    pthread_cond_signal(&tier->jobsReady);
+}
+
+// room for length bytes at the write offset, going back to the start of
+// the file when the end is reached and dropping every record the new one
+// overwrites. Records are kept in the order they were written, so these
+// are always the oldest. Caller holds the lock.
+static off_t reserve_extent(diskTier_t *tier, size_t length) {
+    if (tier->writeOffset + (off_t)length > tier->budget) {
+        while (tier->logHead && tier->logHead->offset >= tier->writeOffset) {
+            atomic_fetch_add(&tier->overwritten, 1);
+            drop_slot(tier, tier->logHead);
+        }
+        tier->writeOffset = 0;
+    }
+    off_t offset = tier->writeOffset;
+    tier->writeOffset += length;
+    while (tier->logHead && tier->logHead->offset >= offset &&
+           tier->logHead->offset < tier->writeOffset) {
+        atomic_fetch_add(&tier->overwritten, 1);
+        drop_slot(tier, tier->logHead);
+    }
+    return offset;
+}
+
+// wake every worker once a read has finished, caller holds the lock
+static void wake_listeners(diskTier_t *tier) {
+    for (int i = 0; i < tier->nListeners; i++) {
+        uint64_t one = 1;
+        if (write(tier->listeners[i], &one, sizeof(one)) < 0) {
+            // already signalled and not yet read
+        }
+    }
+}
+
+/*****************************************************************************/
+// pack a demoted entry and append it to the log; from then on it is read
+// back from there rather than held in memory
+static void write_slot(diskTier_t *tier, diskSlot_t *slot) {
+    size_t length = 0;
+    uint64_t checksum = 0;
+    char *record = pack_entry(slot->entry, &length, &checksum);
+
+    pthread_mutex_lock(&tier->lock);
+    if (!record || slot->dropped || length > (size_t)tier->budget) {
+        if (!record) {
+            atomic_fetch_add(&tier->errors, 1);
+        }
+        slot->busy = 0;
+        if (slot->dropped) {
+            free_slot(slot);
+        } else {
+            drop_slot(tier, slot);
+        }
+        pthread_mutex_unlock(&tier->lock);
+        free(record);
+        return;
+    }
+    slot->offset = reserve_extent(tier, length);
+    slot->length = length;
+    slot->checksum = checksum;
+    slot->logPrev = tier->logTail;
+    slot->logNext = NULL;
+    if (tier->logTail) {
+        tier->logTail->logNext = slot;
+    } else {
+        tier->logHead = slot;
+    }
+    tier->logTail = slot;
+    tier->usedBytes += length;
+    pthread_mutex_unlock(&tier->lock);
+
+    ssize_t written = pwrite(tier->fd, record, length, slot->offset);
+    free(record);
+
+    pthread_mutex_lock(&tier->lock);
+    slot->busy = 0;
+    if (slot->dropped) {
+        free_slot(slot);
+    } else if (written != (ssize_t)length) {
+        atomic_fetch_add(&tier->errors, 1);
+        drop_slot(tier, slot);
+    } else {
+        tier->pendingBytes -= slot->entry->size;
+        release_cache_entry(slot->entry);
+        slot->entry = NULL;
+        slot->state = SLOT_STORED;
+        atomic_fetch_add(&tier->demotions, 1);
+    }
+    pthread_mutex_unlock(&tier->lock);
+}
+
+// read a record back into an entry for the workers to promote. A record
+// overwritten meanwhile fails its checksum and is dropped like a miss.
+static void read_slot(diskTier_t *tier, diskSlot_t *slot) {
+    char *record = malloc(slot->length);
+    assert(record);
+    size_t got = 0;
+    while (got < slot->length) {
+        ssize_t bytes =
+            pread(tier->fd, record + got, slot->length - got, slot->offset + got);
+        if (bytes <= 0) {
+            break;
+        }
+        got += bytes;
+    }
+    cacheEntry_t *entry =
+        (got == slot->length)
+            ? unpack_entry(record, slot->length, slot->checksum)
+            : NULL;
+    free(record);
+    if (entry && (entry->hash != slot->hash ||
+                  entry->keyLength != slot->keyLength ||
+                  memcmp(entry->key, slot->key, slot->keyLength) != 0)) {
+        release_cache_entry(entry);
+        entry = NULL;
+    }
+
+    pthread_mutex_lock(&tier->lock);
+    slot->busy = 0;
+    if (slot->dropped) {
+        release_cache_entry(entry);
+        free_slot(slot);
+    } else if (!entry) {
+        atomic_fetch_add(&tier->errors, 1);
+        drop_slot(tier, slot);
+    } else {
+        slot->entry = entry;
+        slot->state = SLOT_LOADED;
+    }
+    wake_listeners(tier);
+    pthread_mutex_unlock(&tier->lock);
+}
+
+// disk thread: take queued slots and write or read their records
+static void *run_disk_thread(void *arg) {
+    diskTier_t *tier = arg;
+    while (1) {
+        pthread_mutex_lock(&tier->lock);
+        while (!tier->jobsHead) {
+            pthread_cond_wait(&tier->jobsReady, &tier->lock);
+        }
+        diskSlot_t *slot = tier->jobsHead;
+        tier->jobsHead = slot->nextJob;
+        if (!tier->jobsHead) {
+            tier->jobsTail = NULL;
+        }
+        // dropped while queued: nothing left to do for it
+        if (slot->dropped) {
+            free_slot(slot);
+            pthread_mutex_unlock(&tier->lock);
+            continue;
+        }
+        int state = slot->state;
+        pthread_mutex_unlock(&tier->lock);
+
+        if (state == SLOT_WRITING) {
+            write_slot(tier, slot);
+        } else {
+            read_slot(tier, slot);
+        }
+    }
+    return NULL;
+}
+
+/*****************************************************************************/
+// open (and truncate) the log at path, holding at most budget bytes, and
+// start nThreads disk threads
+diskTier_t *create_disk_tier(const char *path, size_t budget, int nThreads) {
+    diskTier_t *tier = calloc(1, sizeof(diskTier_t));
+    assert(tier);
+    tier->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (tier->fd < 0) {
+        perror("Error: Cannot open disk tier");
+        exit(EXIT_FAILURE);
+    }
+    pthread_mutex_init(&tier->lock, NULL);
+    pthread_cond_init(&tier->jobsReady, NULL);
+    tier->budget = budget;
+    tier->nBuckets = INITIAL_DISK_BUCKETS;
+    tier->buckets = calloc(tier->nBuckets, sizeof(diskSlot_t *));
+    assert(tier->buckets);
+    for (int i = 0; i < nThreads; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_disk_thread, tier) != 0) {
+            perror("Error: Cannot start disk thread\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    return tier;
+}
+
+// demote every shard's evictions to the tier
+void attach_disk_tier(shardedCache_t *cache, diskTier_t *tier) {
+    cache->disk = tier;
+    for (unsigned long i = 0; i < cache->nShards; i++) {
+        cache->shards[i]->disk = tier;
+    }
+}
+
+// wake this eventfd whenever a read finishes
+void add_disk_listener(diskTier_t *tier, int eventfd) {
+    pthread_mutex_lock(&tier->lock);
+    assert(tier->nListeners < MAX_DISK_LISTENERS);
+    tier->listeners[tier->nListeners++] = eventfd;
+    pthread_mutex_unlock(&tier->lock);
+}
+
+// under the entry's shard lock: queue an entry evicted from memory to be
+// written to the log, unless it is already past its stale windows, too
+// large for the log, or the disk threads are too far behind
+void demote_entry(diskTier_t *tier, cacheEntry_t *entry) {
+    time_t expires = entry->isStalable ? entry->expires : 0;
+    if (!entry->key || (expires && cache_clock() >= expires) ||
+        (off_t)entry->responseTotalBytes > tier->budget / DISK_MAX_SHARE) {
+        return;
+    }
+    pthread_mutex_lock(&tier->lock);
+    if (tier->pendingBytes + entry->size > DISK_MAX_PENDING) {
+        pthread_mutex_unlock(&tier->lock);
+        return;
+    }
+    diskSlot_t *old = find_slot(tier, entry);
+    if (old) {
+        drop_slot(tier, old);
+    }
+    diskSlot_t *slot = calloc(1, sizeof(diskSlot_t));
+    assert(slot);
+    slot->key = malloc(entry->keyLength);
+    assert(slot->key);
+    memcpy(slot->key, entry->key, entry->keyLength);
+    slot->keyLength = entry->keyLength;
+    slot->hash = entry->hash;
+    slot->state = SLOT_WRITING;
+    hold_cache_entry(entry);
+    slot->entry = entry;
+    slot->expires = expires;
+    tier->pendingBytes += entry->size;
+
+    if ((unsigned long)tier->count >= tier->nBuckets) {
+        grow_buckets(tier);
+    }
+    unsigned long bucket = slot->hash & (tier->nBuckets - 1);
+    slot->next = tier->buckets[bucket];
+    tier->buckets[bucket] = slot;
+    tier->count++;
+    queue_job(tier, slot);
+    pthread_mutex_unlock(&tier->lock);
+}
+
+// look for the key of request without blocking. An entry still waiting to
+// be written, or already read back, is handed over at once; one in the log
+// is queued to be read.
+int read_disk(diskTier_t *tier, cacheEntry_t *request, cacheEntry_t **loaded) {
+    if (!request->key) {
+        return DISK_MISS;
+    }
+    pthread_mutex_lock(&tier->lock);
+    diskSlot_t *slot = find_slot(tier, request);
+    int result = DISK_MISS;
+    if (slot && slot->expires && cache_clock() >= slot->expires) {
+        drop_slot(tier, slot);
+    } else if (slot && slot->state == SLOT_STORED) {
+        slot->state = SLOT_READING;
+        queue_job(tier, slot);
+        result = DISK_PENDING;
+    } else if (slot && slot->state == SLOT_READING) {
+        result = DISK_PENDING;
+    } else if (slot) {
+        hold_cache_entry(slot->entry);
+        *loaded = slot->entry;
+        drop_slot(tier, slot);
+        atomic_fetch_add(&tier->promotions, 1);
+        result = DISK_HIT;
+    }
+    pthread_mutex_unlock(&tier->lock);
+    return result;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,97 @@
+#ifndef DISKTIER
+#define DISKTIER
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include "dataStruct.h"
+
+#define DEFAULT_DISK_BUDGET (1UL << 30)
+#define MAX_DISK_LISTENERS 256
+
+// results of read_disk()
+#define DISK_MISS -1
+#define DISK_PENDING 0
+#define DISK_HIT 1
+
+// where an indexed entry is: queued to be written (entry still held in
+// memory), in the log, being read back, or read back and held in entry
+#define SLOT_WRITING 0
+#define SLOT_STORED 1
+#define SLOT_READING 2
+#define SLOT_LOADED 3
+
+// one entry of the disk tier's index, by key
+typedef struct diskSlot diskSlot_t;
+struct diskSlot {
+    char *key;
+    int keyLength;
+    unsigned long hash;
+    int state;
+    cacheEntry_t *entry;
+    // extent of its record in the log and the record's checksum
+    off_t offset;
+    size_t length;
+    uint64_t checksum;
+    // when the entry is past its stale windows, 0 if never
+    time_t expires;
+    // a disk thread is working on it, and it left the index meanwhile
+    int busy;
+    int dropped;
+    diskSlot_t *next;
+    diskSlot_t *nextJob;
+    // slots with a record in the log, oldest (next to be overwritten)
+    // first
+    diskSlot_t *logPrev;
+    diskSlot_t *logNext;
+};
+
+// log-structured store of entries evicted from memory: records are
+// appended to one file used as a ring of budget bytes, overwriting the
+// oldest, and found through an in-memory index
+struct diskTier {
+    pthread_mutex_t lock;
+    pthread_cond_t jobsReady;
+    int fd;
+    off_t budget;
+    off_t writeOffset;
+    off_t usedBytes;
+    // bytes of demoted entries still held in memory until written
+    size_t pendingBytes;
+    diskSlot_t **buckets;
+    unsigned long nBuckets;
+    int count;
+    diskSlot_t *jobsHead;
+    diskSlot_t *jobsTail;
+    diskSlot_t *logHead;
+    diskSlot_t *logTail;
+    // eventfds of workers to wake when a read finishes
+    int listeners[MAX_DISK_LISTENERS];
+    int nListeners;
+    // entries written, read back into memory, overwritten before being
+    // asked for again, and records that could not be read or written
+    atomic_ulong demotions;
+    atomic_ulong promotions;
+    atomic_ulong overwritten;
+    atomic_ulong errors;
+};
+
+// open (and truncate) the log at path, holding at most budget bytes, and
+// start nThreads disk threads
+diskTier_t *create_disk_tier(const char *path, size_t budget, int nThreads);
+// demote every shard's evictions to the tier
+void attach_disk_tier(shardedCache_t *cache, diskTier_t *tier);
+// wake this eventfd whenever a read finishes
+void add_disk_listener(diskTier_t *tier, int eventfd);
+// under the entry's shard lock: queue an entry evicted from memory to be
+// written to the log, unless it is already past its stale windows
+void demote_entry(diskTier_t *tier, cacheEntry_t *entry);
+// look for the key of request without blocking. Returns DISK_HIT with the
+// entry read back in *loaded (which leaves the tier), DISK_PENDING if a
+// disk thread is reading it, or DISK_MISS.
+int read_disk(diskTier_t *tier, cacheEntry_t *request, cacheEntry_t **loaded);
+
+#endif
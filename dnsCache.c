@@ -0,0 +1,304 @@
+/*
+Resolver cache keyed by host:port. Lookups on the request path never block:
+a miss queues the name for a resolver thread and returns DNS_PENDING, and
+the worker is woken through its eventfd once the answer is in. Answers are
+kept for the positive TTL, failures for the negative TTL; an expired answer
+is still used while a refresh runs in the background. Client Host headers
+pick the names, so the table and the resolver queue are both bounded:
+expired entries are freed to make room, and a new name is failed while
+either is full.
+*/
+
+#define _DEFAULT_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <netdb.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <unistd.h>
+
+#include "dnsCache.h"
+
+#define DNS_BUCKETS 256
+#define MAX_DNS_ENTRIES 4096
+#define MAX_DNS_PENDING 256
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+/*****************************************************************************/
+// FNV-1a over host and port
+static unsigned long hash_host(char *host, char *port) {
+    unsigned long hash = FNV_OFFSET;
+    for (char *curr = host; *curr; curr++) {
+        hash ^= (unsigned char)*curr;
+        hash *= FNV_PRIME;
+    }
+    hash ^= ':';
+    hash *= FNV_PRIME;
+    for (char *curr = port; *curr; curr++) {
+        hash ^= (unsigned char)*curr;
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+// read "address name [aliases...]" lines of a hosts file
+static void load_hosts_file(dnsCache_t *cache, char *hostsFile) {
+    FILE *file = fopen(hostsFile, "r");
+    if (!file) {
+        perror("Error: Cannot open hosts file\n");
+        exit(EXIT_FAILURE);
+    }
+    char line[BUFSIZ];
+    while (fgets(line, sizeof(line), file)) {
+        line[strcspn(line, "#")] = '\0';
+        char *address = strtok(line, " \t\r\n");
+        if (!address) {
+            continue;
+        }
+        struct sockaddr_storage parsed = {0};
+        int family = strchr(address, ':') ? AF_INET6 : AF_INET;
+        void *target =
+            (family == AF_INET6)
+                ? (void *)&((struct sockaddr_in6 *)&parsed)->sin6_addr
+                : (void *)&((struct sockaddr_in *)&parsed)->sin_addr;
+        if (inet_pton(family, address, target) != 1) {
+            continue;
+        }
+        parsed.ss_family = family;
+        char *name;
+        while ((name = strtok(NULL, " \t\r\n"))) {
+            staticHost_t *host = malloc(sizeof(staticHost_t));
+            assert(host);
+            host->name = strdup(name);
+            host->address = parsed;
+            host->family = family;
+            host->next = cache->staticHosts;
+            cache->staticHosts = host;
+        }
+    }
+    fclose(file);
+}
+
+// resolve from the hosts file only, returning how many addresses were found
+static int resolve_static(dnsCache_t *cache, char *host, char *port,
+                          dnsAddress_t *addresses) {
+    int count = 0;
+    uint16_t portNumber = htons(atoi(port));
+    for (staticHost_t *curr = cache->staticHosts;
+         curr && count < MAX_DNS_ADDRESSES; curr = curr->next) {
+        if (strcasecmp(curr->name, host) != 0) {
+            continue;
+        }
+        addresses[count].address = curr->address;
+        addresses[count].family = curr->family;
+        if (curr->family == AF_INET6) {
+            ((struct sockaddr_in6 *)&addresses[count].address)->sin6_port =
+                portNumber;
+            addresses[count].length = sizeof(struct sockaddr_in6);
+        } else {
+            ((struct sockaddr_in *)&addresses[count].address)->sin_port =
+                portNumber;
+            addresses[count].length = sizeof(struct sockaddr_in);
+        }
+        count++;
+    }
+    return count;
+}
+
+// resolve with getaddrinfo(), returning how many addresses were found
+static int resolve_getaddrinfo(char *host, char *port,
+                               dnsAddress_t *addresses) {
+    struct addrinfo hints, *res, *ptr;
+    memset(&hints, 0, sizeof hints);
+    hints.ai_family = AF_UNSPEC; // IPv4 or IPv6
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        return 0;
+    }
+    int count = 0;
+    for (ptr = res; ptr && count < MAX_DNS_ADDRESSES; ptr = ptr->ai_next) {
+        memcpy(&addresses[count].address, ptr->ai_addr, ptr->ai_addrlen);
+        addresses[count].length = ptr->ai_addrlen;
+        addresses[count].family = ptr->ai_family;
+        count++;
+    }
+    freeaddrinfo(res);
+    return count;
+}
+
+// resolver thread: take queued names, resolve them and wake the workers
+static void *run_resolver(void *arg) {
+    dnsCache_t *cache = arg;
+    dnsAddress_t addresses[MAX_DNS_ADDRESSES];
+    while (1) {
+        pthread_mutex_lock(&cache->lock);
+        while (!cache->jobsHead) {
+            pthread_cond_wait(&cache->jobsReady, &cache->lock);
+        }
+        dnsEntry_t *entry = cache->jobsHead;
+        cache->jobsHead = entry->nextJob;
+        if (!cache->jobsHead) {
+            cache->jobsTail = NULL;
+        }
+        pthread_mutex_unlock(&cache->lock);
+
+        // host and port never change once the entry exists
+        int count = cache->staticHosts
+                        ? resolve_static(cache, entry->host, entry->port,
+                                         addresses)
+                        : resolve_getaddrinfo(entry->host, entry->port,
+                                              addresses);
+
+        pthread_mutex_lock(&cache->lock);
+        entry->nAddresses = count;
+        memcpy(entry->addresses, addresses, count * sizeof(dnsAddress_t));
+        entry->expires = time(NULL) +
+                         (count > 0 ? cache->positiveTtl : cache->negativeTtl);
+        entry->pending = 0;
+        cache->nPending--;
+        for (int i = 0; i < cache->nListeners; i++) {
+            uint64_t one = 1;
+            if (write(cache->listeners[i], &one, sizeof(one)) < 0) {
+                // already signalled and not yet read
+            }
+        }
+        pthread_mutex_unlock(&cache->lock);
+    }
+    return NULL;
+}
+
+/*****************************************************************************/
+// create the cache and start nResolvers resolver threads
+dnsCache_t *create_dns_cache(int positiveTtl, int negativeTtl,
+                             char *hostsFile, int nResolvers) {
+    dnsCache_t *cache = calloc(1, sizeof(dnsCache_t));
+    assert(cache);
+    pthread_mutex_init(&cache->lock, NULL);
+    pthread_cond_init(&cache->jobsReady, NULL);
+    cache->nBuckets = DNS_BUCKETS;
+    cache->buckets = calloc(cache->nBuckets, sizeof(dnsEntry_t *));
+    assert(cache->buckets);
+    cache->positiveTtl = positiveTtl;
+    cache->negativeTtl = negativeTtl;
+    if (hostsFile) {
+        load_hosts_file(cache, hostsFile);
+    }
+    for (int i = 0; i < nResolvers; i++) {
+        pthread_t thread;
+        if (pthread_create(&thread, NULL, run_resolver, cache) != 0) {
+            perror("Error: Cannot start resolver\n");
+            exit(EXIT_FAILURE);
+        }
+        pthread_detach(thread);
+    }
+    return cache;
+}
+
+// wake this eventfd whenever a resolution finishes
+void add_dns_listener(dnsCache_t *cache, int eventfd) {
+    pthread_mutex_lock(&cache->lock);
+    assert(cache->nListeners < MAX_DNS_LISTENERS);
+    cache->listeners[cache->nListeners++] = eventfd;
+    pthread_mutex_unlock(&cache->lock);
+}
+
+// queue an entry for a resolver thread, caller holds the lock
+static void queue_resolution(dnsCache_t *cache, dnsEntry_t *entry) {
+    entry->pending = 1;
+    cache->nPending++;
+    entry->nextJob = NULL;
+    if (cache->jobsTail) {
+        cache->jobsTail->nextJob = entry;
+    } else {
+        cache->jobsHead = entry;
+    }
+    cache->jobsTail = entry;
+    pthread_cond_signal(&cache->jobsReady);
+}
+
+// free the entries past their TTL that no resolver is working on, at most
+// once a second, caller holds the lock; they are resolved afresh if asked
+// for again
+static void reap_expired(dnsCache_t *cache, time_t now) {
+    if (now == cache->lastReap) {
+        return;
+    }
+    cache->lastReap = now;
+    for (unsigned long i = 0; i < cache->nBuckets; i++) {
+        dnsEntry_t **link = &cache->buckets[i];
+        while (*link) {
+            dnsEntry_t *entry = *link;
+            if (entry->pending || now < entry->expires) {
+                link = &entry->next;
+                continue;
+            }
+            *link = entry->next;
+            free(entry->host);
+            free(entry->port);
+            free(entry);
+            cache->count--;
+        }
+    }
+}
+
+// copy the addresses of host:port without blocking
+int resolve_cached(dnsCache_t *cache, char *host, char *port,
+                   dnsAddress_t *addresses) {
+    unsigned long hash = hash_host(host, port);
+    pthread_mutex_lock(&cache->lock);
+    dnsEntry_t *entry = cache->buckets[hash & (cache->nBuckets - 1)];
+    while (entry && !(entry->hash == hash && strcmp(entry->host, host) == 0 &&
+                      strcmp(entry->port, port) == 0)) {
+        entry = entry->next;
+    }
+
+    // never seen: queue it and let the worker wait for its eventfd, unless
+    // the table or the queue has no room for it
+    time_t now = time(NULL);
+    if (!entry && cache->count >= MAX_DNS_ENTRIES) {
+        reap_expired(cache, now);
+    }
+    if (!entry && (cache->count >= MAX_DNS_ENTRIES ||
+                   cache->nPending >= MAX_DNS_PENDING)) {
+        pthread_mutex_unlock(&cache->lock);
+        atomic_fetch_add(&cache->misses, 1);
+        return DNS_FAILED;
+    }
+    if (!entry) {
+        entry = calloc(1, sizeof(dnsEntry_t));
+        assert(entry);
+        entry->host = strdup(host);
+        entry->port = strdup(port);
+        entry->hash = hash;
+        entry->next = cache->buckets[hash & (cache->nBuckets - 1)];
+        cache->buckets[hash & (cache->nBuckets - 1)] = entry;
+        cache->count++;
+        queue_resolution(cache, entry);
+        pthread_mutex_unlock(&cache->lock);
+        atomic_fetch_add(&cache->misses, 1);
+        return DNS_PENDING;
+    }
+
+    // expired: refresh in the background, still using a stale answer, if
+    // the queue has room
+    int expired = !entry->pending && now >= entry->expires;
+    if (expired && cache->nPending < MAX_DNS_PENDING) {
+        queue_resolution(cache, entry);
+    }
+    int result = entry->nAddresses;
+    if (result > 0) {
+        memcpy(addresses, entry->addresses, result * sizeof(dnsAddress_t));
+    } else {
+        result = entry->pending ? DNS_PENDING : DNS_FAILED;
+    }
+    pthread_mutex_unlock(&cache->lock);
+    atomic_fetch_add((result == DNS_PENDING) ? &cache->misses : &cache->hits,
+                     1);
+    return result;
+}
+
+/*****************************************************************************/
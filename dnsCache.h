@@ -0,0 +1,87 @@
+#ifndef DNSCACHE
+#define DNSCACHE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <sys/socket.h>
+#include <time.h>
+
+#define DEFAULT_DNS_TTL 60
+#define DEFAULT_DNS_NEGATIVE_TTL 5
+#define MAX_DNS_ADDRESSES 8
+#define MAX_DNS_LISTENERS 256
+
+// results of resolve_cached()
+#define DNS_FAILED -1
+#define DNS_PENDING 0
+
+// one address a host:port resolved to
+typedef struct dnsAddress dnsAddress_t;
+struct dnsAddress {
+    struct sockaddr_storage address;
+    socklen_t length;
+    int family;
+};
+
+// resolution of one host:port, shared by every worker
+typedef struct dnsEntry dnsEntry_t;
+struct dnsEntry {
+    char *host;
+    char *port;
+    unsigned long hash;
+    // a resolver thread is working on it
+    int pending;
+    // valid until expires, then refreshed in the background
+    int nAddresses;
+    dnsAddress_t addresses[MAX_DNS_ADDRESSES];
+    time_t expires;
+    dnsEntry_t *next;
+    dnsEntry_t *nextJob;
+};
+
+// name from a hosts file, used instead of getaddrinfo() when one is given
+typedef struct staticHost staticHost_t;
+struct staticHost {
+    char *name;
+    struct sockaddr_storage address;
+    int family;
+    staticHost_t *next;
+};
+
+typedef struct dnsCache dnsCache_t;
+struct dnsCache {
+    pthread_mutex_t lock;
+    pthread_cond_t jobsReady;
+    dnsEntry_t **buckets;
+    unsigned long nBuckets;
+    // entries held, how many of them are queued or being resolved, and
+    // when expired ones were last looked for to make room
+    int count;
+    int nPending;
+    time_t lastReap;
+    dnsEntry_t *jobsHead;
+    dnsEntry_t *jobsTail;
+    int positiveTtl;
+    int negativeTtl;
+    staticHost_t *staticHosts;
+    // eventfds of workers to wake when a resolution finishes
+    int listeners[MAX_DNS_LISTENERS];
+    int nListeners;
+    atomic_ulong hits;
+    atomic_ulong misses;
+};
+
+// create the cache and start nResolvers resolver threads; with a hosts
+// file, names are only resolved from that file (a stub resolver)
+dnsCache_t *create_dns_cache(int positiveTtl, int negativeTtl,
+                             char *hostsFile, int nResolvers);
+// wake this eventfd whenever a resolution finishes
+void add_dns_listener(dnsCache_t *cache, int eventfd);
+// copy the addresses of host:port without blocking. Returns how many were
+// copied, DNS_PENDING if a resolver thread is still working on it, or
+// DNS_FAILED if it recently failed to resolve or there is no room to
+// resolve it.
+int resolve_cached(dnsCache_t *cache, char *host, char *port,
+                   dnsAddress_t *addresses);
+
+#endif
@@ -0,0 +1,2425 @@
+/*
+Edge-triggered epoll loop driving every connection through a small state
+machine: reading the request, waiting for the origin's address, connecting
+upstream (which also sends the request), relaying the response, or serving
+from cache. Each readiness event simply re-runs the connection's current
+step until a socket would block, so no client or origin can stall the
+others. Bodies of at least the zero-copy threshold are moved
+origin->pipe->client with splice(), teed into a memfd when they are being
+cached, and such cached bodies go out with sendfile(). Client connections
+persist between requests, and pipelined requests are answered one after
+another from what is already buffered. Concurrent misses for a key that is
+already being fetched follow that fetch, streaming the response as it is
+stored instead of asking the origin again. A key found in the disk tier
+waits, like a name being resolved, for a disk thread to read it back. A
+CONNECT turns its connection into a tunnel whose bytes are spliced both ways
+through a pipe per direction, never entering user space. With -t N every
+worker thread runs its own loop on its own SO_REUSEPORT listening socket and
+shares the sharded cache.
+*/
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
+#include <signal.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/sendfile.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include "byteRange.h"
+#include "compression.h"
+#include "diskTier.h"
+#include "eventLoop.h"
+#include "logger.h"
+#include "memPool.h"
+#include "metrics.h"
+#include "peerRing.h"
+#include "snapshot.h"
+#include "sockets.h"
+
+#define MAX_EVENTS 256
+#define MALFORMED_REQUEST 10
+#define TICK_MS 1000
+#define DNS_RESOLVERS 2
+#define SERVE_IOVECS 64
+// room for the freshness of a traced response
+#define TRACE_FRESHNESS 96
+
+#define TUNNEL_ESTABLISHED "HTTP/1.1 200 Connection Established\r\n\r\n"
+#define TUNNEL_LIMIT                                                           \
+    "HTTP/1.1 503 Service Unavailable\r\nContent-Length: 0\r\n"             \
+    "Connection: close\r\n\r\n"
+#define TUNNEL_FAILED                                                          \
+    "HTTP/1.1 502 Bad Gateway\r\nContent-Length: 0\r\n"                     \
+    "Connection: close\r\n\r\n"
+#define HEADERS_TOO_LARGE                                                      \
+    "HTTP/1.1 431 Request Header Fields Too Large\r\nContent-Length: 0\r\n"  \
+    "Connection: close\r\n\r\n"
+
+typedef enum {
+    READING_REQUEST,
+    RESOLVING_HOST,
+    CONNECTING_UPSTREAM,
+    RELAYING,
+    SERVING_CACHE,
+    FOLLOWING,
+    LOADING_DISK,
+    TUNNELING,
+    CLOSED
+} connState_t;
+
+// how the end of a response body is found
+typedef enum {
+    BODY_UNTIL_CLOSE,
+    BODY_LENGTH,
+    BODY_CHUNKED,
+    BODY_NONE
+} bodyFraming_t;
+
+// one client connection and, on a miss, its origin connection
+typedef struct connection conn_t;
+struct connection {
+    connState_t state;
+    int clientfd;
+    int originfd;
+    time_t lastActive;
+
+    // bytes of pipelined requests read after the current one
+    char *leftover;
+    int leftoverLength;
+
+    // headers parsed so far, resumed as more bytes arrive
+    httpParser_t requestParser;
+    httpParser_t responseParser;
+
+    // request in flight, which also collects the response on a miss
+    cacheEntry_t *entry;
+    int cacheable;
+    int sawStale;
+    // the entry is in its shard's in-flight list for followers to join
+    int leading;
+    // stale entry whose validators were sent, answered from on a 304
+    cacheEntry_t *revalidating;
+    // stale entry the client is answered from if the origin fails first
+    cacheEntry_t *fallback;
+    // stale entry a client-less connection is refreshing in the background
+    cacheEntry_t *refreshing;
+    int requestBytes;
+    int requestSent;
+    int requestKeepAlive;
+    // the client takes gzip bodies as they are stored
+    int acceptsGzip;
+    // byte ranges the client asked for, and once the object's length is
+    // known, the 206 or 416 it is sent in their place
+    byteRange_t ranges[MAX_RANGES];
+    int nRanges;
+    rangePlan_t plan;
+    int originReused;
+    // the cluster member the request came from is not asked again; the
+    // member a miss is fetched from instead of the origin, NULL if none
+    int fromPeer;
+    peerNode_t *peer;
+
+    // response relayed from origin; pendingData points at received bytes
+    // the client has not accepted yet, in the cache copy or in buffer
+    long responseBytes;
+    int headerDone;
+    bodyFraming_t framing;
+    // bytes left of a length-framed body; a chunked body keeps it at 1
+    // until its last chunk has gone past
+    long bodyRemaining;
+    chunkParser_t chunkParser;
+    char *pendingData;
+    int pending;
+    int pendingOffset;
+    char *buffer;
+
+    // zero-copy body relay: relayPipe carries the body to the client and
+    // teePipe a duplicate into the entry's memfd when it is being cached
+    int splicing;
+    int pipeBytes;
+    int relayPipe[2];
+    int teePipe[2];
+
+    // CONNECT tunnel: a pipe for each direction (0 carries what the client
+    // sends, 1 what comes back), the bytes each holds, the bytes carried
+    // each way, and whether that direction's sender has finished
+    int tunnel;
+    int tunnelPipe[2][2];
+    int tunnelPipeBytes[2];
+    long tunnelBytes[2];
+    int tunnelEof[2];
+
+    // cached entry being served, or the entry a follower streams
+    cacheEntry_t *served;
+    long servedBytes;
+
+    // when the request's first bytes arrived, the origin connection was
+    // asked for, the request was sent and the response's first bytes
+    // arrived (now_ns(), 0 if not yet), for the stage latencies
+    long parseStarted;
+    long connectStarted;
+    long requestSentAt;
+    long firstByteAt;
+    // when the cache lookup a disk read interrupted began
+    long lookupStarted;
+
+    // connections of this worker waiting on the resolver or the disk
+    // tier, or following another connection's fetch
+    conn_t *waitPrev;
+    conn_t *waitNext;
+    // every open connection of this worker, for idle timeouts
+    conn_t *prev;
+    conn_t *next;
+
+    conn_t *nextClosed;
+};
+
+typedef struct eventLoop loop_t;
+struct eventLoop {
+    int id;
+    int epfd;
+    int listenfd;
+    shardedCache_t *cache;
+    proxyOptions_t *options;
+    workerStats_t stats;
+    upstreamPool_t *upstreams;
+    dnsCache_t *dns;
+    // members of the cluster, NULL if not in one
+    peerRing_t *peers;
+    // written by the resolver, the disk tier and by leaders on any worker
+    // that stored more of a response this worker has followers for
+    int wakefd;
+    conn_t *resolving;
+    conn_t *loading;
+    conn_t *following;
+    atomic_int followingCount;
+    conn_t *connections;
+    // every worker, for waking followers on other workers
+    loop_t *workers;
+    int nWorkers;
+    pthread_t thread;
+    // connections closed during this batch of events, freed after it
+    conn_t *closed;
+    // second up to which this worker's shards were last expired, and
+    // whether any of them had more due than one batch
+    time_t expiredUpTo;
+    int expiryBehind;
+};
+
+// epoll tags of the sockets that do not belong to a connection
+static int listenerTag, wakeTag;
+// CONNECT tunnels open over every worker, kept under options->maxTunnels
+static atomic_int openTunnels;
+
+/**************************************************************************/
+static void drive_connection(loop_t *loop, conn_t *conn);
+
+// true if a non-blocking call failed only because it would block
+static int would_block(void) {
+    return errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR;
+}
+
+// watch a socket for both directions, edge-triggered
+static void watch_socket(loop_t *loop, int fd, conn_t *conn) {
+    struct epoll_event event;
+    event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+    event.data.ptr = conn;
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        perror("Error: Cannot watch socket\n");
+        exit(EXIT_FAILURE);
+    }
+}
+
+// park a connection on one of the worker's waiting lists
+static void start_waiting(conn_t **list, conn_t *conn) {
+    conn->waitPrev = NULL;
+    conn->waitNext = *list;
+    if (*list) {
+        (*list)->waitPrev = conn;
+    }
+    *list = conn;
+}
+
+// take a connection off the waiting list it is on
+static void stop_waiting(conn_t **list, conn_t *conn) {
+    if (conn->waitPrev) {
+        conn->waitPrev->waitNext = conn->waitNext;
+    } else {
+        *list = conn->waitNext;
+    }
+    if (conn->waitNext) {
+        conn->waitNext->waitPrev = conn->waitPrev;
+    }
+    conn->waitPrev = conn->waitNext = NULL;
+}
+
+// stop waiting on the resolver
+static void stop_resolving(loop_t *loop, conn_t *conn) {
+    stop_waiting(&loop->resolving, conn);
+}
+
+/**************************************************************************/
+// nudge every worker that has followers once a fetch some of them may be
+// following has stored more or ended
+static void wake_followers(loop_t *loop, cacheEntry_t *entry) {
+    if (atomic_load(&entry->followers) == 0) {
+        return;
+    }
+    uint64_t one = 1;
+    for (int i = 0; i < loop->nWorkers; i++) {
+        loop_t *worker = &loop->workers[i];
+        if (atomic_load(&worker->followingCount) > 0 &&
+            write(worker->wakefd, &one, sizeof(one)) < 0) {
+            // already signalled and not yet read
+        }
+    }
+}
+
+// a leader's fetch ended: no more followers may join it, and those already
+// following either finish from what it stored or give up on it
+static void end_fetch(loop_t *loop, conn_t *conn, int state) {
+    cacheEntry_t *entry = conn->entry;
+    if (!conn->leading) {
+        return;
+    }
+    conn->leading = 0;
+    cache_t *shard = cache_shard(loop->cache, entry);
+    pthread_mutex_lock(&shard->lock);
+    remove_inflight(shard, entry);
+    pthread_mutex_unlock(&shard->lock);
+    atomic_store(&entry->fetchState, state);
+    wake_followers(loop, entry);
+}
+
+// a follower no longer reads its leader's entry, and is back where its
+// request was handled
+static void stop_following(loop_t *loop, conn_t *conn) {
+    stop_waiting(&loop->following, conn);
+    atomic_fetch_sub(&loop->followingCount, 1);
+    atomic_fetch_sub(&conn->served->followers, 1);
+    conn->state = READING_REQUEST;
+}
+
+// a tunnel is done: free its slot under the limit and its pipes, and log
+// what it carried
+static void close_tunnel(loop_t *loop, conn_t *conn) {
+    atomic_fetch_sub(&openTunnels, 1);
+    atomic_fetch_add(&loop->stats.tunnelsClosed, 1);
+    log_line("Tunnel to %s:%s closed after %ld bytes up, %ld down\n",
+             conn->entry->host, conn->entry->targetPort, conn->tunnelBytes[0],
+             conn->tunnelBytes[1]);
+    for (int i = 0; i < 2; i++) {
+        for (int j = 0; j < 2; j++) {
+            if (conn->tunnelPipe[i][j] >= 0) {
+                close(conn->tunnelPipe[i][j]);
+            }
+        }
+    }
+    conn->tunnel = 0;
+}
+
+// close both sockets and queue the connection to be freed after this batch
+static void close_connection(loop_t *loop, conn_t *conn) {
+    if (conn->state == RESOLVING_HOST) {
+        stop_resolving(loop, conn);
+    }
+    if (conn->state == FOLLOWING) {
+        stop_following(loop, conn);
+    }
+    if (conn->state == LOADING_DISK) {
+        stop_waiting(&loop->loading, conn);
+    }
+    end_fetch(loop, conn, FETCH_FAILED);
+    if (conn->tunnel) {
+        close_tunnel(loop, conn);
+    }
+    if (conn->prev) {
+        conn->prev->next = conn->next;
+    } else {
+        loop->connections = conn->next;
+    }
+    if (conn->next) {
+        conn->next->prev = conn->prev;
+    }
+    pool_free(conn->leftover);
+    pool_free(conn->buffer);
+    conn->leftover = conn->buffer = NULL;
+    free_range_plan(&conn->plan);
+    for (int i = 0; i < 2; i++) {
+        if (conn->relayPipe[i] >= 0) {
+            close(conn->relayPipe[i]);
+        }
+        if (conn->teePipe[i] >= 0) {
+            close(conn->teePipe[i]);
+        }
+    }
+    if (conn->clientfd >= 0) {
+        close(conn->clientfd);
+    }
+    if (conn->originfd >= 0) {
+        close(conn->originfd);
+    }
+    release_cache_entry(conn->entry);
+    release_cache_entry(conn->served);
+    release_cache_entry(conn->revalidating);
+    release_cache_entry(conn->fallback);
+    conn->entry = conn->served = conn->revalidating = conn->fallback = NULL;
+    if (conn->refreshing) {
+        atomic_store(&conn->refreshing->refreshing, 0);
+        release_cache_entry(conn->refreshing);
+        conn->refreshing = NULL;
+    }
+    conn->state = CLOSED;
+    conn->nextClosed = loop->closed;
+    loop->closed = conn;
+}
+
+// answer a CONNECT that gets no tunnel, or a request that cannot be read
+// whole, with a bodiless status small enough to go out in one send, and
+// close
+static void refuse_request(loop_t *loop, conn_t *conn, const char *status) {
+    send(conn->clientfd, status, strlen(status), MSG_NOSIGNAL);
+    close_connection(loop, conn);
+}
+
+// the current exchange is done: close the client if either side asked to
+// (or a background refresh has none), otherwise start on its next request,
+// which may already be buffered
+static void next_request(loop_t *loop, conn_t *conn, int keepAlive) {
+    if (!keepAlive || conn->clientfd < 0) {
+        close_connection(loop, conn);
+        return;
+    }
+    if (conn->originfd >= 0) {
+        close(conn->originfd);
+        conn->originfd = -1;
+    }
+    release_cache_entry(conn->entry);
+    release_cache_entry(conn->served);
+    release_cache_entry(conn->revalidating);
+    release_cache_entry(conn->fallback);
+    conn->served = conn->revalidating = conn->fallback = NULL;
+    conn->servedBytes = 0;
+    conn->nRanges = 0;
+    free_range_plan(&conn->plan);
+    conn->fromPeer = 0;
+    conn->peer = NULL;
+    conn->parseStarted = conn->connectStarted = 0;
+    conn->requestSentAt = conn->firstByteAt = 0;
+    conn->cacheable = 1;
+    conn->sawStale = 0;
+    conn->requestSent = 0;
+    conn->originReused = 0;
+    conn->responseBytes = 0;
+    conn->headerDone = 0;
+    conn->framing = BODY_UNTIL_CLOSE;
+    conn->bodyRemaining = 0;
+    conn->pending = conn->pendingOffset = 0;
+    conn->splicing = 0;
+    reset_http_parser(&conn->requestParser);
+    reset_http_parser(&conn->responseParser);
+    memset(&conn->chunkParser, 0, sizeof(conn->chunkParser));
+    // a pipe still holding bytes of an abandoned body cannot be reused
+    if (conn->pipeBytes > 0) {
+        close(conn->relayPipe[0]);
+        close(conn->relayPipe[1]);
+        conn->relayPipe[0] = conn->relayPipe[1] = -1;
+        conn->pipeBytes = 0;
+    }
+
+    // pipelined bytes become the start of the next request
+    conn->entry = create_cache_entry();
+    conn->entry->request = conn->leftover;
+    conn->requestBytes = conn->leftoverLength;
+    conn->leftover = NULL;
+    conn->leftoverLength = 0;
+    conn->lastActive = time(NULL);
+    conn->state = READING_REQUEST;
+}
+
+// start tracking a connection whose request is read into entry; a
+// background refresh has no client
+static conn_t *new_connection(loop_t *loop, int clientfd,
+                              cacheEntry_t *entry) {
+    conn_t *conn = pool_alloc(sizeof(conn_t));
+    memset(conn, 0, sizeof(conn_t));
+    conn->relayPipe[0] = conn->relayPipe[1] = -1;
+    conn->teePipe[0] = conn->teePipe[1] = -1;
+    for (int i = 0; i < 2; i++) {
+        conn->tunnelPipe[i][0] = conn->tunnelPipe[i][1] = -1;
+    }
+    conn->state = READING_REQUEST;
+    conn->clientfd = clientfd;
+    conn->originfd = -1;
+    conn->entry = entry;
+    conn->cacheable = 1;
+    conn->lastActive = time(NULL);
+    conn->next = loop->connections;
+    if (loop->connections) {
+        loop->connections->prev = conn;
+    }
+    loop->connections = conn;
+    if (clientfd >= 0) {
+        watch_socket(loop, clientfd, conn);
+    }
+    return conn;
+}
+
+// a response framed by its own length (or with no body) leaves the
+// connection usable for another request
+static int response_is_framed(cacheEntry_t *entry) {
+    return entry->statusCode / 100 == 1 || entry->statusCode == 204 ||
+           entry->statusCode == 304 || entry->hasContentLength ||
+           entry->isChunked;
+}
+
+// with -T, log what a request was answered with, in the form --replay
+// reads back: when, the key, the status and body size, and for how long
+// the response may be cached ("no-store" if not at all, "-" if for ever)
+static void trace_request(loop_t *loop, cacheEntry_t *entry, int cacheable) {
+    if (!loop->options->traceRequests || !entry->key) {
+        return;
+    }
+    char freshness[TRACE_FRESHNESS] = "-";
+    if (!cacheable || !entry->isCachable) {
+        strcpy(freshness, "no-store");
+    } else if (entry->isStalable) {
+        snprintf(freshness, sizeof(freshness),
+                 "max-age=%u,stale-while-revalidate=%u,stale-if-error=%u",
+                 entry->maxAge, entry->staleWhileRevalidate,
+                 entry->staleIfError);
+    }
+    long bodyLength = entry->hasContentLength
+                          ? entry->responseContentLength
+                          : entry->responseTotalBytes -
+                                entry->responseHeaderLength -
+                                (long)strlen(EMPTY_LINE);
+    log_line("Trace %ld %s:%s %s %d %ld %s\n", (long)cache_clock(),
+             entry->host, entry->targetPort, entry->path, entry->statusCode,
+             (bodyLength > 0) ? bodyLength : 0, freshness);
+}
+
+/**************************************************************************/
+// evict any stale 'now' un-cacheable request
+static void evict_stale_cache(cacheEntry_t *isStale, cache_t *cache,
+                              cacheEntry_t *entry, int *inCache) {
+    if (isStale) {
+        perform_policy(cache, entry, isStale, inCache);
+    }
+}
+
+// perform all tasks from 2-4 once a response has been fully relayed. The
+// stale entry is looked up again since other connections may have replaced
+// or evicted it while this response was in flight.
+static void perform_caching_stages(cache_t *cache, cacheEntry_t *newCacheEntry,
+                                   int cacheable, int sawStale) {
+    cacheEntry_t *existing = lookup_cache(cache, newCacheEntry);
+    cacheEntry_t *isStale = sawStale ? existing : NULL;
+    int inCache = existing != NULL;
+    // new response is not cacheable (based on byte size)
+    if (!cacheable) {
+        evict_stale_cache(isStale, cache, newCacheEntry, &inCache);
+        release_cache_entry(newCacheEntry);
+        return;
+    }
+    // new response is within byte size, but cache-control says no
+    if (!(newCacheEntry->isCachable)) {
+        log_line("Not caching %s %s\n", newCacheEntry->host,
+                 newCacheEntry->path);
+        evict_stale_cache(isStale, cache, newCacheEntry, &inCache);
+        release_cache_entry(newCacheEntry);
+        return;
+    }
+    // if this key is already cached (previously stale, or filled by another
+    // connection meanwhile), the new entry takes over its key
+    if (existing) {
+        remove_cache_entry(cache, existing);
+        release_cache_entry(existing);
+    }
+    newCacheEntry->cachedTime = cache_clock() - newCacheEntry->initialAge;
+    // larger than the whole cache budget
+    if (!enqueue_cache(cache, newCacheEntry)) {
+        log_line("Not caching %s %s\n", newCacheEntry->host,
+                 newCacheEntry->path);
+        release_cache_entry(newCacheEntry);
+    }
+}
+
+/**************************************************************************/
+// the origin failed, or answered with a server error, before anything was
+// relayed: answer the client from the stale entry kept for that instead
+static void serve_stale(loop_t *loop, conn_t *conn) {
+    log_line("Serving stale %s %s after an origin error\n",
+             conn->fallback->host, conn->fallback->path);
+    if (conn->originfd >= 0) {
+        close(conn->originfd);
+        conn->originfd = -1;
+    }
+    end_fetch(loop, conn, FETCH_FAILED);
+    release_cache_entry(conn->entry);
+    release_cache_entry(conn->revalidating);
+    conn->entry = conn->revalidating = NULL;
+    conn->served = conn->fallback;
+    conn->fallback = NULL;
+    conn->servedBytes = 0;
+    conn->state = SERVING_CACHE;
+    atomic_fetch_add(&loop->stats.staleOnError, 1);
+    trace_request(loop, conn->served, 1);
+}
+
+static void start_forwarding(loop_t *loop, conn_t *conn, int usePool);
+
+// the member owning the key could not be reached, or dropped the request
+// before answering: pass it over for a while and fetch from the origin,
+// caching the response here meanwhile
+static void peer_fallback(loop_t *loop, conn_t *conn) {
+    peer_failed(conn->peer);
+    conn->peer = NULL;
+    conn->cacheable = 1;
+    if (conn->originfd >= 0) {
+        close(conn->originfd);
+        conn->originfd = -1;
+    }
+    atomic_fetch_add(&loop->stats.peerFallbacks, 1);
+    start_forwarding(loop, conn, 1);
+}
+
+// the origin could not be reached or dropped the request
+static void origin_failed(loop_t *loop, conn_t *conn) {
+    if (conn->tunnel) {
+        refuse_request(loop, conn, TUNNEL_FAILED);
+        return;
+    }
+    if (conn->peer) {
+        peer_fallback(loop, conn);
+        return;
+    }
+    if (conn->fallback) {
+        serve_stale(loop, conn);
+        return;
+    }
+    close_connection(loop, conn);
+}
+
+// get an origin connection for the request, from the pool if allowed (a
+// tunnel always gets a fresh one), or park the connection until the
+// resolver has the host's address
+static void start_forwarding(loop_t *loop, conn_t *conn, int usePool) {
+    conn->connectStarted = now_ns();
+    cacheEntry_t *entry = conn->entry;
+    int originfd = forward_request(
+        entry, conn->peer ? conn->peer->host : entry->host,
+        conn->peer ? conn->peer->port : entry->targetPort,
+        (usePool && !conn->tunnel) ? loop->upstreams : NULL, loop->dns,
+        &conn->originReused);
+    if (originfd == FORWARD_RESOLVING) {
+        if (conn->state != RESOLVING_HOST) {
+            start_waiting(&loop->resolving, conn);
+            conn->state = RESOLVING_HOST;
+        }
+        return;
+    }
+    if (conn->state == RESOLVING_HOST) {
+        stop_resolving(loop, conn);
+    }
+    if (originfd < 0) {
+        origin_failed(loop, conn);
+        return;
+    }
+    conn->originfd = originfd;
+    conn->requestSent = 0;
+    watch_socket(loop, conn->originfd, conn);
+    conn->state = CONNECTING_UPSTREAM;
+}
+
+// the resolver finished some names: retry every connection waiting on it
+static void resume_resolving(loop_t *loop) {
+    conn_t *conn = loop->resolving;
+    while (conn) {
+        conn_t *next = conn->waitNext;
+        start_forwarding(loop, conn, 1);
+        if (conn->state != RESOLVING_HOST) {
+            drive_connection(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+// leaders stored more of their responses, or their fetches ended: let
+// every follower of this worker send what it can
+static void resume_following(loop_t *loop) {
+    conn_t *conn = loop->following;
+    while (conn) {
+        conn_t *next = conn->waitNext;
+        drive_connection(loop, conn);
+        conn = next;
+    }
+}
+
+static void lookup_request(loop_t *loop, conn_t *conn, long parsed);
+static void open_tunnel(loop_t *loop, conn_t *conn);
+
+// the disk tier read some entries back: look every request waiting on it
+// up again
+static void resume_loading(loop_t *loop) {
+    conn_t *conn = loop->loading;
+    while (conn) {
+        conn_t *next = conn->waitNext;
+        lookup_request(loop, conn, conn->lookupStarted);
+        if (conn->state != LOADING_DISK) {
+            drive_connection(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+// the resolver, the disk tier or a leader signalled this worker
+static void handle_wakeup(loop_t *loop) {
+    uint64_t count;
+    while (read(loop->wakefd, &count, sizeof(count)) > 0) {
+    }
+    resume_resolving(loop);
+    resume_loading(loop);
+    resume_following(loop);
+}
+
+// true if the request is a plain header, without a body, a range or
+// conditions of the client's own, whose response is the same for every
+// client
+static int is_plain_request(conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    httpParser_t *parser = &conn->requestParser;
+    if (entry->requestLength != parser->headerEnd || entry->rangeLength > 0) {
+        return 0;
+    }
+    for (int i = 0; i < parser->nHeaders; i++) {
+        if (http_header_is(entry->request, &parser->headers[i],
+                           IF_NONE_MATCH) ||
+            http_header_is(entry->request, &parser->headers[i],
+                           IF_MODIFIED_SINCE)) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+// a stale entry can be revalidated with its own validators unless it has
+// none, the request has a body, or the client sent conditions of its own
+static int can_revalidate(conn_t *conn, cacheEntry_t *stale) {
+    return (stale->etagLength > 0 || stale->lastModifiedLength > 0) &&
+           is_plain_request(conn);
+}
+
+// under the shard lock: the entry of a fetch already under way for the
+// request's key, held for the connection to follow, or NULL after making
+// the connection lead a fetch that later misses can follow
+static cacheEntry_t *join_fetch(loop_t *loop, conn_t *conn, cache_t *shard) {
+    cacheEntry_t *entry = conn->entry;
+    if (!loop->options->stage2 || !conn->cacheable || conn->revalidating ||
+        loop->options->coalesceWait <= 0 || !entry->key ||
+        !is_plain_request(conn)) {
+        return NULL;
+    }
+    cacheEntry_t *leader = lookup_inflight(shard, entry);
+    if (leader) {
+        hold_cache_entry(leader);
+        atomic_fetch_add(&leader->followers, 1);
+        return leader;
+    }
+    add_inflight(shard, entry);
+    atomic_store(&entry->fetchState, FETCH_RUNNING);
+    conn->leading = 1;
+    return NULL;
+}
+
+// under the shard lock: for a range miss, the entry of a fetch of the
+// whole object to take the ranges from as it arrives, held for the
+// connection to follow. If none is under way, one is started on a
+// connection without a client, asking without Range and If-Range, and
+// left in fetcher to be driven once the lock is released.
+static cacheEntry_t *join_range_fetch(loop_t *loop, conn_t *conn,
+                                      cache_t *shard, conn_t **fetcher) {
+    cacheEntry_t *entry = conn->entry;
+    httpParser_t *parser = &conn->requestParser;
+    if (!loop->options->stage2 || !conn->cacheable ||
+        loop->options->coalesceWait <= 0 || !entry->key ||
+        entry->ifRangeLength > 0 || entry->requestLength != parser->headerEnd) {
+        return NULL;
+    }
+    cacheEntry_t *leader = lookup_inflight(shard, entry);
+    if (!leader) {
+        const char *drop[] = {RANGE, IF_RANGE, NULL};
+        leader = create_cache_entry();
+        leader->request = rewrite_header(entry->request, parser, NULL, drop,
+                                         "", &leader->requestLength);
+        leader->requestKeepAlive = entry->requestKeepAlive;
+        set_cache_key(leader, entry->host, strlen(entry->host),
+                      entry->targetPort, strlen(entry->targetPort),
+                      entry->path, strlen(entry->path));
+        *fetcher = new_connection(loop, -1, leader);
+        (*fetcher)->sawStale = conn->sawStale;
+        (*fetcher)->leading = 1;
+        add_inflight(shard, leader);
+        atomic_store(&leader->fetchState, FETCH_RUNNING);
+    }
+    hold_cache_entry(leader);
+    atomic_fetch_add(&leader->followers, 1);
+    return leader;
+}
+
+// wait for a leader's fetch of the same key instead of asking the origin
+// again; the connection keeps its own entry to fetch with if that fails
+static void follow_leader(loop_t *loop, conn_t *conn, cacheEntry_t *leader) {
+    log_line("Coalescing %s %s\n", leader->host, leader->path);
+    conn->served = leader;
+    conn->servedBytes = 0;
+    conn->lastActive = time(NULL);
+    start_waiting(&loop->following, conn);
+    atomic_fetch_add(&loop->followingCount, 1);
+    conn->state = FOLLOWING;
+    atomic_fetch_add(&loop->stats.coalesced, 1);
+}
+
+// the cluster member to fetch a miss from instead of the origin: the owner
+// of its key, unless that is this node, the request came from a member
+// already, has a body, or a stale copy here is being revalidated
+static peerNode_t *key_owner(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    if (!loop->peers || !loop->options->stage2 || !conn->cacheable ||
+        conn->fromPeer || conn->sawStale || !entry->key ||
+        entry->requestLength != conn->requestParser.headerEnd) {
+        return NULL;
+    }
+    return peer_owner(loop->peers, entry->hash);
+}
+
+// fetch a miss from the member owning its key, which caches it for the
+// whole cluster; it is not cached here as well
+static void fetch_from_peer(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    log_line("Fetching %s %s from peer %s\n", entry->host, entry->path,
+             conn->peer->name);
+    conn->cacheable = 0;
+    add_via(entry, loop->peers->self->name, PEER_VIA_TOKEN);
+    atomic_fetch_add(&conn->peer->fetches, 1);
+    atomic_fetch_add(&loop->stats.misses, 1);
+    atomic_fetch_add(&loop->stats.peerFetches, 1);
+    start_forwarding(loop, conn, 1);
+}
+
+// true if a stale entry is less than window seconds past its max-age
+static int within_stale_window(cacheEntry_t *stale, unsigned int window) {
+    return cache_clock() - stale->cachedTime < (time_t)stale->maxAge + window;
+}
+
+// fetch a stale entry again on a connection without a client, taking over
+// the request (and the validators to send with it) from conn
+static void start_refresh(loop_t *loop, conn_t *conn, cacheEntry_t *stale) {
+    conn_t *refresh = new_connection(loop, -1, conn->entry);
+    hold_cache_entry(stale);
+    refresh->refreshing = stale;
+    refresh->sawStale = 1;
+    refresh->revalidating = conn->revalidating;
+    conn->entry = conn->revalidating = NULL;
+    if (refresh->revalidating) {
+        add_validators(refresh->entry, refresh->revalidating);
+    }
+    start_forwarding(loop, refresh, 1);
+    drive_connection(loop, refresh);
+}
+
+// answer the client from a stale entry within its stale-while-revalidate
+// window straight away, refreshing it in the background if asked to
+static void serve_while_revalidating(loop_t *loop, conn_t *conn,
+                                     cacheEntry_t *stale, int refresh) {
+    log_line("Serving stale %s %s while revalidating\n", stale->host,
+             stale->path);
+    if (refresh) {
+        start_refresh(loop, conn, stale);
+    }
+    release_cache_entry(conn->entry);
+    release_cache_entry(conn->revalidating);
+    conn->entry = conn->revalidating = NULL;
+    conn->served = stale;
+    conn->servedBytes = 0;
+    conn->state = SERVING_CACHE;
+    atomic_fetch_add(&loop->stats.hits, 1);
+    atomic_fetch_add(&loop->stats.staleServed, 1);
+    trace_request(loop, stale, 1);
+}
+
+// under the shard lock: a range request whose If-Range no longer names the
+// cached entry is sent the whole object instead
+static void check_if_range(conn_t *conn, cache_t *shard) {
+    cacheEntry_t *entry = conn->entry;
+    cacheEntry_t *cached = lookup_cache(shard, entry);
+    if (conn->nRanges && entry->ifRangeLength > 0 && cached &&
+        !if_range_matches(cached, entry->request + entry->ifRange,
+                          entry->ifRangeLength)) {
+        conn->nRanges = 0;
+    }
+}
+
+// the whole request header (ending at headerEnd) has arrived: serve it from
+// cache or forward it
+static void handle_request(loop_t *loop, conn_t *conn, int headerEnd) {
+    cacheEntry_t *entry = conn->entry;
+    int stored = (conn->requestBytes <= MAX_BYTE) ? conn->requestBytes : 0;
+    entry->requestLength = (stored > 0) ? headerEnd : 0;
+    extract_headers(entry, &conn->requestParser, 1);
+
+    // a GET has no body, so anything after its header is the next
+    // pipelined request; one that carries a body is forwarded whole and
+    // the connection closed after it
+    if (entry->hasContentLength && entry->responseContentLength > 0) {
+        entry->requestKeepAlive = 0;
+        entry->requestLength = stored;
+    } else if (stored > headerEnd) {
+        conn->leftoverLength = stored - headerEnd;
+        conn->leftover = pool_alloc(conn->leftoverLength);
+        memcpy(conn->leftover, entry->request + headerEnd,
+               conn->leftoverLength);
+    }
+    entry->hasContentLength = entry->responseContentLength = 0;
+    if (entry->requestLength >= MAX_REQUEST_LENGTH) {
+        conn->cacheable = 0;
+    }
+
+    // handle malformed request, including one whose body has no end that
+    // can be trusted
+    if (entry->requestLength < MALFORMED_REQUEST || !entry->path ||
+        entry->badContentLength) {
+        close_connection(loop, conn);
+        return;
+    }
+    // header lines past those recorded may frame the request, so one with
+    // too many is refused rather than half read
+    if (conn->requestParser.overflowed) {
+        refuse_request(loop, conn, HEADERS_TOO_LARGE);
+        return;
+    }
+
+    if (entry->isTunnel) {
+        open_tunnel(loop, conn);
+        return;
+    }
+
+    conn->requestKeepAlive = entry->requestKeepAlive;
+    conn->acceptsGzip = entry->acceptsGzip;
+    conn->nRanges = parse_ranges(entry->request + entry->range,
+                                 entry->rangeLength, conn->ranges);
+    // a member of the cluster names itself in a Via line of what it sends
+    for (int i = 0; loop->peers && i < conn->requestParser.nHeaders; i++) {
+        httpHeader_t *header = &conn->requestParser.headers[i];
+        if (http_header_is(entry->request, header, VIA) &&
+            http_find(entry->request + header->value, header->valueLength,
+                      PEER_VIA_TOKEN) > -1) {
+            conn->fromPeer = 1;
+            atomic_fetch_add(&loop->stats.peerReceived, 1);
+        }
+    }
+    long parsed = record_latency(&loop->stats, STAGE_PARSE, conn->parseStarted);
+    lookup_request(loop, conn, parsed);
+}
+
+// under the shard lock: promote the request's key from the disk tier if it
+// is there and not in memory. Returns 0 if a disk thread is reading it
+// back, the connection then waiting for the wakeup that says so.
+static int load_from_disk(loop_t *loop, conn_t *conn, cache_t *shard,
+                          long parsed, int *promoted) {
+    cacheEntry_t *loaded = NULL;
+    int found = DISK_MISS;
+    if (shard->disk && loop->options->stage2 && conn->cacheable &&
+        !lookup_cache(shard, conn->entry)) {
+        found = read_disk(shard->disk, conn->entry, &loaded);
+    }
+    if (found == DISK_PENDING) {
+        if (conn->state != LOADING_DISK) {
+            start_waiting(&loop->loading, conn);
+            conn->state = LOADING_DISK;
+            conn->lookupStarted = parsed;
+        }
+        return 0;
+    }
+    if (conn->state == LOADING_DISK) {
+        stop_waiting(&loop->loading, conn);
+        conn->state = READING_REQUEST;
+    }
+    if (found == DISK_HIT) {
+        *promoted = enqueue_cache(shard, loaded);
+        if (!*promoted) {
+            release_cache_entry(loaded);
+        }
+    }
+    return 1;
+}
+
+// look a parsed request up in its key's shard: serve it from cache, follow
+// a fetch of the same key, or forward it
+static void lookup_request(loop_t *loop, conn_t *conn, long parsed) {
+    cacheEntry_t *entry = conn->entry;
+
+    // checking for any stale cache and apply the replacement policy on this
+    // key's shard, once anything the disk tier held for it is back
+    cache_t *shard = cache_shard(loop->cache, entry);
+    int inCache = 0, promoted = 0;
+    pthread_mutex_lock(&shard->lock);
+    if (!load_from_disk(loop, conn, shard, parsed, &promoted)) {
+        pthread_mutex_unlock(&shard->lock);
+        return;
+    }
+    // a gzip entry too large to inflate on the loop is fetched again for a
+    // client that does not take gzip, and relayed as the origin sends it
+    cacheEntry_t *cached = lookup_cache(shard, entry);
+    if (cached && cached->isGzip && !conn->acceptsGzip &&
+        !inflates_inline(cached)) {
+        conn->cacheable = 0;
+    }
+    cacheEntry_t *stale = check_stale_cache(shard, entry);
+    conn->sawStale = stale != NULL;
+    if (stale) {
+        atomic_fetch_add(&loop->stats.staleFound, 1);
+    }
+    if (stale && loop->options->stage2 && conn->cacheable &&
+        can_revalidate(conn, stale)) {
+        hold_cache_entry(stale);
+        conn->revalidating = stale;
+    }
+    if (loop->options->stage2 && conn->cacheable) {
+        perform_policy(shard, entry, NULL, &inCache);
+    }
+
+    if (inCache) {
+        check_if_range(conn, shard);
+    }
+
+    // fetch cache that is not stale
+    if (inCache && !conn->sawStale) {
+        conn->served = fetch_cache(entry, shard);
+        pthread_mutex_unlock(&shard->lock);
+        record_latency(&loop->stats, STAGE_LOOKUP, parsed);
+        conn->entry = NULL;
+        conn->state = SERVING_CACHE;
+        atomic_fetch_add(&loop->stats.hits, 1);
+        atomic_fetch_add(&loop->stats.diskHits, promoted);
+        trace_request(loop, conn->served, 1);
+        return;
+    }
+    // a stale entry may still be served at once while only one request
+    // refreshes it, or kept to stand in for an origin error
+    if (inCache &&
+        within_stale_window(stale, stale->staleWhileRevalidate)) {
+        int refresh = is_plain_request(conn) &&
+                      !atomic_exchange(&stale->refreshing, 1);
+        hold_cache_entry(stale);
+        pthread_mutex_unlock(&shard->lock);
+        record_latency(&loop->stats, STAGE_LOOKUP, parsed);
+        serve_while_revalidating(loop, conn, stale, refresh);
+        atomic_fetch_add(&loop->stats.diskHits, promoted);
+        return;
+    }
+    if (inCache && within_stale_window(stale, stale->staleIfError)) {
+        hold_cache_entry(stale);
+        conn->fallback = stale;
+    }
+    // a miss for a key another member of the cluster owns is its to fetch
+    conn->peer = key_owner(loop, conn);
+    if (conn->peer) {
+        pthread_mutex_unlock(&shard->lock);
+        record_latency(&loop->stats, STAGE_LOOKUP, parsed);
+        fetch_from_peer(loop, conn);
+        return;
+    }
+
+    // a miss follows the fetch already under way for its key, or leads
+    // one; a range miss follows a fetch of the whole object
+    conn_t *fetcher = NULL;
+    cacheEntry_t *leader = conn->nRanges
+                               ? join_range_fetch(loop, conn, shard, &fetcher)
+                               : join_fetch(loop, conn, shard);
+    pthread_mutex_unlock(&shard->lock);
+    record_latency(&loop->stats, STAGE_LOOKUP, parsed);
+    if (leader) {
+        follow_leader(loop, conn, leader);
+        if (fetcher) {
+            start_forwarding(loop, fetcher, 1);
+            drive_connection(loop, fetcher);
+        }
+        return;
+    }
+    atomic_fetch_add(&loop->stats.misses, 1);
+
+    // if not in cache, forward to host server normally, conditionally if
+    // the stale copy has validators
+    if (conn->revalidating) {
+        add_validators(entry, conn->revalidating);
+    }
+    start_forwarding(loop, conn, 1);
+}
+
+// read client's request until its header is complete
+static void read_request(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    char discard[BUFFER_SIZE];
+
+    // a pipelined request may already be complete
+    if (conn->requestBytes > 0) {
+        if (!conn->parseStarted) {
+            conn->parseStarted = now_ns();
+        }
+        int headerEnd = feed_http_parser(&conn->requestParser, entry->request,
+                                         conn->requestBytes);
+        if (headerEnd > 0) {
+            handle_request(loop, conn, headerEnd);
+            return;
+        }
+    }
+
+    while (1) {
+        // store messages in cache within max bytes, growing the pooled
+        // buffer only as far as the request actually needs
+        char *target = discard;
+        int room = BUFFER_SIZE;
+        if (conn->requestBytes < MAX_BYTE) {
+            room = MAX_BYTE - conn->requestBytes;
+            room = (room < BUFFER_SIZE) ? room : BUFFER_SIZE;
+            entry->request =
+                pool_reserve(entry->request, conn->requestBytes + room);
+            target = entry->request + conn->requestBytes;
+        }
+        int bytesRead = recv(conn->clientfd, target, room, 0);
+        if (bytesRead < 0 && would_block()) {
+            return;
+        }
+        if (bytesRead <= 0) {
+            close_connection(loop, conn);
+            return;
+        }
+        if (target == discard) {
+            conn->cacheable = 0;
+        }
+        if (conn->requestBytes == 0) {
+            conn->parseStarted = now_ns();
+        }
+        conn->requestBytes += bytesRead;
+        conn->lastActive = time(NULL);
+
+        int stored =
+            (conn->requestBytes <= MAX_BYTE) ? conn->requestBytes : MAX_BYTE;
+        // handle malformed header
+        if (conn->requestBytes < MALFORMED &&
+            my_memmem(entry->request, stored, MALFORMED_END,
+                      strlen(MALFORMED_END)) > -1) {
+            close_connection(loop, conn);
+            return;
+        }
+        int headerEnd =
+            feed_http_parser(&conn->requestParser, entry->request, stored);
+        if (headerEnd > 0) {
+            handle_request(loop, conn, headerEnd);
+            return;
+        }
+    }
+}
+
+// a pooled connection the origin closed just before it was reused: send the
+// request again on a fresh connection
+static void retry_upstream(loop_t *loop, conn_t *conn) {
+    close(conn->originfd);
+    conn->originfd = -1;
+    start_forwarding(loop, conn, 0);
+}
+
+// send the request once the origin connection is writable
+static void send_request(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    while (conn->requestSent < entry->requestLength) {
+        int sent = send(conn->originfd, entry->request + conn->requestSent,
+                        entry->requestLength - conn->requestSent, 0);
+        if (sent < 0 && would_block()) {
+            return;
+        }
+        if (sent <= 0 && conn->originReused) {
+            retry_upstream(loop, conn);
+            return;
+        }
+        if (sent <= 0) {
+            perror("Error: Failed to send to host\n");
+            origin_failed(loop, conn);
+            return;
+        }
+        conn->requestSent += sent;
+    }
+    conn->requestSentAt =
+        record_latency(&loop->stats, STAGE_CONNECT, conn->connectStarted);
+    conn->state = RELAYING;
+}
+
+// hand the origin connection back to the pool if the response ended exactly
+// where its framing said and neither side asked to close
+static void release_upstream(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    if (!loop->upstreams || conn->framing == BODY_UNTIL_CLOSE ||
+        conn->bodyRemaining != 0 || !entry->requestKeepAlive ||
+        !entry->responseKeepAlive) {
+        return;
+    }
+    epoll_ctl(loop->epfd, EPOLL_CTL_DEL, conn->originfd, NULL);
+    checkin_upstream(loop->upstreams,
+                     conn->peer ? conn->peer->host : entry->host,
+                     conn->peer ? conn->peer->port : entry->targetPort,
+                     conn->originfd);
+    conn->originfd = -1;
+}
+
+// the origin confirmed a stale entry with a 304: refresh its freshness
+// (taking a new max-age from the 304 if it sent one) and answer the client
+// from it without fetching the body again
+static void serve_revalidated(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry, *stale = conn->revalidating;
+    release_upstream(loop, conn);
+    if (conn->originfd >= 0) {
+        close(conn->originfd);
+        conn->originfd = -1;
+    }
+    cache_t *shard = cache_shard(loop->cache, stale);
+    pthread_mutex_lock(&shard->lock);
+    stale->cachedTime = cache_clock() - entry->initialAge;
+    if (entry->isStalable) {
+        stale->maxAge = entry->maxAge;
+        stale->staleWhileRevalidate = entry->staleWhileRevalidate;
+        stale->staleIfError = entry->staleIfError;
+    }
+    reschedule_expiry(shard, stale);
+    pthread_mutex_unlock(&shard->lock);
+    log_line("Revalidated %s %s\n", stale->host, stale->path);
+    atomic_fetch_add(&loop->stats.revalidated, 1);
+    if (conn->clientfd < 0) {
+        close_connection(loop, conn);
+        return;
+    }
+
+    release_cache_entry(entry);
+    conn->entry = conn->revalidating = NULL;
+    conn->served = stale;
+    conn->servedBytes = 0;
+    conn->state = SERVING_CACHE;
+    trace_request(loop, stale, 1);
+}
+
+// followers are only given a response that is being stored whole
+static int fetch_shareable(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    long headerBytes = entry->responseHeaderLength + strlen(EMPTY_LINE);
+    return conn->headerDone && conn->cacheable && entry->isCachable &&
+           entry->statusCode != 304 &&
+           (conn->framing != BODY_LENGTH ||
+            headerBytes + entry->responseContentLength <=
+                loop->options->objectLimit);
+}
+
+// let followers send the part of a leader's response stored so far: the
+// first block and segments, or the header and what the memfd holds
+static void publish_fetch(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    if (!conn->leading || !conn->headerDone) {
+        return;
+    }
+    if (!fetch_shareable(loop, conn)) {
+        end_fetch(loop, conn, FETCH_FAILED);
+        // a fetch made only for range followers has nobody left to serve
+        if (conn->clientfd < 0 && !conn->refreshing) {
+            close_connection(loop, conn);
+        }
+        return;
+    }
+    atomic_store(&entry->published,
+                 conn->splicing ? entry->blockLength + entry->bodyLength
+                                : conn->responseBytes);
+    wake_followers(loop, entry);
+}
+
+// gzip a response about to be cached, counting what it saved and cost
+static void compress_response(loop_t *loop, cacheEntry_t *entry) {
+    long started = now_ns();
+    long before = entry->responseContentLength;
+    if (compress_entry(entry, loop->options->gzipLevel)) {
+        atomic_fetch_add(&loop->stats.gzipped, 1);
+        atomic_fetch_add(&loop->stats.gzipInBytes, before);
+        atomic_fetch_add(&loop->stats.gzipOutBytes,
+                         entry->responseContentLength);
+    }
+    atomic_fetch_add(&loop->stats.gzipNs, now_ns() - started);
+}
+
+// response fully relayed (or origin closed): cache it and finish up
+static void finish_response(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    if (conn->firstByteAt) {
+        record_latency(&loop->stats, STAGE_RELAY, conn->firstByteAt);
+    }
+    if (conn->revalidating && conn->headerDone && entry->statusCode == 304) {
+        serve_revalidated(loop, conn);
+        return;
+    }
+    if (conn->fallback && !conn->headerDone) {
+        serve_stale(loop, conn);
+        return;
+    }
+    entry->responseTotalBytes = conn->responseBytes;
+    // a framed body the origin cut short is not worth caching
+    if (conn->framing != BODY_UNTIL_CLOSE && conn->bodyRemaining != 0) {
+        conn->cacheable = 0;
+    }
+    // a 304 for the client's own conditions has no body to cache, and says
+    // nothing against a stale copy
+    if (conn->headerDone && entry->statusCode == 304) {
+        conn->cacheable = conn->sawStale = 0;
+    }
+    // nor is part of an object the origin sent for a client's own range
+    if (conn->headerDone && entry->statusCode == 206) {
+        conn->cacheable = 0;
+    }
+    if (conn->headerDone) {
+        release_upstream(loop, conn);
+    }
+    if (conn->headerDone) {
+        // bodies without a Content-Length report what was relayed
+        long bodyLength = entry->hasContentLength
+                              ? entry->responseContentLength
+                              : conn->responseBytes -
+                                    entry->responseHeaderLength -
+                                    (long)strlen(EMPTY_LINE);
+        log_line("Response body length %ld\n", bodyLength);
+    } else {
+        conn->cacheable = 0;
+    }
+    if (conn->headerDone && conn->clientfd >= 0) {
+        trace_request(loop, entry, conn->cacheable);
+    }
+    // the client can send another request only if the body ended where
+    // its framing said and neither side asked to close
+    int keepAlive = conn->headerDone && conn->framing != BODY_UNTIL_CLOSE &&
+                    conn->bodyRemaining == 0 && entry->requestKeepAlive &&
+                    entry->responseKeepAlive;
+    // followers get the rest of a complete response, or give up on it
+    int leading = conn->leading;
+    if (leading && fetch_shareable(loop, conn)) {
+        atomic_store(&entry->published, conn->responseBytes);
+        end_fetch(loop, conn, FETCH_DONE);
+    } else {
+        end_fetch(loop, conn, FETCH_FAILED);
+    }
+    // text is gzipped before it is cached, while no follower can still be
+    // reading the bytes it replaces
+    if (loop->options->stage2 && loop->options->gzipLevel > 0 &&
+        conn->cacheable && entry->isCachable &&
+        atomic_load(&entry->followers) == 0) {
+        compress_response(loop, entry);
+    }
+    if (loop->options->stage2) {
+        cache_t *shard = cache_shard(loop->cache, entry);
+        pthread_mutex_lock(&shard->lock);
+        // a leader reserved the whole first block up front; once nobody
+        // can be reading it, it shrinks to what the response used
+        if (leading && atomic_load(&entry->followers) == 0 &&
+            entry->responseTotalBytes < entry->blockLength) {
+            entry->response =
+                pool_realloc(entry->response, entry->responseTotalBytes);
+        }
+        perform_caching_stages(shard, entry, conn->cacheable, conn->sawStale);
+        pthread_mutex_unlock(&shard->lock);
+        conn->entry = NULL;
+    }
+    next_request(loop, conn, keepAlive);
+}
+
+// make a pipe of the relay chunk size, returning 0 if none can be made
+static int open_pipe(loop_t *loop, int *ends) {
+    if (ends[0] >= 0) {
+        return 1;
+    }
+    if (pipe2(ends, O_NONBLOCK | O_CLOEXEC) < 0) {
+        ends[0] = ends[1] = -1;
+        return 0;
+    }
+    fcntl(ends[1], F_SETPIPE_SZ, loop->options->relayChunk);
+    return 1;
+}
+
+// the header is parsed: decide whether the body is large enough to splice
+// (to a client, which a background refresh does not have), and if it is
+// also being cached, move the body bytes already received into a memfd
+// that the rest of the body is teed into
+static void start_splicing(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    if (conn->framing != BODY_LENGTH || conn->clientfd < 0 ||
+        entry->responseContentLength < loop->options->zeroCopyThreshold ||
+        !open_pipe(loop, conn->relayPipe)) {
+        return;
+    }
+    conn->splicing = 1;
+
+    int headerBytes = entry->responseHeaderLength + strlen(EMPTY_LINE);
+    int caching = loop->options->stage2 && conn->cacheable &&
+                  entry->isCachable &&
+                  headerBytes + entry->responseContentLength <=
+                      loop->options->objectLimit &&
+                  open_pipe(loop, conn->teePipe);
+    if (caching) {
+        entry->bodyFd = memfd_create("htproxy-body", MFD_CLOEXEC);
+    }
+    long received = conn->responseBytes - headerBytes;
+    if (entry->bodyFd < 0 ||
+        write(entry->bodyFd, entry->response + headerBytes, received) !=
+            received) {
+        // not cached: only the header stays in the entry
+        conn->cacheable = 0;
+        return;
+    }
+    entry->bodyLength = received;
+}
+
+// fix how much of the response the first block holds once the header is
+// parsed: just the header when the body goes to a memfd, otherwise as much
+// of the response as fits. A leader reserves it whole so that the block
+// followers read from never moves.
+static void set_first_block(conn_t *conn, int headerEnd) {
+    cacheEntry_t *entry = conn->entry;
+    if (conn->splicing) {
+        entry->blockLength = headerEnd;
+        return;
+    }
+    long expected = MAX_BYTE;
+    if (conn->framing == BODY_LENGTH) {
+        expected = headerEnd + (long)entry->responseContentLength;
+    } else if (conn->framing == BODY_NONE) {
+        expected = conn->responseBytes;
+    }
+    expected = (expected > conn->responseBytes) ? expected
+                                                : conn->responseBytes;
+    entry->blockLength = (expected < MAX_BYTE) ? expected : MAX_BYTE;
+    if (conn->leading) {
+        char *block = entry->response;
+        entry->response = pool_reserve(entry->response, entry->blockLength);
+        // the bytes just received are relayed from where the block moved
+        if (conn->pendingData != conn->buffer) {
+            conn->pendingData = entry->response + (conn->pendingData - block);
+        }
+    }
+}
+
+// keep a copy of relayed bytes for the cache and track the response framing
+static void track_response(loop_t *loop, conn_t *conn, int bytesRead) {
+    cacheEntry_t *entry = conn->entry;
+    conn->responseBytes += bytesRead;
+
+    // track the ending of either a header or a body
+    if (conn->headerDone && conn->framing == BODY_CHUNKED) {
+        conn->bodyRemaining = !feed_chunk_parser(&conn->chunkParser,
+                                                 conn->pendingData, bytesRead);
+        return;
+    }
+    if (conn->headerDone) {
+        conn->bodyRemaining -= bytesRead;
+        return;
+    }
+    int stored =
+        (conn->responseBytes <= MAX_BYTE) ? conn->responseBytes : MAX_BYTE;
+    int headerEnd =
+        feed_http_parser(&conn->responseParser, entry->response, stored);
+    if (headerEnd > 0) {
+        entry->responseHeaderLength = headerEnd - strlen(EMPTY_LINE);
+        extract_headers(entry, &conn->responseParser, 0);
+        conn->headerDone = 1;
+        long received = conn->responseBytes - headerEnd;
+        conn->bodyRemaining = entry->responseContentLength - received;
+        // chunked framing wins over a Content-Length sent alongside it
+        if (entry->statusCode / 100 == 1 || entry->statusCode == 204 ||
+            entry->statusCode == 304) {
+            conn->framing = BODY_NONE;
+            conn->bodyRemaining = 0;
+        } else if (entry->isChunked) {
+            conn->framing = BODY_CHUNKED;
+            conn->bodyRemaining = !feed_chunk_parser(
+                &conn->chunkParser, entry->response + headerEnd, received);
+        } else if (entry->hasContentLength) {
+            conn->framing = BODY_LENGTH;
+        } else {
+            conn->framing = BODY_UNTIL_CLOSE;
+        }
+        // a body longer than the largest object cached is only relayed
+        if (conn->framing == BODY_LENGTH &&
+            entry->responseContentLength >
+                loop->options->objectLimit - headerEnd) {
+            conn->cacheable = 0;
+        }
+        start_splicing(loop, conn);
+        set_first_block(conn, headerEnd);
+    }
+}
+
+// true if the client hung up while we were waiting on the origin
+static int client_gone(conn_t *conn) {
+    char peek;
+    return recv(conn->clientfd, &peek, 1, MSG_PEEK | MSG_DONTWAIT) == 0;
+}
+
+// where the next bytes from the origin go: straight into the cache copy
+// while the header is incomplete or the response may still be cached
+// (the first max bytes in response, the rest in segments up to the object
+// limit), otherwise into the relay buffer
+static char *receive_target(loop_t *loop, conn_t *conn, int *room,
+                            responseSegment_t **segment) {
+    cacheEntry_t *entry = conn->entry;
+    int chunk = loop->options->relayChunk;
+    int storing = !conn->headerDone || (loop->options->stage2 &&
+                                        conn->cacheable && entry->isCachable);
+    int blockLength = conn->headerDone ? entry->blockLength : MAX_BYTE;
+    *segment = NULL;
+    if (storing && conn->responseBytes < blockLength) {
+        *room = blockLength - conn->responseBytes;
+        *room = (*room < chunk) ? *room : chunk;
+        entry->response =
+            pool_reserve(entry->response, conn->responseBytes + *room);
+        return entry->response + conn->responseBytes;
+    }
+    long limitRoom = loop->options->objectLimit - conn->responseBytes;
+    if (storing && conn->headerDone && limitRoom > 0) {
+        *segment = writable_segment(entry);
+        *room = SEGMENT_DATA - (*segment)->length;
+        *room = (*room < chunk) ? *room : chunk;
+        *room = (*room < limitRoom) ? *room : limitRoom;
+        return (*segment)->data + (*segment)->length;
+    }
+    if (!conn->buffer) {
+        conn->buffer = pool_alloc(chunk);
+    }
+    *room = chunk;
+    return conn->buffer;
+}
+
+// duplicate what was just spliced into relayPipe into the entry's memfd,
+// giving up on caching the response if that fails (the memfd stays open
+// for any follower still sending what it holds)
+static void tee_body(conn_t *conn, int moved) {
+    cacheEntry_t *entry = conn->entry;
+    ssize_t teed = tee(conn->relayPipe[0], conn->teePipe[1], moved,
+                       SPLICE_F_NONBLOCK);
+    loff_t offset = entry->bodyLength;
+    while (teed > 0) {
+        ssize_t written = splice(conn->teePipe[0], NULL, entry->bodyFd,
+                                 &offset, teed, SPLICE_F_MOVE);
+        if (written <= 0) {
+            break;
+        }
+        teed -= written;
+        entry->bodyLength += written;
+    }
+    if (teed != 0 || entry->bodyLength != offset) {
+        // a tee pipe left holding bytes would misalign the next body
+        close(conn->teePipe[0]);
+        close(conn->teePipe[1]);
+        conn->teePipe[0] = conn->teePipe[1] = -1;
+        conn->cacheable = 0;
+    }
+}
+
+// relay a large body origin->pipe->client without copying it through user
+// space, teeing it into the cache's memfd if it is being cached
+static void splice_response(loop_t *loop, conn_t *conn) {
+    while (1) {
+        while (conn->pipeBytes > 0) {
+            ssize_t moved = splice(conn->relayPipe[0], NULL, conn->clientfd,
+                                   NULL, conn->pipeBytes,
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0 && would_block()) {
+                return;
+            }
+            if (moved <= 0) {
+                close_connection(loop, conn);
+                return;
+            }
+            conn->pipeBytes -= moved;
+            atomic_fetch_add(&loop->stats.bytesServed, moved);
+        }
+        if (conn->bodyRemaining <= 0) {
+            finish_response(loop, conn);
+            return;
+        }
+
+        long want = (conn->bodyRemaining < loop->options->relayChunk)
+                        ? conn->bodyRemaining
+                        : loop->options->relayChunk;
+        ssize_t moved = splice(conn->originfd, NULL, conn->relayPipe[1], NULL,
+                               want, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0 && would_block()) {
+            if (client_gone(conn)) {
+                close_connection(loop, conn);
+            }
+            return;
+        }
+        if (moved <= 0) {
+            finish_response(loop, conn);
+            return;
+        }
+        if (conn->cacheable && conn->entry->bodyFd >= 0) {
+            tee_body(conn, moved);
+        }
+        conn->pipeBytes = moved;
+        conn->bodyRemaining -= moved;
+        conn->responseBytes += moved;
+        publish_fetch(loop, conn);
+    }
+}
+
+// while a stale entry may still answer the client, nothing reaches it
+// before the status is known: a 304 to revalidation is answered from the
+// stale entry, a server error from the one kept for origin errors, and
+// anything else is relayed whole
+static void hold_response(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *entry = conn->entry;
+    if (!conn->headerDone ||
+        (conn->revalidating && entry->statusCode == 304)) {
+        conn->pending = 0;
+        return;
+    }
+    if (conn->fallback && entry->statusCode / 100 == 5) {
+        serve_stale(loop, conn);
+        return;
+    }
+    // the header is kept in response, unless it outgrew max bytes
+    if (conn->responseBytes > MAX_BYTE) {
+        close_connection(loop, conn);
+        return;
+    }
+    release_cache_entry(conn->revalidating);
+    release_cache_entry(conn->fallback);
+    conn->revalidating = conn->fallback = NULL;
+    conn->pendingData = entry->response;
+    conn->pending = conn->responseBytes;
+}
+
+// relay host's response to the client, keeping a copy for the cache
+static void relay_response(loop_t *loop, conn_t *conn) {
+    while (1) {
+        // flush what the client has not accepted yet; a background refresh
+        // has nobody to relay to
+        if (conn->clientfd < 0) {
+            conn->pendingOffset = conn->pending;
+        }
+        while (conn->pendingOffset < conn->pending) {
+            int sent =
+                send(conn->clientfd, conn->pendingData + conn->pendingOffset,
+                     conn->pending - conn->pendingOffset, 0);
+            if (sent < 0 && would_block()) {
+                return;
+            }
+            if (sent <= 0) {
+                close_connection(loop, conn);
+                return;
+            }
+            conn->pendingOffset += sent;
+            atomic_fetch_add(&loop->stats.bytesServed, sent);
+        }
+        if (conn->splicing) {
+            splice_response(loop, conn);
+            return;
+        }
+        if (conn->headerDone && conn->framing != BODY_UNTIL_CLOSE &&
+            conn->bodyRemaining <= 0) {
+            finish_response(loop, conn);
+            return;
+        }
+
+        int room;
+        responseSegment_t *segment;
+        char *target = receive_target(loop, conn, &room, &segment);
+        int bytesRead = recv(conn->originfd, target, room, 0);
+        if (bytesRead < 0 && would_block()) {
+            if (client_gone(conn)) {
+                close_connection(loop, conn);
+            }
+            return;
+        }
+        if (bytesRead <= 0 && conn->responseBytes == 0 && conn->originReused) {
+            retry_upstream(loop, conn);
+            return;
+        }
+        if (bytesRead <= 0 && conn->responseBytes == 0 && conn->peer) {
+            peer_fallback(loop, conn);
+            return;
+        }
+        if (bytesRead < 0) {
+            conn->cacheable = 0;
+        }
+        if (bytesRead <= 0) {
+            finish_response(loop, conn);
+            return;
+        }
+        // bytes past the header that land in the relay buffer are not kept,
+        // so the response cannot be cached any more
+        if (target == conn->buffer) {
+            conn->cacheable = 0;
+        }
+        if (segment) {
+            segment->length += bytesRead;
+            conn->entry->segmentBytes += bytesRead;
+        }
+        if (conn->responseBytes == 0) {
+            conn->firstByteAt = record_latency(
+                &loop->stats, STAGE_FIRST_BYTE, conn->requestSentAt);
+        }
+        conn->pendingData = target;
+        conn->pending = bytesRead;
+        conn->pendingOffset = 0;
+        int headerWasDone = conn->headerDone;
+        track_response(loop, conn, bytesRead);
+        // nothing of a response whose body has no end that can be trusted
+        // (a bad Content-Length, or more header lines than are recorded, the
+        // missing ones perhaps framing it) reaches the client, which gets a
+        // stale copy if it has one
+        if (!headerWasDone && conn->headerDone &&
+            (conn->entry->badContentLength ||
+             conn->responseParser.overflowed)) {
+            log_line("Bad %s from %s\n",
+                     conn->entry->badContentLength ? "Content-Length"
+                                                   : "header",
+                     conn->entry->host);
+            if (conn->fallback) {
+                serve_stale(loop, conn);
+            } else {
+                close_connection(loop, conn);
+            }
+            return;
+        }
+        if ((conn->revalidating || conn->fallback) && !headerWasDone) {
+            hold_response(loop, conn);
+            if (conn->state != RELAYING) {
+                return;
+            }
+        }
+        publish_fetch(loop, conn);
+        if (conn->state == CLOSED) {
+            return;
+        }
+    }
+}
+
+// gather the in-memory bytes of a stored response in [offset, end): the
+// first block, then its segments, which are full up to the last one. Only
+// links to bytes below end are followed, so this is safe on a response a
+// leader is still storing.
+static int cached_iovec(cacheEntry_t *served, long offset, long end,
+                        struct iovec *iov) {
+    int count = 0;
+    long start = served->blockLength;
+    if (offset < start) {
+        iov[count].iov_base = served->response + offset;
+        iov[count++].iov_len = ((end < start) ? end : start) - offset;
+    }
+    responseSegment_t *segment = NULL;
+    for (; start < end && count < SERVE_IOVECS; start += SEGMENT_DATA) {
+        segment = segment ? segment->next : served->segments;
+        long stop = start + SEGMENT_DATA;
+        stop = (stop < end) ? stop : end;
+        if (offset < stop) {
+            long skip = (offset > start) ? offset - start : 0;
+            iov[count].iov_base = segment->data + skip;
+            iov[count++].iov_len = stop - start - skip;
+        }
+    }
+    return count;
+}
+
+// send a stored response to the client from *position up to limit bytes,
+// moving position on: the in-memory part gathered into one sendmsg() per
+// batch of segments, then a memfd body with sendfile(). Returns 1 once
+// limit bytes have gone, 0 if the client would block and -1 if the
+// connection was closed.
+static int send_stored(loop_t *loop, conn_t *conn, cacheEntry_t *served,
+                       long *position, long limit) {
+    long inMemory = (served->bodyFd >= 0) ? served->blockLength : limit;
+    inMemory = (inMemory < limit) ? inMemory : limit;
+    while (*position < inMemory) {
+        struct iovec iov[SERVE_IOVECS];
+        struct msghdr message = {.msg_iov = iov};
+        message.msg_iovlen = cached_iovec(served, *position, inMemory, iov);
+        int sent = sendmsg(conn->clientfd, &message,
+                           (served->bodyFd >= 0) ? MSG_MORE : 0);
+        if (sent < 0 && would_block()) {
+            return 0;
+        }
+        if (sent <= 0) {
+            close_connection(loop, conn);
+            return -1;
+        }
+        *position += sent;
+        atomic_fetch_add(&loop->stats.bytesServed, sent);
+    }
+    while (*position < limit) {
+        off_t offset = *position - inMemory;
+        ssize_t sent = sendfile(conn->clientfd, served->bodyFd, &offset,
+                                limit - *position);
+        if (sent < 0 && would_block()) {
+            return 0;
+        }
+        if (sent <= 0) {
+            close_connection(loop, conn);
+            return -1;
+        }
+        *position += sent;
+        atomic_fetch_add(&loop->stats.bytesServed, sent);
+    }
+    return 1;
+}
+
+// send the pieces of a range plan, taking stored bytes only up to
+// available; returns as send_stored() does, 0 also while waiting for
+// stored bytes that have not arrived
+static int send_ranges(loop_t *loop, conn_t *conn, cacheEntry_t *served,
+                       long available) {
+    long start = 0;
+    for (int i = 0; i < conn->plan.nPieces; i++) {
+        rangePiece_t *piece = &conn->plan.pieces[i];
+        long end = start + piece->length;
+        while (!piece->stored && conn->servedBytes < end) {
+            long done = conn->servedBytes - start;
+            int sent = send(conn->clientfd, conn->plan.text + piece->offset +
+                                                done,
+                            piece->length - done, MSG_MORE);
+            if (sent < 0 && would_block()) {
+                return 0;
+            }
+            if (sent <= 0) {
+                close_connection(loop, conn);
+                return -1;
+            }
+            conn->servedBytes += sent;
+            atomic_fetch_add(&loop->stats.bytesServed, sent);
+        }
+        if (piece->stored && conn->servedBytes < end) {
+            long position = piece->offset + conn->servedBytes - start;
+            long limit = piece->offset + piece->length;
+            limit = (limit < available) ? limit : available;
+            int result = send_stored(loop, conn, served, &position, limit);
+            if (result < 0) {
+                return -1;
+            }
+            conn->servedBytes = start + position - piece->offset;
+            if (result == 0 || conn->servedBytes < end) {
+                return 0;
+            }
+        }
+        start = end;
+    }
+    return 1;
+}
+
+// the first time a range request is sent anything, plan its ranges of
+// served, or drop them if served cannot be ranged; 206 and 416 are counted
+static void plan_served_ranges(loop_t *loop, conn_t *conn,
+                               cacheEntry_t *served) {
+    if (!conn->nRanges || conn->plan.nPieces || conn->servedBytes) {
+        return;
+    }
+    if (!plan_ranges(served, conn->ranges, conn->nRanges, &conn->plan)) {
+        conn->nRanges = 0;
+        return;
+    }
+    atomic_fetch_add(&loop->stats.ranged, 1);
+}
+
+// a client that does not take gzip is sent an inflated copy of a gzip
+// entry, made before its first byte goes out
+static void inflate_served(loop_t *loop, conn_t *conn) {
+    long started = now_ns();
+    long limit = loop->options->objectLimit;
+    cacheEntry_t *copy = inflate_entry(
+        conn->served, (limit < GZIP_MAX_BODY) ? limit : GZIP_MAX_BODY);
+    atomic_fetch_add(&loop->stats.inflateNs, now_ns() - started);
+    if (copy) {
+        release_cache_entry(conn->served);
+        conn->served = copy;
+        atomic_fetch_add(&loop->stats.inflated, 1);
+    }
+}
+
+// send a cached response to the client
+static void serve_cache(loop_t *loop, conn_t *conn) {
+    if (conn->servedBytes == 0 && conn->served->isGzip && !conn->acceptsGzip) {
+        inflate_served(loop, conn);
+    }
+    cacheEntry_t *served = conn->served;
+    plan_served_ranges(loop, conn, served);
+    int sent = conn->plan.nPieces
+                   ? send_ranges(loop, conn, served, served->responseTotalBytes)
+                   : send_stored(loop, conn, served, &conn->servedBytes,
+                                 served->responseTotalBytes);
+    if (sent > 0) {
+        next_request(loop, conn,
+                     conn->requestKeepAlive && served->responseKeepAlive &&
+                         response_is_framed(served));
+    }
+}
+
+// a follower whose leader failed before sending it anything, or did not
+// get a header within the coalescing wait, fetches on its own, or if asked
+// to rejoins, following whichever of the others fetches first
+static void stop_coalescing(loop_t *loop, conn_t *conn, int rejoin) {
+    log_line("Not coalescing %s %s\n", conn->served->host,
+             conn->served->path);
+    stop_following(loop, conn);
+    free_range_plan(&conn->plan);
+    release_cache_entry(conn->served);
+    conn->served = NULL;
+    atomic_fetch_add(&loop->stats.coalesceFallbacks, 1);
+    if (rejoin) {
+        cache_t *shard = cache_shard(loop->cache, conn->entry);
+        pthread_mutex_lock(&shard->lock);
+        cacheEntry_t *leader = join_fetch(loop, conn, shard);
+        pthread_mutex_unlock(&shard->lock);
+        if (leader) {
+            follow_leader(loop, conn, leader);
+            return;
+        }
+    }
+    atomic_fetch_add(&loop->stats.misses, 1);
+    start_forwarding(loop, conn, 1);
+}
+
+// send a follower what its leader has stored so far, finishing once the
+// fetch is done; if it failed, a follower that has already sent part of
+// the response can only be cut off
+static void follow_fetch(loop_t *loop, conn_t *conn) {
+    cacheEntry_t *leader = conn->served;
+    // published is final once the state says the fetch is done
+    int state = atomic_load(&leader->fetchState);
+    long published = atomic_load(&leader->published);
+    if (state == FETCH_FAILED && conn->servedBytes == 0) {
+        // a leader that got no response at all may have failed for its own
+        // reasons, such as its client leaving; one that did would only
+        // fail again for the next leader
+        stop_coalescing(loop, conn, leader->statusCode == 0);
+        return;
+    }
+    if (state == FETCH_FAILED) {
+        close_connection(loop, conn);
+        return;
+    }
+    // an encoded response the client did not ask for is fetched again
+    if (conn->servedBytes == 0 && published > 0 && leader->isEncoded &&
+        !conn->acceptsGzip) {
+        stop_coalescing(loop, conn, 0);
+        return;
+    }
+    // ranges are planned once the leader's header is in, and done as soon
+    // as their bytes are
+    if (published > 0) {
+        plan_served_ranges(loop, conn, leader);
+    }
+    if (conn->plan.nPieces) {
+        if (send_ranges(loop, conn, leader, published) <= 0) {
+            return;
+        }
+    } else if (send_stored(loop, conn, leader, &conn->servedBytes,
+                           published) <= 0 ||
+               state != FETCH_DONE) {
+        return;
+    }
+    trace_request(loop, leader, 1);
+    stop_following(loop, conn);
+    next_request(loop, conn,
+                 conn->requestKeepAlive && leader->responseKeepAlive &&
+                     response_is_framed(leader));
+}
+
+// followers still waiting for their leader's header after the coalescing
+// wait fetch on their own
+static void expire_followers(loop_t *loop, time_t now) {
+    conn_t *conn = loop->following;
+    while (conn) {
+        conn_t *next = conn->waitNext;
+        if (atomic_load(&conn->served->published) == 0 &&
+            now - conn->lastActive >= loop->options->coalesceWait) {
+            stop_coalescing(loop, conn, 0);
+            drive_connection(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+/**************************************************************************/
+// a CONNECT: take a slot under the tunnel limit, turning the client away
+// with a 503 if there is none, and connect to the far end it names
+static void open_tunnel(loop_t *loop, conn_t *conn) {
+    if (atomic_fetch_add(&openTunnels, 1) >= loop->options->maxTunnels) {
+        atomic_fetch_sub(&openTunnels, 1);
+        atomic_fetch_add(&loop->stats.tunnelsRejected, 1);
+        refuse_request(loop, conn, TUNNEL_LIMIT);
+        return;
+    }
+    conn->tunnel = 1;
+    conn->cacheable = 0;
+    atomic_fetch_add(&loop->stats.tunnels, 1);
+    if (!open_pipe(loop, conn->tunnelPipe[0]) ||
+        !open_pipe(loop, conn->tunnelPipe[1])) {
+        refuse_request(loop, conn, TUNNEL_LIMIT);
+        return;
+    }
+    start_forwarding(loop, conn, 0);
+}
+
+// once the far end has accepted, queue the 200 for the client, and
+// anything the client sent after its CONNECT for the far end, in the pipes
+// ahead of what is relayed
+static void establish_tunnel(loop_t *loop, conn_t *conn) {
+    int error = 0;
+    socklen_t length = sizeof(error);
+    if (getsockopt(conn->originfd, SOL_SOCKET, SO_ERROR, &error, &length) < 0 ||
+        error) {
+        origin_failed(loop, conn);
+        return;
+    }
+    struct sockaddr_storage address;
+    length = sizeof(address);
+    if (getpeername(conn->originfd, (struct sockaddr *)&address, &length) <
+        0) {
+        return;
+    }
+    int reply = strlen(TUNNEL_ESTABLISHED);
+    if (write(conn->tunnelPipe[1][1], TUNNEL_ESTABLISHED, reply) != reply) {
+        close_connection(loop, conn);
+        return;
+    }
+    conn->tunnelPipeBytes[1] = reply;
+    // a client does not usually send before the 200, and never more than
+    // the pipe holds
+    if (conn->leftoverLength > 0) {
+        if (write(conn->tunnelPipe[0][1], conn->leftover,
+                  conn->leftoverLength) != conn->leftoverLength) {
+            close_connection(loop, conn);
+            return;
+        }
+        conn->tunnelPipeBytes[0] = conn->tunnelBytes[0] = conn->leftoverLength;
+        atomic_fetch_add(&loop->stats.tunnelBytesUp, conn->leftoverLength);
+        pool_free(conn->leftover);
+        conn->leftover = NULL;
+        conn->leftoverLength = 0;
+    }
+    record_latency(&loop->stats, STAGE_CONNECT, conn->connectStarted);
+    log_line("Tunnel to %s:%s established\n", conn->entry->host,
+             conn->entry->targetPort);
+    conn->lastActive = time(NULL);
+    conn->state = TUNNELING;
+}
+
+// splice what one side of a tunnel sends through its direction's pipe to
+// the other side until either would block, passing the end of its stream
+// on once all of it is through; returns 0 if the tunnel broke
+static int pump_tunnel(loop_t *loop, conn_t *conn, int direction) {
+    int from = direction ? conn->originfd : conn->clientfd;
+    int to = direction ? conn->clientfd : conn->originfd;
+    int *ends = conn->tunnelPipe[direction];
+    atomic_ulong *carried = direction ? &loop->stats.tunnelBytesDown
+                                      : &loop->stats.tunnelBytesUp;
+    while (1) {
+        while (conn->tunnelPipeBytes[direction] > 0) {
+            ssize_t moved = splice(ends[0], NULL, to, NULL,
+                                   conn->tunnelPipeBytes[direction],
+                                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+            if (moved < 0 && would_block()) {
+                return 1;
+            }
+            if (moved <= 0) {
+                return 0;
+            }
+            conn->tunnelPipeBytes[direction] -= moved;
+        }
+        if (conn->tunnelEof[direction]) {
+            return 1;
+        }
+        ssize_t moved = splice(from, NULL, ends[1], NULL,
+                               loop->options->relayChunk,
+                               SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        if (moved < 0 && would_block()) {
+            return 1;
+        }
+        if (moved < 0) {
+            return 0;
+        }
+        if (moved == 0) {
+            conn->tunnelEof[direction] = 1;
+            shutdown(to, SHUT_WR);
+            return 1;
+        }
+        conn->tunnelPipeBytes[direction] = moved;
+        conn->tunnelBytes[direction] += moved;
+        atomic_fetch_add(carried, moved);
+        conn->lastActive = time(NULL);
+    }
+}
+
+// move a tunnel's bytes both ways as far as they go, and close it once
+// both sides have finished sending or either has failed
+static void relay_tunnel(loop_t *loop, conn_t *conn) {
+    if (!pump_tunnel(loop, conn, 0) || !pump_tunnel(loop, conn, 1) ||
+        (conn->tunnelEof[0] && conn->tunnelEof[1])) {
+        close_connection(loop, conn);
+    }
+}
+
+/**************************************************************************/
+// close client connections that sat waiting for a request, and tunnels
+// that carried nothing either way, for too long
+static void expire_idle_clients(loop_t *loop, time_t now) {
+    conn_t *conn = loop->connections;
+    while (conn) {
+        conn_t *next = conn->next;
+        if ((conn->state == READING_REQUEST &&
+             now - conn->lastActive >= loop->options->clientIdle) ||
+            (conn->state == TUNNELING &&
+             now - conn->lastActive >= loop->options->tunnelIdle)) {
+            close_connection(loop, conn);
+        }
+        conn = next;
+    }
+}
+
+// reclaim expired entries from this worker's share of the shards, once a
+// second or sooner while a shard still has more due than one batch
+static void expire_cache_entries(loop_t *loop) {
+    shardedCache_t *cache = loop->cache;
+    time_t now = cache_clock();
+    if (now == loop->expiredUpTo && !loop->expiryBehind) {
+        return;
+    }
+    loop->expiredUpTo = now;
+    loop->expiryBehind = 0;
+    for (unsigned long i = loop->id; i < cache->nShards; i += loop->nWorkers) {
+        cache_t *shard = cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        loop->expiryBehind |= expire_cache(shard, now);
+        pthread_mutex_unlock(&shard->lock);
+    }
+}
+
+/**************************************************************************/
+// run the current step of a connection until it has to wait for a socket
+static void drive_connection(loop_t *loop, conn_t *conn) {
+    connState_t previous;
+    do {
+        previous = conn->state;
+        switch (conn->state) {
+        case READING_REQUEST:
+            read_request(loop, conn);
+            break;
+        case RESOLVING_HOST:
+        case LOADING_DISK:
+            break;
+        case CONNECTING_UPSTREAM:
+            if (conn->tunnel) {
+                establish_tunnel(loop, conn);
+            } else {
+                send_request(loop, conn);
+            }
+            break;
+        case RELAYING:
+            relay_response(loop, conn);
+            break;
+        case SERVING_CACHE:
+            serve_cache(loop, conn);
+            break;
+        case FOLLOWING:
+            follow_fetch(loop, conn);
+            break;
+        case TUNNELING:
+            relay_tunnel(loop, conn);
+            break;
+        case CLOSED:
+            break;
+        }
+    } while (conn->state != previous && conn->state != CLOSED);
+}
+
+// accept every pending client and start reading its request
+static void accept_clients(loop_t *loop) {
+    struct sockaddr_storage client_addr;
+    socklen_t client_addr_size;
+    while (1) {
+        long started = now_ns();
+        // get a valid client address
+        client_addr_size = sizeof(client_addr);
+        int clientfd = accept(loop->listenfd, (struct sockaddr *)&client_addr,
+                              &client_addr_size);
+        if (clientfd < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            return;
+        }
+        log_line("Accepted\n");
+        set_nonblocking(clientfd);
+
+        // store new request in new cache entry
+        conn_t *conn = new_connection(loop, clientfd, create_cache_entry());
+        record_latency(&loop->stats, STAGE_ACCEPT, started);
+        drive_connection(loop, conn);
+    }
+}
+
+// serve every client accepted on this worker's listening socket from one
+// edge-triggered epoll loop
+static void *run_event_loop(void *arg) {
+    loop_t *loop = arg;
+    struct epoll_event events[MAX_EVENTS];
+
+    // pin worker i to cpu i (modulo the cpus available) if asked to
+    if (loop->options->pinCpus) {
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(loop->id % sysconf(_SC_NPROCESSORS_ONLN), &cpus);
+        if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0) {
+            fprintf(stderr, "Error: Cannot pin worker %d\n", loop->id);
+        }
+    }
+
+    if (loop->options->upstreamPerHost > 0) {
+        loop->upstreams = create_upstream_pool(loop->options->upstreamPerHost,
+                                               loop->options->upstreamIdle);
+    }
+    loop->epfd = epoll_create1(0);
+    if (loop->epfd < 0) {
+        perror("Error: Cannot create epoll instance\n");
+        exit(EXIT_FAILURE);
+    }
+    // the listening socket and wakeups are the only ones registered
+    // without a connection
+    struct epoll_event event = {.events = EPOLLIN | EPOLLET,
+                                .data.ptr = &listenerTag};
+    struct epoll_event wakeup = {.events = EPOLLIN | EPOLLET,
+                                 .data.ptr = &wakeTag};
+    if (epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->listenfd, &event) < 0 ||
+        epoll_ctl(loop->epfd, EPOLL_CTL_ADD, loop->wakefd, &wakeup) < 0) {
+        perror("Error: Cannot watch listening socket\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // Accept and serve connections - loop until CTRL-C, waking up at least
+    // once a tick to close idle client and origin connections
+    while (1) {
+        int ready = epoll_wait(loop->epfd, events, MAX_EVENTS, TICK_MS);
+        if (ready < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            perror("Error: epoll_wait failed\n");
+            exit(EXIT_FAILURE);
+        }
+        tick_cache_clock();
+        for (int i = 0; i < ready; i++) {
+            conn_t *conn = events[i].data.ptr;
+            if (conn == (conn_t *)&listenerTag) {
+                accept_clients(loop);
+            } else if (conn == (conn_t *)&wakeTag) {
+                handle_wakeup(loop);
+            } else if (conn->state != CLOSED) {
+                drive_connection(loop, conn);
+            }
+        }
+        // nothing in this batch can refer to these any more
+        while (loop->closed) {
+            conn_t *conn = loop->closed;
+            loop->closed = conn->nextClosed;
+            pool_free(conn);
+        }
+        time_t now = time(NULL);
+        expire_idle_clients(loop, now);
+        expire_followers(loop, now);
+        if (loop->upstreams) {
+            expire_idle_upstreams(loop->upstreams, now);
+        }
+        expire_cache_entries(loop);
+        // clients expired above are freed on the next pass
+    }
+    free_upstream_pool(loop->upstreams);
+    return NULL;
+}
+
+// print the hits and misses served per second since the last report
+static void report_throughput(loop_t *loops, int threads, int interval,
+                              dnsCache_t *dns, shardedCache_t *cache,
+                              unsigned long *lastHits,
+                              unsigned long *lastMisses) {
+    unsigned long hits = 0, misses = 0, diskHits = 0, coalesced = 0;
+    unsigned long fallbacks = 0;
+    unsigned long staleServed = 0, staleOnError = 0;
+    unsigned long gzipped = 0, gzipIn = 0, gzipOut = 0, gzipNs = 0;
+    unsigned long inflated = 0, inflateNs = 0;
+    unsigned long peerFetches = 0, peerFallbacks = 0, peerReceived = 0;
+    for (int i = 0; i < threads; i++) {
+        hits += atomic_load(&loops[i].stats.hits);
+        misses += atomic_load(&loops[i].stats.misses);
+        diskHits += atomic_load(&loops[i].stats.diskHits);
+        coalesced += atomic_load(&loops[i].stats.coalesced);
+        fallbacks += atomic_load(&loops[i].stats.coalesceFallbacks);
+        staleServed += atomic_load(&loops[i].stats.staleServed);
+        staleOnError += atomic_load(&loops[i].stats.staleOnError);
+        gzipped += atomic_load(&loops[i].stats.gzipped);
+        gzipIn += atomic_load(&loops[i].stats.gzipInBytes);
+        gzipOut += atomic_load(&loops[i].stats.gzipOutBytes);
+        gzipNs += atomic_load(&loops[i].stats.gzipNs);
+        inflated += atomic_load(&loops[i].stats.inflated);
+        inflateNs += atomic_load(&loops[i].stats.inflateNs);
+        peerFetches += atomic_load(&loops[i].stats.peerFetches);
+        peerFallbacks += atomic_load(&loops[i].stats.peerFallbacks);
+        peerReceived += atomic_load(&loops[i].stats.peerReceived);
+    }
+    log_line("Throughput with %d threads: %.1f hits/s %.1f misses/s\n",
+             threads, (double)(hits - *lastHits) / interval,
+             (double)(misses - *lastMisses) / interval);
+    log_line("Resolver: %lu hits %lu misses\n", atomic_load(&dns->hits),
+             atomic_load(&dns->misses));
+    log_line("Coalesced: %lu requests, %lu fell back\n", coalesced,
+             fallbacks);
+    log_line("Stale: %lu served while revalidating, %lu for origin errors\n",
+             staleServed, staleOnError);
+    log_line("Gzip: %lu bodies stored at %.1f%% of their size in %.1fms, "
+             "%lu inflated in %.1fms\n",
+             gzipped, gzipIn ? 100.0 * gzipOut / gzipIn : 0, gzipNs / 1e6,
+             inflated, inflateNs / 1e6);
+    unsigned long requests = hits + misses;
+    log_line("Hit ratio with the %s policy: %.1f%% of %lu requests\n",
+             cache->policy->name, requests ? 100.0 * hits / requests : 0,
+             requests);
+    if (cache->disk) {
+        log_line("Tiers: %.1f%% hit memory, %.1f%% hit disk; %lu demoted, "
+                 "%lu promoted, %lu overwritten\n",
+                 requests ? 100.0 * (hits - diskHits) / requests : 0,
+                 requests ? 100.0 * diskHits / requests : 0,
+                 atomic_load(&cache->disk->demotions),
+                 atomic_load(&cache->disk->promotions),
+                 atomic_load(&cache->disk->overwritten));
+    }
+    if (loops[0].peers) {
+        log_line("Peers: %lu misses fetched from their owners, %lu fell back "
+                 "to origins, %lu requests from peers\n",
+                 peerFetches, peerFallbacks, peerReceived);
+    }
+    *lastHits = hits;
+    *lastMisses = misses;
+}
+
+// the main thread once the workers run: report throughput and write cache
+// snapshots on their intervals, then on SIGTERM or SIGINT write a last
+// snapshot and exit
+static void supervise_workers(loop_t *loops, proxyOptions_t *options,
+                              shardedCache_t *cache, dnsCache_t *dns,
+                              sigset_t *stopSignals) {
+    unsigned long lastHits = 0, lastMisses = 0;
+    time_t now = time(NULL);
+    time_t nextStats = now + options->statsInterval;
+    time_t nextSnapshot = now + options->snapshotInterval;
+    while (1) {
+        struct timespec tick = {.tv_sec = 1};
+        if (sigtimedwait(stopSignals, NULL, &tick) > 0) {
+            if (options->snapshotPath) {
+                save_snapshot(cache, options->snapshotPath);
+            }
+            flush_logger();
+            exit(EXIT_SUCCESS);
+        }
+        now = time(NULL);
+        if (options->statsInterval > 0 && now >= nextStats) {
+            report_throughput(loops, options->threads, options->statsInterval,
+                              dns, cache, &lastHits, &lastMisses);
+            nextStats = now + options->statsInterval;
+        }
+        if (options->snapshotPath && options->snapshotInterval > 0 &&
+            now >= nextSnapshot) {
+            save_snapshot(cache, options->snapshotPath);
+            nextSnapshot = now + options->snapshotInterval;
+        }
+    }
+}
+
+// start options->threads workers, each accepting on its own SO_REUSEPORT
+// listening socket so the kernel spreads new clients across them
+void run_workers(proxyOptions_t *options, shardedCache_t *cache) {
+    loop_t *loops = calloc(options->threads, sizeof(loop_t));
+    if (!loops) {
+        perror("Error: Cannot allocate workers\n");
+        exit(EXIT_FAILURE);
+    }
+
+    // a client or origin closing mid-send must not kill the proxy, and
+    // stop signals are left for the main thread to take with sigtimedwait,
+    // so they are blocked before any other thread starts
+    signal(SIGPIPE, SIG_IGN);
+    sigset_t stopSignals;
+    sigemptyset(&stopSignals);
+    sigaddset(&stopSignals, SIGTERM);
+    sigaddset(&stopSignals, SIGINT);
+    pthread_sigmask(SIG_BLOCK, &stopSignals, NULL);
+
+    dnsCache_t *dns = create_dns_cache(options->dnsTtl, options->dnsNegativeTtl,
+                                       options->hostsFile, DNS_RESOLVERS);
+    peerRing_t *peers = NULL;
+    if (options->peers) {
+        peers = create_peer_ring(options->peerName, options->peers);
+    }
+    for (int i = 0; i < options->threads; i++) {
+        loops[i].id = i;
+        loops[i].cache = cache;
+        loops[i].options = options;
+        loops[i].dns = dns;
+        loops[i].peers = peers;
+        loops[i].listenfd = create_listening_socket(options->tcpPort);
+        loops[i].workers = loops;
+        loops[i].nWorkers = options->threads;
+        // made before any worker starts, since any of them may write it
+        loops[i].wakefd = eventfd(0, EFD_NONBLOCK);
+        if (loops[i].wakefd < 0) {
+            perror("Error: Cannot create wakeup eventfd\n");
+            exit(EXIT_FAILURE);
+        }
+        add_dns_listener(dns, loops[i].wakefd);
+        if (cache->disk) {
+            add_disk_listener(cache->disk, loops[i].wakefd);
+        }
+    }
+    if (options->adminPort) {
+        workerStats_t **stats = malloc(options->threads * sizeof(*stats));
+        if (!stats) {
+            perror("Error: Cannot allocate admin server\n");
+            exit(EXIT_FAILURE);
+        }
+        for (int i = 0; i < options->threads; i++) {
+            stats[i] = &loops[i].stats;
+        }
+        start_admin_server(options->adminPort, stats, options->threads, cache,
+                           dns, peers);
+    }
+    for (int i = 0; i < options->threads; i++) {
+        if (pthread_create(&loops[i].thread, NULL, run_event_loop,
+                           &loops[i]) != 0) {
+            perror("Error: Cannot start worker\n");
+            exit(EXIT_FAILURE);
+        }
+    }
+    supervise_workers(loops, options, cache, dns, &stopSignals);
+}
+
+/**************************************************************************/
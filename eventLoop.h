@@ -0,0 +1,62 @@
+#ifndef EVENTLOOP
+#define EVENTLOOP
+
+#include "dataStruct.h"
+
+#define DEFAULT_CLIENT_IDLE 15
+#define DEFAULT_RELAY_CHUNK 16384
+#define DEFAULT_ZERO_COPY_THRESHOLD 32768
+#define DEFAULT_COALESCE_WAIT 5
+#define DEFAULT_MAX_TUNNELS 1024
+#define DEFAULT_TUNNEL_IDLE 300
+
+// startup options shared by every worker
+typedef struct proxyOptions proxyOptions_t;
+struct proxyOptions {
+    char *tcpPort;
+    int stage2;
+    size_t capacity;
+    int threads;
+    int pinCpus;
+    int statsInterval;
+    int upstreamPerHost;
+    int upstreamIdle;
+    int dnsTtl;
+    int dnsNegativeTtl;
+    char *hostsFile;
+    int clientIdle;
+    int relayChunk;
+    int zeroCopyThreshold;
+    long objectLimit;
+    char *snapshotPath;
+    int snapshotInterval;
+    int coalesceWait;
+    char *adminPort;
+    const cachePolicy_t *policy;
+    int gzipLevel;
+    char *diskPath;
+    size_t diskCapacity;
+    // log a trace line per request, and the trace to replay offline with
+    // the capacities and policies to replay it through
+    int traceRequests;
+    char *replayPath;
+    char *replayCapacities;
+    char *replayPolicies;
+    // the other members of a cache cluster, and this node's host:port as
+    // they list it
+    char *peers;
+    char *peerName;
+    // seconds 404s, 410s and 5xx without freshness of their own are cached
+    int negativeTtl;
+    // CONNECT tunnels open at once over every worker, and seconds one may
+    // pass without a byte either way before it is closed
+    int maxTunnels;
+    int tunnelIdle;
+};
+
+// start options->threads workers, each accepting on its own SO_REUSEPORT
+// listening socket and serving clients from its own edge-triggered epoll
+// loop. Runs until CTRL-C.
+void run_workers(proxyOptions_t *options, shardedCache_t *cache);
+
+#endif
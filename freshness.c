@@ -0,0 +1,249 @@
+/*
+Freshness of cached responses, following the shared-cache rules of RFC
+9111. The Cache-Control, Date, Expires, Age and Last-Modified headers are
+picked up while the header is scanned, each Cache-Control value in a
+single pass over its directives, and combined once the header is complete:
+s-maxage wins over max-age, which wins over Expires less Date, which wins
+over a heuristic tenth of the time since Last-Modified. The age the
+response already had (from Age, or from Date if it is later) is taken off
+the time it was cached, so it goes stale when its origin meant it to. 404,
+410 and 5xx responses without freshness of their own are kept briefly, so
+a missing or failing object does not send every request to the origin.
+*/
+
+#define _GNU_SOURCE
+#include <limits.h>
+#include <stdio.h>
+#include <string.h>
+#include <strings.h>
+
+#include "freshness.h"
+
+// longest HTTP date taken, with room to spare
+#define HTTP_DATE_LENGTH 64
+
+static unsigned int negativeTtl = DEFAULT_NEGATIVE_TTL;
+
+/*****************************************************************************/
+// nothing seen yet
+void reset_freshness(freshness_t *freshness) {
+    *freshness = (freshness_t){0};
+    freshness->maxAge = freshness->sMaxAge = -1;
+    freshness->staleWhileRevalidate = freshness->staleIfError = -1;
+    freshness->date = freshness->expires = freshness->lastModified = -1;
+    freshness->age = -1;
+}
+
+// true if the directive name at name is token, in any case
+static int directive_is(const char *name, int length, const char *token) {
+    return length == (int)strlen(token) &&
+           strncasecmp(name, token, length) == 0;
+}
+
+// add the directives of one Cache-Control value, in a single pass over it
+void parse_cache_control(freshness_t *freshness, const char *value,
+                         int length) {
+    int at = 0;
+    while (at < length) {
+        while (at < length && (value[at] == ' ' || value[at] == '\t' ||
+                               value[at] == ',')) {
+            at++;
+        }
+        int name = at;
+        while (at < length && value[at] != '=' && value[at] != ',' &&
+               value[at] != ' ' && value[at] != '\t') {
+            at++;
+        }
+        int nameLength = at - name;
+        while (at < length && (value[at] == ' ' || value[at] == '\t')) {
+            at++;
+        }
+        // an argument is delta-seconds, possibly quoted, or a quoted list
+        // of field names that may itself hold commas
+        long seconds = -1;
+        if (at < length && value[at] == '=') {
+            at++;
+            int quoted = at < length && value[at] == '"';
+            at += quoted;
+            for (; at < length && value[at] >= '0' && value[at] <= '9'; at++) {
+                seconds = (seconds < 0) ? 0 : seconds;
+                if (seconds < MAX_DELTA_SECONDS) {
+                    seconds = seconds * 10 + (value[at] - '0');
+                }
+            }
+            while (quoted && at < length && value[at] != '"') {
+                at++;
+            }
+            while (at < length && value[at] != ',') {
+                at++;
+            }
+        }
+        seconds = (seconds > MAX_DELTA_SECONDS) ? MAX_DELTA_SECONDS : seconds;
+
+        const char *directive = value + name;
+        if (directive_is(directive, nameLength, "no-store")) {
+            freshness->noStore = 1;
+        } else if (directive_is(directive, nameLength, "no-cache")) {
+            freshness->noCache = 1;
+        } else if (directive_is(directive, nameLength, "private")) {
+            freshness->isPrivate = 1;
+        } else if (directive_is(directive, nameLength, "must-revalidate") ||
+                   directive_is(directive, nameLength, "proxy-revalidate")) {
+            freshness->mustRevalidate = 1;
+        } else if (directive_is(directive, nameLength, "max-age")) {
+            freshness->maxAge = seconds;
+        } else if (directive_is(directive, nameLength, "s-maxage")) {
+            freshness->sMaxAge = seconds;
+        } else if (directive_is(directive, nameLength,
+                                "stale-while-revalidate")) {
+            freshness->staleWhileRevalidate = seconds;
+        } else if (directive_is(directive, nameLength, "stale-if-error")) {
+            freshness->staleIfError = seconds;
+        }
+    }
+}
+
+// seconds since the epoch of an HTTP date in any of its three formats, -1
+// if the value is not one
+time_t parse_http_date(const char *value, int length) {
+    const char *formats[] = {"%a, %d %b %Y %H:%M:%S GMT",
+                             "%A, %d-%b-%y %H:%M:%S GMT",
+                             "%a %b %e %H:%M:%S %Y"};
+    char date[HTTP_DATE_LENGTH];
+    while (length > 0 && (*value == ' ' || *value == '\t')) {
+        value++;
+        length--;
+    }
+    if (length <= 0 || length >= HTTP_DATE_LENGTH) {
+        return -1;
+    }
+    memcpy(date, value, length);
+    date[length] = '\0';
+    for (size_t i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+        struct tm parsed = {0};
+        const char *end = strptime(date, formats[i], &parsed);
+        if (end && (*end == '\0' || *end == ' ')) {
+            return timegm(&parsed);
+        }
+    }
+    return -1;
+}
+
+/*****************************************************************************/
+// status codes a cache may store without being told how long they are
+// fresh for (RFC 9110 15.1)
+static int is_heuristically_cacheable(int statusCode) {
+    const int codes[] = {200, 203, 204, 206, 300, 301,
+                         308, 404, 405, 410, 414, 501};
+    for (size_t i = 0; i < sizeof(codes) / sizeof(codes[0]); i++) {
+        if (codes[i] == statusCode) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// a missing or failing object, cached briefly to spare its origin
+static int is_negative(int statusCode) {
+    return statusCode == 404 || statusCode == 410 || statusCode / 100 == 5;
+}
+
+// work out, as a shared cache, whether a response may be stored, how long
+// it stays fresh, how old it already is and how long past that it may be
+// served stale
+void set_freshness(cacheEntry_t *entry, freshness_t *freshness) {
+    entry->maxAge = entry->initialAge = 0;
+    entry->isStalable = 0;
+    entry->staleWhileRevalidate = entry->staleIfError = 0;
+    if (freshness->noStore || freshness->isPrivate) {
+        entry->isCachable = 0;
+        return;
+    }
+
+    // the age it already had: what the caches before said it was, or how
+    // long ago its origin sent it if that is more (RFC 9111 4.2.3)
+    time_t now = cache_clock();
+    time_t date = (freshness->date >= 0) ? freshness->date : now;
+    long initialAge = (now > date) ? now - date : 0;
+    if (freshness->age > initialAge) {
+        initialAge = freshness->age;
+    }
+
+    // how long it stays fresh (RFC 9111 4.2.1 and 4.2.2)
+    long lifetime = -1;
+    if (freshness->sMaxAge >= 0) {
+        lifetime = freshness->sMaxAge;
+    } else if (freshness->maxAge >= 0) {
+        lifetime = freshness->maxAge;
+    } else if (freshness->hasExpires) {
+        lifetime = (freshness->expires > date) ? freshness->expires - date : 0;
+    } else if (is_negative(entry->statusCode)) {
+        lifetime = negativeTtl;
+    } else if (is_heuristically_cacheable(entry->statusCode) &&
+               freshness->lastModified >= 0 &&
+               freshness->lastModified < date) {
+        lifetime = (date - freshness->lastModified) / HEURISTIC_FRACTION;
+        lifetime = (lifetime < HEURISTIC_MAX) ? lifetime : HEURISTIC_MAX;
+    }
+    if (freshness->noCache) {
+        lifetime = 0;
+    }
+    // without any, what may be stored by default is stale from the start,
+    // to be revalidated on every use
+    if (lifetime < 0) {
+        if (!is_heuristically_cacheable(entry->statusCode)) {
+            entry->isCachable = 0;
+            return;
+        }
+        lifetime = 0;
+    }
+
+    // an origin that wants every use checked allows no stale serving, and
+    // s-maxage says as much for shared caches
+    if (!freshness->mustRevalidate && freshness->sMaxAge < 0) {
+        entry->staleWhileRevalidate = (freshness->staleWhileRevalidate > 0)
+                                          ? freshness->staleWhileRevalidate
+                                          : 0;
+        entry->staleIfError =
+            (freshness->staleIfError > 0) ? freshness->staleIfError : 0;
+    }
+    // stale from the start with nothing to revalidate it with or serve it
+    // for, it would only ever be replaced
+    if (lifetime == 0 && entry->etagLength == 0 &&
+        entry->lastModifiedLength == 0 && entry->staleWhileRevalidate == 0 &&
+        entry->staleIfError == 0) {
+        entry->isCachable = 0;
+        return;
+    }
+    entry->maxAge = (lifetime < INT_MAX) ? lifetime : INT_MAX;
+    entry->initialAge = (initialAge < INT_MAX) ? initialAge : INT_MAX;
+    entry->isStalable = 1;
+}
+
+// set an entry's freshness from a Cache-Control value alone, as if it were
+// the only caching header of its response
+void validateCache(cacheEntry_t *entry, const char *value, int length) {
+    freshness_t freshness;
+    reset_freshness(&freshness);
+    parse_cache_control(&freshness, value, length);
+    set_freshness(entry, &freshness);
+}
+
+// set the freshness of a response known only by its status, as an access
+// log line is: one its status allows to be stored by default is kept until
+// evicted, an error for the negative TTL, anything else not at all
+void set_status_freshness(cacheEntry_t *entry) {
+    validateCache(entry, "", 0);
+    if (!is_negative(entry->statusCode) &&
+        is_heuristically_cacheable(entry->statusCode)) {
+        entry->isCachable = 1;
+    }
+}
+
+// cache 404s, 410s and 5xx without freshness of their own for seconds (0
+// to always ask the origin again)
+void set_negative_ttl(unsigned int seconds) {
+    negativeTtl = seconds;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,61 @@
+#ifndef FRESHNESS
+#define FRESHNESS
+
+#include <time.h>
+
+#include "dataStruct.h"
+
+// seconds a 404, 410 or 5xx without freshness of its own is cached for
+#define DEFAULT_NEGATIVE_TTL 10
+// a response with only a Last-Modified stays fresh for this fraction of
+// its age at the time, up to a day
+#define HEURISTIC_FRACTION 10
+#define HEURISTIC_MAX 86400
+// delta-seconds past this are taken as this (RFC 9111 1.2.2)
+#define MAX_DELTA_SECONDS 2147483648L
+
+// what the header of a message says about caching it, gathered as the
+// header is scanned and worked out once it is complete
+typedef struct freshness freshness_t;
+struct freshness {
+    // Cache-Control directives; delta-seconds are -1 when absent
+    int noStore;
+    int noCache;
+    int isPrivate;
+    int mustRevalidate;
+    long maxAge;
+    long sMaxAge;
+    long staleWhileRevalidate;
+    long staleIfError;
+    // Date, Expires and Last-Modified, -1 when absent (an Expires that is
+    // not a date says the response is already stale), and Age
+    time_t date;
+    time_t expires;
+    int hasExpires;
+    time_t lastModified;
+    long age;
+};
+
+// nothing seen yet
+void reset_freshness(freshness_t *freshness);
+// add the directives of one Cache-Control value, in a single pass over it
+void parse_cache_control(freshness_t *freshness, const char *value,
+                         int length);
+// seconds since the epoch of an HTTP date in any of its three formats, -1
+// if the value is not one
+time_t parse_http_date(const char *value, int length);
+// work out, as a shared cache, whether a response may be stored, how long
+// it stays fresh, how old it already is and how long past that it may be
+// served stale
+void set_freshness(cacheEntry_t *entry, freshness_t *freshness);
+// set an entry's freshness from a Cache-Control value alone, as if it were
+// the only caching header of its response
+void validateCache(cacheEntry_t *entry, const char *value, int length);
+// set the freshness of a response known only by its status, as an access
+// log line is, keeping what may be stored by default until evicted
+void set_status_freshness(cacheEntry_t *entry);
+// cache 404s, 410s and 5xx without freshness of their own for seconds (0
+// to always ask the origin again)
+void set_negative_ttl(unsigned int seconds);
+
+#endif
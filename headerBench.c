@@ -0,0 +1,126 @@
+/*
+Microbenchmark for header parsing: a browser-sized request arriving in small
+segments, parsed by the incremental parser against the previous approach of
+searching the whole buffer for "\r\n\r\n" after every segment and then
+copying and tokenising the header with strtok. Usage: headerbench [segment]
+*/
+
+#define _POSIX_C_SOURCE 200112L
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <time.h>
+
+#include "httpParser.h"
+
+#define ITERATIONS 200000
+#define DEFAULT_SEGMENT 64
+
+static const char *request =
+    "GET /static/js/app.bundle.js?v=20261018 HTTP/1.1\r\n"
+    "Host: www.example.com:8080\r\n"
+    "User-Agent: Mozilla/5.0 (X11; Linux x86_64; rv:131.0) Gecko/20100101 "
+    "Firefox/131.0\r\n"
+    "Accept: text/html,application/xhtml+xml,application/xml;q=0.9,"
+    "image/avif,image/webp,*/*;q=0.8\r\n"
+    "Accept-Language: en-GB,en;q=0.7,de;q=0.3\r\n"
+    "Accept-Encoding: gzip, deflate, br, zstd\r\n"
+    "Referer: https://www.example.com/articles/2026/10/header-parsing\r\n"
+    "Cookie: session=8f14e45fceea167a5a36dedd4bea2543; theme=dark; "
+    "consent=analytics,functional; ab=checkout-v2\r\n"
+    "Connection: keep-alive\r\n"
+    "Cache-Control: max-age=0\r\n"
+    "Upgrade-Insecure-Requests: 1\r\n"
+    "Sec-Fetch-Dest: document\r\n"
+    "Sec-Fetch-Mode: navigate\r\n"
+    "Sec-Fetch-Site: same-origin\r\n"
+    "Priority: u=0, i\r\n"
+    "\r\n";
+
+// sink so the compiler keeps the work
+static volatile long checksum;
+
+/*****************************************************************************/
+// search used by the proxy before the incremental parser
+static int my_memmem(const char *string, int stringlen, const char *substring,
+                     int sublen) {
+    for (int offset = 0; offset <= stringlen - sublen; offset++) {
+        if (memcmp(string + offset, substring, sublen) == 0) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+// previous parse: rescan from 0 per segment, then copy and strtok
+static void parse_previous(const char *message, int length, int segment) {
+    int received = 0, headerEnd = -1;
+    while (headerEnd < 0 && received < length) {
+        received += (length - received < segment) ? length - received : segment;
+        headerEnd = my_memmem(message, received, "\r\n\r\n", 4);
+    }
+    char lines[4096];
+    memcpy(lines, message, headerEnd);
+    lines[headerEnd] = '\0';
+    long found = 0;
+    for (char *line = strtok(lines, "\r\n"); line; line = strtok(NULL, "\r\n")) {
+        if (strncasecmp(line, "Host:", 5) == 0 ||
+            strncasecmp(line, "Connection:", 11) == 0 ||
+            strncasecmp(line, "Cache-Control:", 14) == 0) {
+            found += strlen(line);
+        }
+    }
+    checksum += found;
+}
+
+// incremental parse: each segment is scanned once, headers are spans
+static void parse_incremental(const char *message, int length, int segment) {
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    int received = 0, headerEnd = 0;
+    while (!headerEnd && received < length) {
+        received += (length - received < segment) ? length - received : segment;
+        headerEnd = feed_http_parser(&parser, message, received);
+    }
+    long found = 0;
+    for (int i = 0; i < parser.nHeaders; i++) {
+        if (http_header_is(message, &parser.headers[i], "Host") ||
+            http_header_is(message, &parser.headers[i], "Connection") ||
+            http_header_is(message, &parser.headers[i], "Cache-Control")) {
+            found += parser.headers[i].lineLength;
+        }
+    }
+    checksum += found;
+}
+
+// time ITERATIONS parses, returning nanoseconds per request
+static double time_parser(void (*parse)(const char *, int, int), int segment) {
+    int length = strlen(request);
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < ITERATIONS; i++) {
+        parse(request, length, segment);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return ((end.tv_sec - start.tv_sec) * 1e9 +
+            (end.tv_nsec - start.tv_nsec)) /
+           ITERATIONS;
+}
+
+/*****************************************************************************/
+int main(int argc, char **argv) {
+    int segment = (argc > 1) ? atoi(argv[1]) : DEFAULT_SEGMENT;
+    if (segment <= 0) {
+        fprintf(stderr, "Usage: %s [segment bytes]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+    double previous = time_parser(parse_previous, segment);
+    double incremental = time_parser(parse_incremental, segment);
+    printf("%zu byte request in %d byte segments\n", strlen(request),
+           segment);
+    printf("previous:    %8.1f ns/request\n", previous);
+    printf("incremental: %8.1f ns/request (%.1fx)\n", incremental,
+           previous / incremental);
+    return 0;
+}
@@ -0,0 +1,219 @@
+/*
+Incremental HTTP header parser. Each call only scans the bytes that arrived
+since the previous one, finding line ends 32 (AVX2) or 16 (SSE2) bytes at a
+time, and records every header line as spans into the caller's buffer so
+nothing is copied or modified. A header ends at the first "\r\n\r\n", as it
+did when callers searched the whole buffer with my_memmem(). Chunked bodies
+are followed the same way, so a relay knows where one ends without
+buffering or rewriting it.
+*/
+
+#include <ctype.h>
+#include <limits.h>
+#include <string.h>
+#include <strings.h>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+#include "httpParser.h"
+
+/*****************************************************************************/
+// offset of the first '\n' in buffer[from, to), -1 if there is none
+static int find_newline(const char *buffer, int from, int to) {
+    int i = from;
+#if defined(__AVX2__)
+    const __m256i newline = _mm256_set1_epi8('\n');
+    for (; i + 32 <= to; i += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i *)(buffer + i));
+        unsigned int mask =
+            _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk, newline));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+#if defined(__SSE2__)
+    const __m128i newline16 = _mm_set1_epi8('\n');
+    for (; i + 16 <= to; i += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i *)(buffer + i));
+        unsigned int mask =
+            _mm_movemask_epi8(_mm_cmpeq_epi8(chunk, newline16));
+        if (mask) {
+            return i + __builtin_ctz(mask);
+        }
+    }
+#endif
+    const char *found = memchr(buffer + i, '\n', to - i);
+    return found ? found - buffer : -1;
+}
+
+// record a complete, non-empty line without its line end
+static void record_line(httpParser_t *parser, const char *buffer, int start,
+                        int length) {
+    if (parser->startLineLength == 0) {
+        parser->startLineLength = length;
+        return;
+    }
+    if (parser->nHeaders == MAX_HTTP_HEADERS) {
+        parser->overflowed = 1;
+        return;
+    }
+    httpHeader_t *header = &parser->headers[parser->nHeaders++];
+    header->line = start;
+    header->lineLength = length;
+
+    const char *colon = memchr(buffer + start, ':', length);
+    if (!colon) {
+        header->nameLength = length;
+        header->value = start + length;
+        header->valueLength = 0;
+        return;
+    }
+    header->nameLength = colon - (buffer + start);
+    int value = header->nameLength + 1;
+    while (value < length &&
+           (buffer[start + value] == ' ' || buffer[start + value] == '\t')) {
+        value++;
+    }
+    int end = length;
+    while (end > value &&
+           (buffer[start + end - 1] == ' ' || buffer[start + end - 1] == '\t')) {
+        end--;
+    }
+    header->value = start + value;
+    header->valueLength = end - value;
+}
+
+/*****************************************************************************/
+// start parsing a new message
+void reset_http_parser(httpParser_t *parser) {
+    parser->scanned = parser->lineStart = parser->headerEnd = 0;
+    parser->startLineLength = parser->nHeaders = parser->overflowed = 0;
+}
+
+// scan bytes of buffer received since the last call for complete lines
+int feed_http_parser(httpParser_t *parser, const char *buffer, int length) {
+    while (!parser->headerEnd && parser->scanned < length) {
+        int newline = find_newline(buffer, parser->scanned, length);
+        if (newline < 0) {
+            parser->scanned = length;
+            break;
+        }
+        int start = parser->lineStart, end = newline;
+        int crlf = end > start && buffer[end - 1] == '\r';
+        end -= crlf;
+        parser->scanned = parser->lineStart = newline + 1;
+
+        if (end > start) {
+            record_line(parser, buffer, start, end - start);
+        } else if (crlf && start >= 2 && buffer[start - 2] == '\r') {
+            // "\r\n" right after a line that ended in "\r\n"
+            parser->headerEnd = newline + 1;
+        }
+    }
+    return parser->headerEnd;
+}
+
+// value of a hex digit, -1 if c is not one
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9') {
+        return c - '0';
+    }
+    c = tolower((unsigned char)c);
+    return (c >= 'a' && c <= 'f') ? c - 'a' + 10 : -1;
+}
+
+// follow the chunk framing of the next bytes of a body
+int feed_chunk_parser(chunkParser_t *parser, const char *data, int length) {
+    int i = 0;
+    while (i < length && parser->state != CHUNK_DONE) {
+        char c = data[i];
+        switch (parser->state) {
+        case CHUNK_SIZE:
+        case CHUNK_EXTENSION:
+            // size line: hex digits, then anything up to its line end
+            if (parser->state == CHUNK_SIZE && hex_value(c) >= 0 &&
+                parser->remaining < LONG_MAX / 16) {
+                parser->remaining = parser->remaining * 16 + hex_value(c);
+            } else if (c == '\n') {
+                parser->state =
+                    parser->remaining ? CHUNK_DATA : CHUNK_TRAILER;
+                parser->lineLength = 0;
+            } else {
+                parser->state = CHUNK_EXTENSION;
+            }
+            i++;
+            break;
+        case CHUNK_DATA: {
+            long take = length - i;
+            take = (take < parser->remaining) ? take : parser->remaining;
+            i += take;
+            parser->remaining -= take;
+            if (parser->remaining == 0) {
+                parser->state = CHUNK_DATA_END;
+            }
+            break;
+        }
+        case CHUNK_DATA_END:
+            if (c == '\n') {
+                parser->state = CHUNK_SIZE;
+            }
+            i++;
+            break;
+        case CHUNK_TRAILER:
+            if (c == '\n') {
+                parser->state =
+                    parser->lineLength ? CHUNK_TRAILER : CHUNK_DONE;
+                parser->lineLength = 0;
+            } else if (c != '\r') {
+                parser->lineLength++;
+            }
+            i++;
+            break;
+        case CHUNK_DONE:
+            break;
+        }
+    }
+    return parser->state == CHUNK_DONE;
+}
+
+// true if a header's name is name, ignoring case
+int http_header_is(const char *buffer, const httpHeader_t *header,
+                   const char *name) {
+    int length = strlen(name);
+    return header->nameLength == length &&
+           strncasecmp(buffer + header->line, name, length) == 0;
+}
+
+// offset of token in span ignoring case, -1 if it does not appear
+int http_find(const char *span, int length, const char *token) {
+    int tokenLength = strlen(token);
+    for (int offset = 0; offset <= length - tokenLength; offset++) {
+        if (strncasecmp(span + offset, token, tokenLength) == 0) {
+            return offset;
+        }
+    }
+    return -1;
+}
+
+// value of the number that starts span after any blanks, 0 if none and -1
+// if it is larger than a long holds
+long http_to_long(const char *span, int length) {
+    int i = 0;
+    long number = 0;
+    while (i < length && (span[i] == ' ' || span[i] == '\t')) {
+        i++;
+    }
+    for (; i < length && isdigit((unsigned char)span[i]); i++) {
+        int digit = span[i] - '0';
+        if (number > (LONG_MAX - digit) / 10) {
+            return -1;
+        }
+        number = number * 10 + digit;
+    }
+    return number;
+}
+
+/*****************************************************************************/
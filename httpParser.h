@@ -0,0 +1,73 @@
+#ifndef HTTPPARSER
+#define HTTPPARSER
+
+#define MAX_HTTP_HEADERS 64
+
+// one header line, as offsets into the buffer it was parsed from
+typedef struct httpHeader httpHeader_t;
+struct httpHeader {
+    int line;
+    int lineLength;
+    int nameLength;
+    // value with surrounding blanks trimmed, empty if the line has no ':'
+    int value;
+    int valueLength;
+};
+
+// resumable parser state for one request or response header; an all-zero
+// parser is ready for a new message
+typedef struct httpParser httpParser_t;
+struct httpParser {
+    // bytes already searched for line ends, and the line still arriving
+    int scanned;
+    int lineStart;
+    // offset just past the empty line, 0 until it has arrived
+    int headerEnd;
+    int startLineLength;
+    int nHeaders;
+    httpHeader_t headers[MAX_HTTP_HEADERS];
+    // set once a line past MAX_HTTP_HEADERS arrived; it is not recorded, so
+    // a header that frames the message may be missing and callers must
+    // reject it
+    int overflowed;
+};
+
+// progress through a chunked body
+typedef enum {
+    CHUNK_SIZE,
+    CHUNK_EXTENSION,
+    CHUNK_DATA,
+    CHUNK_DATA_END,
+    CHUNK_TRAILER,
+    CHUNK_DONE
+} chunkState_t;
+
+// resumable state for finding the end of a chunked body; an all-zero
+// parser is ready for a new body
+typedef struct chunkParser chunkParser_t;
+struct chunkParser {
+    chunkState_t state;
+    // data bytes left in the current chunk
+    long remaining;
+    // bytes of the current trailer line, 0 on the empty line that ends it
+    int lineLength;
+};
+
+// start parsing a new message
+void reset_http_parser(httpParser_t *parser);
+// scan bytes of buffer received since the last call; returns the offset
+// just past the empty line once the header is complete, otherwise 0
+int feed_http_parser(httpParser_t *parser, const char *buffer, int length);
+// follow the chunk framing of the next bytes of a body; returns 1 once the
+// last chunk and its trailer have gone past
+int feed_chunk_parser(chunkParser_t *parser, const char *data, int length);
+// true if a header's name is name, ignoring case
+int http_header_is(const char *buffer, const httpHeader_t *header,
+                   const char *name);
+// offset of token in span ignoring case, -1 if it does not appear
+int http_find(const char *span, int length, const char *token);
+// value of the number that starts span after any blanks, 0 if none and -1
+// if it is larger than a long holds
+long http_to_long(const char *span, int length);
+
+#endif
@@ -0,0 +1,147 @@
+/*
+Asynchronous logger. Every thread formats its lines into a ring of its own,
+so logging on the request path is a vsnprintf() and a copy, with no lock
+and no system call. A background thread wakes every few milliseconds and
+writes whatever the rings hold with one writev() per ring. A line that
+does not fit in a full ring is dropped rather than blocking the worker.
+*/
+
+#define _GNU_SOURCE
+#include <assert.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+
+// lines logged by one thread: its owner only moves head, the flusher
+// (holding flushLock) only moves tail. Rings live as long as the process.
+typedef struct logRing logRing_t;
+struct logRing {
+    char data[LOG_RING_SIZE];
+    atomic_size_t head;
+    atomic_size_t tail;
+    logRing_t *next;
+};
+
+static _Thread_local logRing_t *ownRing;
+static logRing_t *_Atomic rings;
+static pthread_mutex_t flushLock = PTHREAD_MUTEX_INITIALIZER;
+static int logFd = STDOUT_FILENO;
+static atomic_ulong dropped;
+
+/*****************************************************************************/
+// the calling thread's ring, made and linked in on its first line
+static logRing_t *thread_ring(void) {
+    if (!ownRing) {
+        ownRing = calloc(1, sizeof(logRing_t));
+        assert(ownRing);
+        ownRing->next = atomic_load(&rings);
+        while (!atomic_compare_exchange_weak(&rings, &ownRing->next,
+                                             ownRing)) {
+        }
+    }
+    return ownRing;
+}
+
+// write out what one ring holds, in at most two pieces where it wraps
+static void flush_ring(logRing_t *ring) {
+    size_t head = atomic_load_explicit(&ring->head, memory_order_acquire);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+    while (tail != head) {
+        size_t start = tail % LOG_RING_SIZE, length = head - tail;
+        struct iovec iov[2] = {{.iov_base = ring->data + start}};
+        int count = 1;
+        if (start + length > LOG_RING_SIZE) {
+            iov[0].iov_len = LOG_RING_SIZE - start;
+            iov[1].iov_base = ring->data;
+            iov[1].iov_len = length - iov[0].iov_len;
+            count = 2;
+        } else {
+            iov[0].iov_len = length;
+        }
+        ssize_t written = writev(logFd, iov, count);
+        if (written <= 0) {
+            // nowhere to write: let the lines go rather than fill up
+            written = length;
+        }
+        tail += written;
+        atomic_store_explicit(&ring->tail, tail, memory_order_release);
+    }
+}
+
+static void *run_flusher(void *arg) {
+    (void)arg;
+    struct timespec interval = {.tv_nsec = LOG_FLUSH_MS * 1000000L};
+    while (1) {
+        nanosleep(&interval, NULL);
+        flush_logger();
+    }
+    return NULL;
+}
+
+/*****************************************************************************/
+// start the background thread that writes logged lines to fd in batches
+void start_logger(int fd) {
+    logFd = fd;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_flusher, NULL) != 0) {
+        perror("Error: Cannot start logger\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+}
+
+// format a line into the calling thread's ring without blocking; the line
+// is dropped (and counted) if the ring is full
+void log_line(const char *format, ...) {
+    char line[LOG_LINE_MAX];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0) {
+        return;
+    }
+    // a truncated line still ends its line
+    if (length >= LOG_LINE_MAX) {
+        length = LOG_LINE_MAX - 1;
+        line[length - 1] = '\n';
+    }
+
+    logRing_t *ring = thread_ring();
+    size_t head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    size_t tail = atomic_load_explicit(&ring->tail, memory_order_acquire);
+    if (LOG_RING_SIZE - (head - tail) < (size_t)length) {
+        atomic_fetch_add(&dropped, 1);
+        return;
+    }
+    size_t start = head % LOG_RING_SIZE;
+    size_t first = LOG_RING_SIZE - start;
+    first = (first < (size_t)length) ? first : (size_t)length;
+    memcpy(ring->data + start, line, first);
+    memcpy(ring->data, line + first, length - first);
+    atomic_store_explicit(&ring->head, head + length, memory_order_release);
+}
+
+// write out every line logged so far, e.g. before exiting
+void flush_logger(void) {
+    pthread_mutex_lock(&flushLock);
+    for (logRing_t *ring = atomic_load(&rings); ring; ring = ring->next) {
+        flush_ring(ring);
+    }
+    pthread_mutex_unlock(&flushLock);
+}
+
+// lines dropped so far because a ring was full
+unsigned long logger_dropped(void) {
+    return atomic_load(&dropped);
+}
+
+/*****************************************************************************/
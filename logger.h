@@ -0,0 +1,18 @@
+#ifndef LOGGER
+#define LOGGER
+
+#define LOG_RING_SIZE (1 << 20)
+#define LOG_LINE_MAX 512
+#define LOG_FLUSH_MS 20
+
+// start the background thread that writes logged lines to fd in batches
+void start_logger(int fd);
+// format a line into the calling thread's ring without blocking; the line
+// is dropped (and counted) if the ring is full
+void log_line(const char *format, ...) __attribute__((format(printf, 1, 2)));
+// write out every line logged so far, e.g. before exiting
+void flush_logger(void);
+// lines dropped so far because a ring was full
+unsigned long logger_dropped(void);
+
+#endif
@@ -1,142 +1,239 @@
 #define _POSIX_C_SOURCE 200112L
-#include <arpa/inet.h>
-#include <assert.h>
-#include <netdb.h>
+#include <errno.h>
+#include <limits.h>
 #include <stdio.h>
+#include <sys/resource.h>
 #include <stdlib.h>
 #include <string.h>
-#include <ctype.h>
-#include <strings.h>
 #include <unistd.h>
 
+#include "compression.h"
 #include "dataStruct.h"
-#include "sockets.h"
+#include "diskTier.h"
+#include "dnsCache.h"
+#include "eventLoop.h"
+#include "freshness.h"
+#include "logger.h"
+#include "replay.h"
+#include "snapshot.h"
+#include "upstreamPool.h"
 
-#define BACKLOG 10
-#define MALFORMED_REQUEST 10
 #define DEFAULT_LISTEN_PORT "8080"
 
+#define MAX_THREADS 256
+#define MAX_OBJECT_LIMIT (1L << 30)
+#define DISK_THREADS 2
+#define PEER_NAME 64
+
 /**************************************************************************/
-void perform_caching_stages(cache_t *cache, cacheEntry_t *newCacheEntry,
-                            int *inCache, int *cacheable,
-                            cacheEntry_t *isStale);
-void get_port(int argc, char **argv, char **tcpPort, int *stage2);
-void evict_stale_cache(cacheEntry_t *isStale, cache_t *cache,
-                       cacheEntry_t *entry, int *inCache);
+void get_options(int argc, char **argv, proxyOptions_t *options);
 /**************************************************************************/
 
 int main(int argc, char *argv[]) {
 
-    char *tcpPort = DEFAULT_LISTEN_PORT;
-    int stage2 = 0;
-    cache_t *cache = create_cache();
-    get_port(argc, argv, &tcpPort, &stage2);
-
-    // create a listening socket
-    int listenfd = create_listening_socket(tcpPort, NULL);
-    int clientfd;
-    struct sockaddr_storage client_addr;
-    socklen_t client_addr_size;
-
-    // Accept a connection - loop until CTRL-C
-    while (1) {
-        // get a valid client address
-        client_addr_size = sizeof(client_addr);
-        clientfd = accept(listenfd, (struct sockaddr *)&client_addr,
-                          &client_addr_size);
-        if (clientfd < 0) {
-            continue;
-        }
-        printf("Accepted\n");
-        fflush(stdout);
-
-        // store new request in new cache entry
-        cacheEntry_t *newCacheEntry = create_cache_entry();
-        int cacheable = 1, inCache = 0;
-        read_message(newCacheEntry, clientfd, &cacheable, 1, -1, 1);
-
-        // handle malformed request
-        if (newCacheEntry->requestLength < MALFORMED_REQUEST ||
-            newCacheEntry->path[0] == '\0') {
-            close(clientfd);
-            continue;
-        }
-
-        // checking for any stale cache
-        cacheEntry_t *isStale = check_stale_cache(cache, newCacheEntry);
-
-        // perform least recently updated algorithm on cache
-        if (stage2 && cacheable) {
-            perform_lru(cache, newCacheEntry, NULL, &inCache);
-        }
-
-        // fetch cache that is not stale
-        if (inCache && !isStale) {
-            fetch_cache(newCacheEntry, clientfd, cache);
-        } else {
-            // if not in cache, forward to host server normally
-            int originfd = forward_request(newCacheEntry);
-            read_message(newCacheEntry, originfd, &cacheable, 0, clientfd, 1);
-            if (stage2) {
-                perform_caching_stages(cache, newCacheEntry, &inCache,
-                                       &cacheable, isStale);
-            } else {
-                free(newCacheEntry);
-            }
-        }
-        close(clientfd);
+    proxyOptions_t options = {.tcpPort = DEFAULT_LISTEN_PORT,
+                              .stage2 = 0,
+                              .capacity = DEFAULT_CACHE_BUDGET,
+                              .threads = 1,
+                              .pinCpus = 0,
+                              .statsInterval = 0,
+                              .upstreamPerHost = DEFAULT_UPSTREAM_PER_HOST,
+                              .upstreamIdle = DEFAULT_UPSTREAM_IDLE,
+                              .dnsTtl = DEFAULT_DNS_TTL,
+                              .dnsNegativeTtl = DEFAULT_DNS_NEGATIVE_TTL,
+                              .hostsFile = NULL,
+                              .clientIdle = DEFAULT_CLIENT_IDLE,
+                              .relayChunk = DEFAULT_RELAY_CHUNK,
+                              .zeroCopyThreshold =
+                                  DEFAULT_ZERO_COPY_THRESHOLD,
+                              .objectLimit = MAX_RESPONSE_BUFFER,
+                              .snapshotPath = NULL,
+                              .snapshotInterval = DEFAULT_SNAPSHOT_INTERVAL,
+                              .coalesceWait = DEFAULT_COALESCE_WAIT,
+                              .adminPort = NULL,
+                              .policy = NULL,
+                              .gzipLevel = 0,
+                              .diskPath = NULL,
+                              .diskCapacity = DEFAULT_DISK_BUDGET,
+                              .traceRequests = 0,
+                              .replayPath = NULL,
+                              .replayCapacities = NULL,
+                              .replayPolicies = NULL,
+                              .peers = NULL,
+                              .peerName = NULL,
+                              .negativeTtl = DEFAULT_NEGATIVE_TTL,
+                              .maxTunnels = DEFAULT_MAX_TUNNELS,
+                              .tunnelIdle = DEFAULT_TUNNEL_IDLE};
+    options.policy = find_cache_policy(DEFAULT_CACHE_POLICY);
+    get_options(argc, argv, &options);
+    set_negative_ttl(options.negativeTtl);
+    // a trace is replayed offline, without sockets or workers
+    if (options.replayPath) {
+        return run_replay(&options);
+    }
+    // siblings on the same machine list each other by loopback address
+    char peerName[PEER_NAME];
+    if (options.peers && !options.peerName) {
+        snprintf(peerName, sizeof(peerName), "127.0.0.1:%s", options.tcpPort);
+        options.peerName = peerName;
+    }
+    // log lines are written out in batches by a thread of the logger's own
+    start_logger(STDOUT_FILENO);
+
+    // every cached memfd body and spliced connection holds descriptors
+    struct rlimit files;
+    if (getrlimit(RLIMIT_NOFILE, &files) == 0) {
+        files.rlim_cur = files.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &files);
     }
-    free_cache(cache);
+    shardedCache_t *cache =
+        create_sharded_cache(options.capacity, options.threads, options.policy);
+    if (options.diskPath) {
+        attach_disk_tier(cache, create_disk_tier(options.diskPath,
+                                                 options.diskCapacity,
+                                                 DISK_THREADS));
+    }
+    if (options.snapshotPath) {
+        load_snapshot(cache, options.snapshotPath);
+    }
+
+    // Accept and serve connections on every worker - loop until CTRL-C or
+    // SIGTERM
+    run_workers(&options, cache);
+    free_sharded_cache(cache);
     return 0;
 }
 
 /**************************************************************************/
-// evict any stale 'now' un-cacheable requestQ
-void evict_stale_cache(cacheEntry_t *isStale, cache_t *cache,
-                       cacheEntry_t *entry, int *inCache) {
-    if (isStale) {
-        perform_lru(cache, entry, isStale, inCache);
-    }
-}
-
-// perform all tasks from 2-4
-void perform_caching_stages(cache_t *cache, cacheEntry_t *newCacheEntry,
-                            int *inCache, int *cacheable,
-                            cacheEntry_t *isStale) {
-    // new response is not cacheable (based on byte size)
-    if (!(*cacheable)) {
-        evict_stale_cache(isStale, cache, newCacheEntry, inCache);
-        free(newCacheEntry);
-        return;
-    }
-    // new response is within byte size, but cache-control says no
-    if (!(newCacheEntry->isCachable)) {
-        printf("Not caching %s %s\n", newCacheEntry->host, newCacheEntry->path);
-        fflush(stdout);
-        evict_stale_cache(isStale, cache, newCacheEntry, inCache);
-        free(newCacheEntry);
-        return;
-    }
-    // if this new response is not previously stale
-    if (!isStale) {
-        newCacheEntry->cachedTime = time(NULL);
-        enqueue_cache(cache, newCacheEntry);
-        return;
+// the value of an integer option, exiting with an error unless all of text
+// is a number from min to max
+static int parse_int_option(const char *flag, const char *text, int min,
+                            int max) {
+    char *end;
+    errno = 0;
+    long value = strtol(text, &end, 10);
+    if (end == text || *end != '\0' || errno == ERANGE || value < min ||
+        value > max) {
+        if (max == INT_MAX) {
+            fprintf(stderr, "Error: %s must be a number of at least %d\n",
+                    flag, min);
+        } else {
+            fprintf(stderr, "Error: %s must be a number from %d to %d\n",
+                    flag, min, max);
+        }
+        exit(EXIT_FAILURE);
     }
-    // if this new response is previously stale, copy new response to this
-    // stale cache
-    memcpy(isStale, newCacheEntry, sizeof(cacheEntry_t));
-    free(newCacheEntry);
+    return value;
 }
 
-// get listening port number
-void get_port(int argc, char **argv, char **tcpPort, int *stage2) {
-    // get tcp port number and cache flag
+// get listening port number, cache flag, cache byte budget and workers
+void get_options(int argc, char **argv, proxyOptions_t *options) {
     for (int i = 1; i < argc; i++) {
-        if (strcmp(argv[i], "-p") == 0) {
-            *tcpPort = argv[i + 1];
+        if (strcmp(argv[i], "-p") == 0 && i + 1 < argc) {
+            options->tcpPort = argv[++i];
         } else if (strcmp("-c", argv[i]) == 0) {
-            *stage2 = 1;
+            options->stage2 = 1;
+        } else if (strcmp("-m", argv[i]) == 0 && i + 1 < argc) {
+            options->capacity = parse_byte_size(argv[++i]);
+            if (options->capacity == 0) {
+                fprintf(stderr, "Error: cache budget must look like 512M\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp("-t", argv[i]) == 0 && i + 1 < argc) {
+            options->threads =
+                parse_int_option("-t", argv[++i], 1, MAX_THREADS);
+        } else if (strcmp("-a", argv[i]) == 0) {
+            options->pinCpus = 1;
+        } else if (strcmp("-s", argv[i]) == 0 && i + 1 < argc) {
+            options->statsInterval =
+                parse_int_option("-s", argv[++i], 0, INT_MAX);
+        } else if (strcmp("-k", argv[i]) == 0 && i + 1 < argc) {
+            options->upstreamPerHost =
+                parse_int_option("-k", argv[++i], 0, INT_MAX);
+        } else if (strcmp("-K", argv[i]) == 0 && i + 1 < argc) {
+            options->upstreamIdle =
+                parse_int_option("-K", argv[++i], 1, INT_MAX);
+        } else if (strcmp("-d", argv[i]) == 0 && i + 1 < argc) {
+            options->dnsTtl =
+                parse_int_option("-d", argv[++i], 0, INT_MAX);
+        } else if (strcmp("-D", argv[i]) == 0 && i + 1 < argc) {
+            options->dnsNegativeTtl =
+                parse_int_option("-D", argv[++i], 0, INT_MAX);
+        } else if (strcmp("-H", argv[i]) == 0 && i + 1 < argc) {
+            options->hostsFile = argv[++i];
+        } else if (strcmp("-i", argv[i]) == 0 && i + 1 < argc) {
+            options->clientIdle =
+                parse_int_option("-i", argv[++i], 1, INT_MAX);
+        } else if (strcmp("-b", argv[i]) == 0 && i + 1 < argc) {
+            size_t chunk = parse_byte_size(argv[++i]);
+            if (chunk < BUFFER_SIZE || chunk > INT_MAX) {
+                fprintf(stderr, "Error: -b must be at least %d and below 2G\n",
+                        BUFFER_SIZE);
+                exit(EXIT_FAILURE);
+            }
+            options->relayChunk = chunk;
+        } else if (strcmp("-z", argv[i]) == 0 && i + 1 < argc) {
+            size_t threshold = parse_byte_size(argv[++i]);
+            if (threshold == 0 || threshold > INT_MAX) {
+                fprintf(stderr, "Error: -z must look like 32K\n");
+                exit(EXIT_FAILURE);
+            }
+            options->zeroCopyThreshold = threshold;
+        } else if (strcmp("-o", argv[i]) == 0 && i + 1 < argc) {
+            size_t limit = parse_byte_size(argv[++i]);
+            if (limit < MAX_RESPONSE_BUFFER || limit > MAX_OBJECT_LIMIT) {
+                fprintf(stderr, "Error: -o must be between 100K and 1G\n");
+                exit(EXIT_FAILURE);
+            }
+            options->objectLimit = limit;
+        } else if (strcmp("-S", argv[i]) == 0 && i + 1 < argc) {
+            options->snapshotPath = argv[++i];
+        } else if (strcmp("-W", argv[i]) == 0 && i + 1 < argc) {
+            options->snapshotInterval =
+                parse_int_option("-W", argv[++i], 0, INT_MAX);
+        } else if (strcmp("-C", argv[i]) == 0 && i + 1 < argc) {
+            options->coalesceWait =
+                parse_int_option("-C", argv[++i], 0, INT_MAX);
+        } else if (strcmp("-A", argv[i]) == 0 && i + 1 < argc) {
+            options->adminPort = argv[++i];
+        } else if (strcmp("-P", argv[i]) == 0 && i + 1 < argc) {
+            options->policy = find_cache_policy(argv[++i]);
+            if (!options->policy) {
+                fprintf(stderr, "Error: -P must be lru or s3fifo\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp("-g", argv[i]) == 0 && i + 1 < argc) {
+            options->gzipLevel =
+                parse_int_option("-g", argv[++i], 0, MAX_GZIP_LEVEL);
+        } else if (strcmp("-L", argv[i]) == 0 && i + 1 < argc) {
+            options->diskPath = argv[++i];
+        } else if (strcmp("-M", argv[i]) == 0 && i + 1 < argc) {
+            options->diskCapacity = parse_byte_size(argv[++i]);
+            if (options->diskCapacity == 0) {
+                fprintf(stderr, "Error: disk budget must look like 4G\n");
+                exit(EXIT_FAILURE);
+            }
+        } else if (strcmp("-T", argv[i]) == 0) {
+            options->traceRequests = 1;
+        } else if (strcmp("--replay", argv[i]) == 0 && i + 1 < argc) {
+            options->replayPath = argv[++i];
+        } else if (strcmp("--capacities", argv[i]) == 0 && i + 1 < argc) {
+            options->replayCapacities = argv[++i];
+        } else if (strcmp("--policies", argv[i]) == 0 && i + 1 < argc) {
+            options->replayPolicies = argv[++i];
+        } else if (strcmp("-N", argv[i]) == 0 && i + 1 < argc) {
+            options->peers = argv[++i];
+        } else if (strcmp("-I", argv[i]) == 0 && i + 1 < argc) {
+            options->peerName = argv[++i];
+        } else if (strcmp("-n", argv[i]) == 0 && i + 1 < argc) {
+            options->negativeTtl =
+                parse_int_option("-n", argv[++i], 0, INT_MAX);
+        } else if (strcmp("-x", argv[i]) == 0 && i + 1 < argc) {
+            options->maxTunnels =
+                parse_int_option("-x", argv[++i], 0, INT_MAX);
+        } else if (strcmp("-X", argv[i]) == 0 && i + 1 < argc) {
+            options->tunnelIdle =
+                parse_int_option("-X", argv[++i], 1, INT_MAX);
         }
     }
 }
@@ -0,0 +1,150 @@
+/*
+Size-class pool for cache entries and message buffers. Classes are powers of
+two from 64 bytes to 1 MB, larger blocks are malloced at their own size.
+Freed blocks are kept on the freeing thread's class free list so the next
+request reuses them without another malloc, but only up to a few MB per
+thread: a block allocated on one thread is often freed on another (a disk
+thread reads an entry back, a worker evicts it), so past the cap they go
+back to malloc rather than piling up where nothing allocates them again.
+*/
+
+#include <assert.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "memPool.h"
+
+#define MIN_CLASS_SHIFT 6
+#define NUM_CLASSES 15
+#define LARGE_CLASS NUM_CLASSES
+// bytes of free blocks one thread keeps over all its classes
+#define MAX_FREE_BYTES (4UL << 20)
+// change in a thread's free bytes that is added to the shared total at once
+#define REPORT_BYTES 65536
+
+// header kept in front of every block, padded to keep payloads aligned
+typedef union blockHeader blockHeader_t;
+union blockHeader {
+    struct {
+        size_t sizeClass;
+        size_t size;
+        blockHeader_t *nextFree;
+    } info;
+    max_align_t align;
+};
+
+// free lists are per thread so workers never contend on the pool
+static _Thread_local blockHeader_t *freeLists[NUM_CLASSES];
+static _Thread_local size_t freeBytes;
+// free bytes of every thread, brought up to date in steps of REPORT_BYTES
+static _Thread_local long unreported;
+static atomic_long retainedBytes;
+
+/*****************************************************************************/
+// smallest class whose blocks hold size bytes, LARGE_CLASS if none does
+static size_t size_class(size_t size) {
+    size_t sizeClass = 0;
+    while (sizeClass < NUM_CLASSES &&
+           ((size_t)1 << (sizeClass + MIN_CLASS_SHIFT)) < size) {
+        sizeClass++;
+    }
+    return sizeClass;
+}
+
+// account for a change in this thread's free bytes
+static void count_free_bytes(long change) {
+    freeBytes += change;
+    unreported += change;
+    if (unreported >= REPORT_BYTES || unreported <= -REPORT_BYTES) {
+        atomic_fetch_add_explicit(&retainedBytes, unreported,
+                                  memory_order_relaxed);
+        unreported = 0;
+    }
+}
+
+/*****************************************************************************/
+// get a block of at least size bytes, contents are not initialised
+void *pool_alloc(size_t size) {
+    size_t sizeClass = size_class(size);
+    blockHeader_t *header;
+
+    if (sizeClass == LARGE_CLASS) {
+        header = malloc(sizeof(blockHeader_t) + size);
+        assert(header);
+        header->info.sizeClass = LARGE_CLASS;
+        header->info.size = size;
+        return header + 1;
+    }
+
+    header = freeLists[sizeClass];
+    if (!header) {
+        size_t classSize = (size_t)1 << (sizeClass + MIN_CLASS_SHIFT);
+        header = malloc(sizeof(blockHeader_t) + classSize);
+        assert(header);
+        header->info.sizeClass = sizeClass;
+        header->info.size = classSize;
+        return header + 1;
+    }
+    freeLists[sizeClass] = header->info.nextFree;
+    count_free_bytes(-(long)header->info.size);
+    return header + 1;
+}
+
+// grow or shrink a block, keeping its contents
+void *pool_realloc(void *ptr, size_t size) {
+    if (!ptr) {
+        return pool_alloc(size);
+    }
+    size_t oldSize = pool_block_size(ptr);
+    if (size <= oldSize && size_class(size) == size_class(oldSize)) {
+        return ptr;
+    }
+    void *newPtr = pool_alloc(size);
+    memcpy(newPtr, ptr, oldSize < size ? oldSize : size);
+    pool_free(ptr);
+    return newPtr;
+}
+
+// grow a block only if it cannot already hold needed bytes
+void *pool_reserve(void *ptr, size_t needed) {
+    if (!ptr || pool_block_size(ptr) < needed) {
+        ptr = pool_realloc(ptr, needed);
+    }
+    return ptr;
+}
+
+// hand a block back to its size class
+void pool_free(void *ptr) {
+    if (!ptr) {
+        return;
+    }
+    blockHeader_t *header = (blockHeader_t *)ptr - 1;
+    size_t sizeClass = header->info.sizeClass;
+    // large blocks, and any past this thread's cap, go back to malloc
+    if (sizeClass == LARGE_CLASS ||
+        freeBytes + header->info.size > MAX_FREE_BYTES) {
+        free(header);
+        return;
+    }
+    count_free_bytes(header->info.size);
+    header->info.nextFree = freeLists[sizeClass];
+    freeLists[sizeClass] = header;
+}
+
+// usable bytes of a block, which is what it costs against a cache budget
+size_t pool_block_size(void *ptr) {
+    if (!ptr) {
+        return 0;
+    }
+    return ((blockHeader_t *)ptr - 1)->info.size;
+}
+
+/*****************************************************************************/
+// bytes of freed blocks kept on the free lists of every thread, to within
+// REPORT_BYTES a thread
+size_t pool_retained_bytes(void) {
+    long bytes = atomic_load_explicit(&retainedBytes, memory_order_relaxed);
+    return (bytes > 0) ? (size_t)bytes : 0;
+}
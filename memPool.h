@@ -0,0 +1,23 @@
+#ifndef MEMPOOL
+#define MEMPOOL
+
+#include <stddef.h>
+
+// size-class pool used for cache entries and message buffers so their
+// storage is sized to their content and recycled instead of re-zeroed
+
+// get a block of at least size bytes, contents are not initialised
+void *pool_alloc(size_t size);
+// grow or shrink a block, keeping its contents
+void *pool_realloc(void *ptr, size_t size);
+// grow a block only if it cannot already hold needed bytes
+void *pool_reserve(void *ptr, size_t needed);
+// hand a block back to its size class
+void pool_free(void *ptr);
+// usable bytes of a block, which is what it costs against a cache budget
+size_t pool_block_size(void *ptr);
+// bytes of freed blocks the pool keeps for reuse over all threads, outside
+// any cache budget
+size_t pool_retained_bytes(void);
+
+#endif
@@ -0,0 +1,440 @@
+/*
+Counters and per-stage latency histograms, and the admin endpoint that
+exposes them. Each worker owns its counters, so recording is an
+uncontended atomic add, and latencies fall into power-of-two microsecond
+buckets so a histogram is a fixed array. The admin endpoint runs on its own
+thread and port, sums every worker when scraped and answers in the
+Prometheus text format, so the request path never waits on it.
+*/
+
+#define _GNU_SOURCE
+#include <poll.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "diskTier.h"
+#include "httpParser.h"
+#include "logger.h"
+#include "memPool.h"
+#include "metrics.h"
+#include "sockets.h"
+
+#define ADMIN_REQUEST 4096
+#define ADMIN_TIMEOUT 1
+#define METRICS_PATH "GET /metrics"
+
+// what the admin thread reports on
+typedef struct adminServer adminServer_t;
+struct adminServer {
+    int listenfd;
+    workerStats_t **workers;
+    int nWorkers;
+    shardedCache_t *cache;
+    dnsCache_t *dns;
+    peerRing_t *peers;
+};
+
+// a text buffer filled a line at a time
+typedef struct metricsText metricsText_t;
+struct metricsText {
+    char *data;
+    int length;
+};
+
+static const char *stageNames[NUM_STAGES] = {
+    "accept", "parse", "lookup", "connect", "first_byte", "relay"};
+
+/*****************************************************************************/
+// monotonic clock in nanoseconds, for measuring stages
+long now_ns(void) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000L + now.tv_nsec;
+}
+
+// count one latency of a stage that began at start (from now_ns()) and
+// ends now; returns now
+long record_latency(workerStats_t *stats, stage_t stage, long start) {
+    long now = now_ns();
+    long micros = (now - start + 999) / 1000;
+    // bucket i counts latencies of at most 2^i microseconds
+    int bucket = (micros <= 1) ? 0 : 64 - __builtin_clzl(micros - 1);
+    bucket = (bucket < LATENCY_BUCKETS) ? bucket : LATENCY_BUCKETS;
+    latencyHistogram_t *histogram = &stats->stages[stage];
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1,
+                              memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sumNs, now - start,
+                              memory_order_relaxed);
+    return now;
+}
+
+/*****************************************************************************/
+// append a formatted line, dropping what does not fit. vsnprintf returns
+// the length it wanted, so a line cut short leaves the buffer full (less
+// its terminator) and nothing more is taken.
+static void add_text(metricsText_t *text, const char *format, ...) {
+    int room = METRICS_BUFFER - text->length;
+    if (room <= 1) {
+        return;
+    }
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(text->data + text->length, room, format, args);
+    va_end(args);
+    if (length >= room) {
+        text->length = METRICS_BUFFER - 1;
+    } else if (length > 0) {
+        text->length += length;
+    }
+}
+
+// a counter's header and its value
+static void add_counter(metricsText_t *text, const char *name,
+                        const char *help, unsigned long value) {
+    add_text(text, "# HELP %s %s\n# TYPE %s counter\n%s %lu\n", name, help,
+             name, name, value);
+}
+
+// one counter of every worker added up
+static unsigned long sum_workers(adminServer_t *admin, size_t offset) {
+    unsigned long total = 0;
+    for (int i = 0; i < admin->nWorkers; i++) {
+        total += atomic_load((atomic_ulong *)((char *)admin->workers[i] +
+                                              offset));
+    }
+    return total;
+}
+
+// every stage's histogram, summed over the workers, as cumulative buckets
+static void add_latencies(metricsText_t *text, adminServer_t *admin) {
+    const char *name = "htproxy_stage_duration_seconds";
+    add_text(text, "# HELP %s Time spent in each stage of a request.\n",
+             name);
+    add_text(text, "# TYPE %s histogram\n", name);
+    for (int stage = 0; stage < NUM_STAGES; stage++) {
+        unsigned long cumulative = 0, count = 0, sumNs = 0;
+        for (int bucket = 0; bucket <= LATENCY_BUCKETS; bucket++) {
+            for (int i = 0; i < admin->nWorkers; i++) {
+                cumulative += atomic_load(
+                    &admin->workers[i]->stages[stage].buckets[bucket]);
+            }
+            if (bucket < LATENCY_BUCKETS) {
+                add_text(text, "%s_bucket{stage=\"%s\",le=\"%g\"} %lu\n",
+                         name, stageNames[stage], (1L << bucket) / 1e6,
+                         cumulative);
+            } else {
+                add_text(text, "%s_bucket{stage=\"%s\",le=\"+Inf\"} %lu\n",
+                         name, stageNames[stage], cumulative);
+            }
+        }
+        for (int i = 0; i < admin->nWorkers; i++) {
+            count += atomic_load(&admin->workers[i]->stages[stage].count);
+            sumNs += atomic_load(&admin->workers[i]->stages[stage].sumNs);
+        }
+        add_text(text, "%s_sum{stage=\"%s\"} %.9f\n", name, stageNames[stage],
+                 sumNs / 1e9);
+        add_text(text, "%s_count{stage=\"%s\"} %lu\n", name,
+                 stageNames[stage], count);
+    }
+}
+
+// what the disk tier holds and has moved in and out of memory
+static void add_disk_tier(metricsText_t *text, diskTier_t *tier) {
+    pthread_mutex_lock(&tier->lock);
+    int entries = tier->count;
+    unsigned long bytes = tier->usedBytes;
+    pthread_mutex_unlock(&tier->lock);
+    add_counter(text, "htproxy_disk_demotions_total",
+                "Evicted entries written to the disk tier.",
+                atomic_load(&tier->demotions));
+    add_counter(text, "htproxy_disk_promotions_total",
+                "Entries read back from the disk tier into memory.",
+                atomic_load(&tier->promotions));
+    add_counter(text, "htproxy_disk_overwritten_total",
+                "Disk tier records overwritten before being read back.",
+                atomic_load(&tier->overwritten));
+    add_counter(text, "htproxy_disk_errors_total",
+                "Disk tier records that could not be written or read.",
+                atomic_load(&tier->errors));
+    add_text(text, "# HELP htproxy_disk_entries Entries in the disk tier.\n"
+                   "# TYPE htproxy_disk_entries gauge\n"
+                   "htproxy_disk_entries %d\n",
+             entries);
+    add_text(text, "# HELP htproxy_disk_bytes Bytes of the disk tier's log "
+                   "holding records.\n# TYPE htproxy_disk_bytes gauge\n"
+                   "htproxy_disk_bytes %lu\n",
+             bytes);
+}
+
+// misses fetched from each other member of the cluster, forwards to it that
+// failed, and requests the members sent here
+static void add_peers(metricsText_t *text, adminServer_t *admin) {
+    peerRing_t *ring = admin->peers;
+    add_text(text, "# HELP htproxy_peer_fetches_total Misses fetched from "
+                   "the cluster member owning their key.\n"
+                   "# TYPE htproxy_peer_fetches_total counter\n");
+    for (int i = 0; i < ring->nNodes; i++) {
+        if (!ring->nodes[i].isSelf) {
+            add_text(text, "htproxy_peer_fetches_total{peer=\"%s\"} %lu\n",
+                     ring->nodes[i].name,
+                     atomic_load(&ring->nodes[i].fetches));
+        }
+    }
+    add_text(text, "# HELP htproxy_peer_failures_total Fetches from a "
+                   "member that failed and went to the origin.\n"
+                   "# TYPE htproxy_peer_failures_total counter\n");
+    for (int i = 0; i < ring->nNodes; i++) {
+        if (!ring->nodes[i].isSelf) {
+            add_text(text, "htproxy_peer_failures_total{peer=\"%s\"} %lu\n",
+                     ring->nodes[i].name,
+                     atomic_load(&ring->nodes[i].failures));
+        }
+    }
+    add_counter(text, "htproxy_peer_received_total",
+                "Requests other members of the cluster sent here.",
+                sum_workers(admin, offsetof(workerStats_t, peerReceived)));
+}
+
+// CONNECT tunnels opened, open now and turned away, and the bytes they
+// carried from the client (up) and back (down)
+static void add_tunnels(metricsText_t *text, adminServer_t *admin) {
+    // closes are read first so the gauge cannot go below zero
+    unsigned long closed =
+        sum_workers(admin, offsetof(workerStats_t, tunnelsClosed));
+    unsigned long opened = sum_workers(admin, offsetof(workerStats_t, tunnels));
+    add_counter(text, "htproxy_tunnels_total", "CONNECT tunnels opened.",
+                opened);
+    add_text(text, "# HELP htproxy_tunnels_active CONNECT tunnels open.\n"
+                   "# TYPE htproxy_tunnels_active gauge\n"
+                   "htproxy_tunnels_active %lu\n",
+             opened - closed);
+    add_counter(text, "htproxy_tunnels_rejected_total",
+                "CONNECT requests turned away at the tunnel limit.",
+                sum_workers(admin, offsetof(workerStats_t, tunnelsRejected)));
+    add_text(text, "# HELP htproxy_tunnel_bytes_total Bytes carried through "
+                   "CONNECT tunnels.\n"
+                   "# TYPE htproxy_tunnel_bytes_total counter\n");
+    add_text(text, "htproxy_tunnel_bytes_total{direction=\"up\"} %lu\n",
+             sum_workers(admin, offsetof(workerStats_t, tunnelBytesUp)));
+    add_text(text, "htproxy_tunnel_bytes_total{direction=\"down\"} %lu\n",
+             sum_workers(admin, offsetof(workerStats_t, tunnelBytesDown)));
+}
+
+// everything the endpoint reports, as Prometheus text
+static void format_metrics(metricsText_t *text, adminServer_t *admin) {
+    // labelled with the replacement policy so runs under different
+    // policies can be compared
+    const char *policy = admin->cache->policy->name;
+    add_text(text, "# HELP htproxy_requests_total Requests answered from "
+                   "cache (hit) or the origin (miss).\n"
+                   "# TYPE htproxy_requests_total counter\n");
+    add_text(text, "htproxy_requests_total{policy=\"%s\",result=\"hit\"} %lu\n",
+             policy, sum_workers(admin, offsetof(workerStats_t, hits)));
+    add_text(text,
+             "htproxy_requests_total{policy=\"%s\",result=\"miss\"} %lu\n",
+             policy, sum_workers(admin, offsetof(workerStats_t, misses)));
+    unsigned long diskHits =
+        sum_workers(admin, offsetof(workerStats_t, diskHits));
+    add_text(text, "# HELP htproxy_tier_hits_total Cache hits by the tier "
+                   "their entry was found in.\n"
+                   "# TYPE htproxy_tier_hits_total counter\n");
+    add_text(text, "htproxy_tier_hits_total{tier=\"memory\"} %lu\n",
+             sum_workers(admin, offsetof(workerStats_t, hits)) - diskHits);
+    add_text(text, "htproxy_tier_hits_total{tier=\"disk\"} %lu\n", diskHits);
+    add_counter(text, "htproxy_coalesced_total",
+                "Misses that followed a fetch already under way.",
+                sum_workers(admin, offsetof(workerStats_t, coalesced)));
+    add_counter(text, "htproxy_coalesce_fallbacks_total",
+                "Coalesced misses that fetched on their own after all.",
+                sum_workers(admin,
+                            offsetof(workerStats_t, coalesceFallbacks)));
+    add_counter(text, "htproxy_stale_found_total",
+                "Requests whose cached entry was past its max-age.",
+                sum_workers(admin, offsetof(workerStats_t, staleFound)));
+    add_counter(text, "htproxy_revalidated_total",
+                "Stale entries the origin confirmed with a 304.",
+                sum_workers(admin, offsetof(workerStats_t, revalidated)));
+    add_text(text, "# HELP htproxy_stale_served_total Stale entries served "
+                   "while revalidating or for an origin error.\n"
+                   "# TYPE htproxy_stale_served_total counter\n");
+    add_text(text, "htproxy_stale_served_total{reason=\"revalidating\"} %lu\n",
+             sum_workers(admin, offsetof(workerStats_t, staleServed)));
+    add_text(text, "htproxy_stale_served_total{reason=\"error\"} %lu\n",
+             sum_workers(admin, offsetof(workerStats_t, staleOnError)));
+    add_counter(text, "htproxy_bytes_served_total",
+                "Bytes sent to clients.",
+                sum_workers(admin, offsetof(workerStats_t, bytesServed)));
+    add_counter(text, "htproxy_range_responses_total",
+                "Range requests answered with a 206 or 416.",
+                sum_workers(admin, offsetof(workerStats_t, ranged)));
+    add_counter(text, "htproxy_gzipped_total",
+                "Text bodies gzipped as they were cached.",
+                sum_workers(admin, offsetof(workerStats_t, gzipped)));
+    add_text(text, "# HELP htproxy_gzip_bytes_total Bytes of the bodies "
+                   "gzipped, before and after.\n"
+                   "# TYPE htproxy_gzip_bytes_total counter\n");
+    add_text(text, "htproxy_gzip_bytes_total{stage=\"in\"} %lu\n",
+             sum_workers(admin, offsetof(workerStats_t, gzipInBytes)));
+    add_text(text, "htproxy_gzip_bytes_total{stage=\"out\"} %lu\n",
+             sum_workers(admin, offsetof(workerStats_t, gzipOutBytes)));
+    add_counter(text, "htproxy_inflated_total",
+                "Gzip entries inflated for clients that do not take gzip.",
+                sum_workers(admin, offsetof(workerStats_t, inflated)));
+    add_text(text, "# HELP htproxy_compression_seconds_total Time spent "
+                   "compressing and inflating bodies.\n"
+                   "# TYPE htproxy_compression_seconds_total counter\n");
+    add_text(text, "htproxy_compression_seconds_total{op=\"deflate\"} %.9f\n",
+             sum_workers(admin, offsetof(workerStats_t, gzipNs)) / 1e9);
+    add_text(text, "htproxy_compression_seconds_total{op=\"inflate\"} %.9f\n",
+             sum_workers(admin, offsetof(workerStats_t, inflateNs)) / 1e9);
+    add_tunnels(text, admin);
+
+    unsigned long entries = 0, bytes = 0, evictions = 0, expirations = 0;
+    for (unsigned long i = 0; i < admin->cache->nShards; i++) {
+        cache_t *shard = admin->cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        entries += shard->count;
+        bytes += shard->usedBytes;
+        evictions += shard->evictions;
+        expirations += shard->expirations;
+        pthread_mutex_unlock(&shard->lock);
+    }
+    add_counter(text, "htproxy_evictions_total",
+                "Entries evicted to make room.", evictions);
+    add_counter(text, "htproxy_expirations_total",
+                "Entries reclaimed once past their max-age and stale windows.",
+                expirations);
+    add_text(text, "# HELP htproxy_cache_entries Entries cached.\n"
+                   "# TYPE htproxy_cache_entries gauge\n"
+                   "htproxy_cache_entries %lu\n",
+             entries);
+    add_text(text, "# HELP htproxy_cache_bytes Bytes charged to the cache "
+                   "budget.\n# TYPE htproxy_cache_bytes gauge\n"
+                   "htproxy_cache_bytes %lu\n",
+             bytes);
+    add_text(text, "# HELP htproxy_pool_free_bytes Bytes of freed blocks "
+                   "the memory pool keeps for reuse, outside the cache "
+                   "budget.\n# TYPE htproxy_pool_free_bytes gauge\n"
+                   "htproxy_pool_free_bytes %zu\n",
+             pool_retained_bytes());
+    if (admin->cache->disk) {
+        add_disk_tier(text, admin->cache->disk);
+    }
+    if (admin->peers) {
+        add_peers(text, admin);
+    }
+    add_text(text, "# HELP htproxy_dns_lookups_total Origin names found in "
+                   "the resolver cache (hit) or not (miss).\n"
+                   "# TYPE htproxy_dns_lookups_total counter\n");
+    add_text(text, "htproxy_dns_lookups_total{result=\"hit\"} %lu\n",
+             atomic_load(&admin->dns->hits));
+    add_text(text, "htproxy_dns_lookups_total{result=\"miss\"} %lu\n",
+             atomic_load(&admin->dns->misses));
+    add_counter(text, "htproxy_log_dropped_total",
+                "Log lines dropped because a log ring was full.",
+                logger_dropped());
+    add_latencies(text, admin);
+}
+
+// read one request from an admin client and answer it
+static void answer_admin(adminServer_t *admin, int clientfd, char *request,
+                         metricsText_t *text) {
+    struct timeval timeout = {.tv_sec = ADMIN_TIMEOUT};
+    setsockopt(clientfd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(clientfd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    int length = 0;
+    while (!feed_http_parser(&parser, request, length)) {
+        if (length == ADMIN_REQUEST) {
+            return;
+        }
+        ssize_t got = recv(clientfd, request + length, ADMIN_REQUEST - length,
+                           0);
+        if (got <= 0) {
+            return;
+        }
+        length += got;
+    }
+
+    char header[256];
+    text->length = 0;
+    int found = parser.startLineLength > (int)strlen(METRICS_PATH) &&
+                strncmp(request, METRICS_PATH, strlen(METRICS_PATH)) == 0 &&
+                (request[strlen(METRICS_PATH)] == ' ' ||
+                 request[strlen(METRICS_PATH)] == '?');
+    if (found) {
+        format_metrics(text, admin);
+    } else {
+        add_text(text, "Not found, try /metrics\n");
+    }
+    int headerLength = sprintf(
+        header,
+        "HTTP/1.1 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+        "Content-Length: %d\r\nConnection: close\r\n\r\n",
+        found ? "200 OK" : "404 Not Found", text->length);
+    if (send(clientfd, header, headerLength, MSG_NOSIGNAL) == headerLength) {
+        send(clientfd, text->data, text->length, MSG_NOSIGNAL);
+    }
+}
+
+// answer admin clients one at a time; scrapes are rare and quick
+static void *run_admin_server(void *arg) {
+    adminServer_t *admin = arg;
+    char *request = malloc(ADMIN_REQUEST);
+    metricsText_t text = {.data = malloc(METRICS_BUFFER)};
+    if (!request || !text.data) {
+        perror("Error: Cannot allocate admin buffers\n");
+        exit(EXIT_FAILURE);
+    }
+    struct pollfd listener = {.fd = admin->listenfd, .events = POLLIN};
+    while (1) {
+        if (poll(&listener, 1, -1) < 0) {
+            continue;
+        }
+        int clientfd = accept(admin->listenfd, NULL, NULL);
+        if (clientfd < 0) {
+            continue;
+        }
+        answer_admin(admin, clientfd, request, &text);
+        close(clientfd);
+    }
+    return NULL;
+}
+
+/*****************************************************************************/
+// serve the counters and latencies of every worker, the cache and the
+// resolver as Prometheus text at GET /metrics on port, from a thread of
+// its own
+void start_admin_server(char *port, workerStats_t **workers, int nWorkers,
+                        shardedCache_t *cache, dnsCache_t *dns,
+                        peerRing_t *peers) {
+    adminServer_t *admin = malloc(sizeof(adminServer_t));
+    if (!admin) {
+        perror("Error: Cannot allocate admin server\n");
+        exit(EXIT_FAILURE);
+    }
+    admin->listenfd = create_listening_socket(port);
+    admin->workers = workers;
+    admin->nWorkers = nWorkers;
+    admin->cache = cache;
+    admin->dns = dns;
+    admin->peers = peers;
+    pthread_t thread;
+    if (pthread_create(&thread, NULL, run_admin_server, admin) != 0) {
+        perror("Error: Cannot start admin server\n");
+        exit(EXIT_FAILURE);
+    }
+    pthread_detach(thread);
+    log_line("Admin: metrics at http://localhost:%s/metrics\n", port);
+}
+
+/*****************************************************************************/
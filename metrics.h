@@ -0,0 +1,91 @@
+#ifndef METRICS
+#define METRICS
+
+#include <stdatomic.h>
+
+#include "dataStruct.h"
+#include "dnsCache.h"
+#include "peerRing.h"
+
+// latency buckets are powers of two microseconds, 1us up to about 8s, with
+// one more for anything slower
+#define LATENCY_BUCKETS 24
+#define METRICS_BUFFER 65536
+
+// stages of a request whose latencies are recorded
+typedef enum {
+    STAGE_ACCEPT,
+    STAGE_PARSE,
+    STAGE_LOOKUP,
+    STAGE_CONNECT,
+    STAGE_FIRST_BYTE,
+    STAGE_RELAY,
+    NUM_STAGES
+} stage_t;
+
+typedef struct latencyHistogram latencyHistogram_t;
+struct latencyHistogram {
+    atomic_ulong buckets[LATENCY_BUCKETS + 1];
+    atomic_ulong count;
+    atomic_ulong sumNs;
+};
+
+// what one worker has served. Only the worker writes them; the stats
+// reporter and the admin endpoint read them.
+typedef struct workerStats workerStats_t;
+struct workerStats {
+    // hits (those whose entry came back from the disk tier among them) and
+    // misses
+    atomic_ulong hits;
+    atomic_ulong misses;
+    atomic_ulong diskHits;
+    // misses that followed another fetch, some falling back to their own
+    atomic_ulong coalesced;
+    atomic_ulong coalesceFallbacks;
+    // stale entries found, refreshed with a 304, and served while refreshed
+    // or in place of an origin error
+    atomic_ulong staleFound;
+    atomic_ulong revalidated;
+    atomic_ulong staleServed;
+    atomic_ulong staleOnError;
+    // bytes sent to clients
+    atomic_ulong bytesServed;
+    // bodies gzipped for the cache (bytes before and after, and the time it
+    // took), and copies inflated for clients without gzip
+    atomic_ulong gzipped;
+    atomic_ulong gzipInBytes;
+    atomic_ulong gzipOutBytes;
+    atomic_ulong gzipNs;
+    atomic_ulong inflated;
+    atomic_ulong inflateNs;
+    // range requests answered with a 206 or 416
+    atomic_ulong ranged;
+    // misses fetched from the cluster member owning their key, those that
+    // fell back to the origin, and requests other members sent here
+    atomic_ulong peerFetches;
+    atomic_ulong peerFallbacks;
+    atomic_ulong peerReceived;
+    // CONNECT tunnels opened, closed and turned away at the limit, and the
+    // bytes they carried from the client (up) and back (down)
+    atomic_ulong tunnels;
+    atomic_ulong tunnelsClosed;
+    atomic_ulong tunnelsRejected;
+    atomic_ulong tunnelBytesUp;
+    atomic_ulong tunnelBytesDown;
+    // how long each stage took
+    latencyHistogram_t stages[NUM_STAGES];
+};
+
+// monotonic clock in nanoseconds, for measuring stages
+long now_ns(void);
+// count one latency of a stage that began at start (from now_ns()) and
+// ends now; returns now
+long record_latency(workerStats_t *stats, stage_t stage, long start);
+// serve the counters and latencies of every worker, the cache, the
+// resolver and the cluster (NULL if not in one) as Prometheus text at GET
+// /metrics on port, from a thread of its own
+void start_admin_server(char *port, workerStats_t **workers, int nWorkers,
+                        shardedCache_t *cache, dnsCache_t *dns,
+                        peerRing_t *peers);
+
+#endif
@@ -0,0 +1,152 @@
+/*
+Cooperative cache cluster. Every member is started with the same list of
+siblings and places each of them, itself included, at PEER_VNODES points on
+a consistent-hash ring, so all members agree on which one owns a cache key
+without talking to each other, and a member joining or leaving only moves
+the keys next to its own points. A miss for a key another member owns is
+fetched from that member, which caches it once for the whole cluster; a
+member that cannot be reached is passed over for a while and its keys are
+fetched from the origin.
+*/
+
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "dataStruct.h"
+#include "logger.h"
+#include "peerRing.h"
+
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+#define MAX_PEERS 64
+
+/*****************************************************************************/
+// spread the bits of an FNV hash, whose high bits barely change between
+// names that differ in their last characters
+static unsigned long mix_hash(unsigned long hash) {
+    hash ^= hash >> 30;
+    hash *= 0xbf58476d1ce4e5b9UL;
+    hash ^= hash >> 27;
+    hash *= 0x94d049bb133111ebUL;
+    hash ^= hash >> 31;
+    return hash;
+}
+
+// FNV-1a over a member's name and the number of one of its points
+static unsigned long hash_point(const char *name, int point) {
+    char text[128];
+    int length = snprintf(text, sizeof(text), "%s#%d", name, point);
+    unsigned long hash = FNV_OFFSET;
+    for (int i = 0; i < length && i < (int)sizeof(text) - 1; i++) {
+        hash ^= (unsigned char)text[i];
+        hash *= FNV_PRIME;
+    }
+    return mix_hash(hash);
+}
+
+// qsort order of ring points
+static int compare_points(const void *a, const void *b) {
+    const ringPoint_t *left = a, *right = b;
+    if (left->hash != right->hash) {
+        return (left->hash < right->hash) ? -1 : 1;
+    }
+    return left->node - right->node;
+}
+
+// fill in a member from its host:port name; exits if it is not one
+static void set_peer_node(peerNode_t *node, const char *name, int isSelf) {
+    const char *colon = strrchr(name, ':');
+    if (!colon || colon == name || colon[1] == '\0') {
+        fprintf(stderr, "Error: peers must look like host:port, not %s\n",
+                name);
+        exit(EXIT_FAILURE);
+    }
+    node->name = strdup(name);
+    node->host = strndup(name, colon - name);
+    node->port = strdup(colon + 1);
+    assert(node->name && node->host && node->port);
+    node->isSelf = isSelf;
+    atomic_init(&node->downUntil, 0);
+    atomic_init(&node->fetches, 0);
+    atomic_init(&node->failures, 0);
+}
+
+/*****************************************************************************/
+// build the ring of self and the comma-separated host:port siblings (which
+// may list self too, so every member can be given the same list); exits on
+// a malformed list
+peerRing_t *create_peer_ring(const char *self, const char *siblings) {
+    peerRing_t *ring = malloc(sizeof(peerRing_t));
+    assert(ring);
+    ring->nodes = calloc(MAX_PEERS, sizeof(peerNode_t));
+    assert(ring->nodes);
+    set_peer_node(&ring->nodes[0], self, 1);
+    ring->nNodes = 1;
+
+    char *list = strdup(siblings), *save = NULL;
+    assert(list);
+    for (char *name = strtok_r(list, ",", &save); name;
+         name = strtok_r(NULL, ",", &save)) {
+        int listed = 0;
+        for (int i = 0; i < ring->nNodes; i++) {
+            listed |= strcmp(ring->nodes[i].name, name) == 0;
+        }
+        if (listed) {
+            continue;
+        }
+        if (ring->nNodes == MAX_PEERS) {
+            fprintf(stderr, "Error: at most %d peers\n", MAX_PEERS);
+            exit(EXIT_FAILURE);
+        }
+        set_peer_node(&ring->nodes[ring->nNodes++], name, 0);
+    }
+    free(list);
+    ring->self = &ring->nodes[0];
+
+    ring->nPoints = ring->nNodes * PEER_VNODES;
+    ring->points = malloc(ring->nPoints * sizeof(ringPoint_t));
+    assert(ring->points);
+    for (int i = 0; i < ring->nNodes; i++) {
+        for (int j = 0; j < PEER_VNODES; j++) {
+            ringPoint_t *point = &ring->points[i * PEER_VNODES + j];
+            point->hash = hash_point(ring->nodes[i].name, j);
+            point->node = i;
+        }
+    }
+    qsort(ring->points, ring->nPoints, sizeof(ringPoint_t), compare_points);
+    return ring;
+}
+
+// the member to fetch a key's miss from, NULL if this node owns the key or
+// its owner is being passed over
+peerNode_t *peer_owner(peerRing_t *ring, unsigned long keyHash) {
+    // the first point at or after the key's, wrapping round to the first
+    unsigned long hash = mix_hash(keyHash);
+    int low = 0, high = ring->nPoints;
+    while (low < high) {
+        int middle = low + (high - low) / 2;
+        if (ring->points[middle].hash < hash) {
+            low = middle + 1;
+        } else {
+            high = middle;
+        }
+    }
+    peerNode_t *owner = &ring->nodes[ring->points[low % ring->nPoints].node];
+    if (owner->isSelf || atomic_load(&owner->downUntil) > cache_clock()) {
+        return NULL;
+    }
+    return owner;
+}
+
+// pass a member over for PEER_RETRY seconds after a forward to it failed
+void peer_failed(peerNode_t *peer) {
+    atomic_fetch_add(&peer->failures, 1);
+    atomic_store(&peer->downUntil, cache_clock() + PEER_RETRY);
+    log_line("Peer %s failed, going to origins for its keys for %ds\n",
+             peer->name, PEER_RETRY);
+}
+
+/*****************************************************************************/
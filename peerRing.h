@@ -0,0 +1,59 @@
+#ifndef PEERRING
+#define PEERRING
+
+#include <stdatomic.h>
+#include <time.h>
+
+// points each member is placed at on the ring
+#define PEER_VNODES 160
+// seconds a member that failed is passed over, its keys fetched from the
+// origin instead
+#define PEER_RETRY 10
+// marks a request one member forwarded to another in the Via line it adds,
+// so the owner fetches it itself rather than forwarding it again
+#define PEER_VIA_TOKEN "(htproxy)"
+
+// one member of the cluster, this node among them
+typedef struct peerNode peerNode_t;
+struct peerNode {
+    // host:port as every member lists it, and its two halves
+    char *name;
+    char *host;
+    char *port;
+    int isSelf;
+    // cache_clock() time until which the member is passed over
+    _Atomic time_t downUntil;
+    // misses forwarded to it, and forwards that failed
+    atomic_ulong fetches;
+    atomic_ulong failures;
+};
+
+// where a member sits on the ring
+typedef struct ringPoint ringPoint_t;
+struct ringPoint {
+    unsigned long hash;
+    int node;
+};
+
+// consistent-hash ring over the members, in hash order; read-only once
+// built, so shared by every worker without a lock
+typedef struct peerRing peerRing_t;
+struct peerRing {
+    peerNode_t *nodes;
+    int nNodes;
+    peerNode_t *self;
+    ringPoint_t *points;
+    int nPoints;
+};
+
+// build the ring of self and the comma-separated host:port siblings (which
+// may list self too, so every member can be given the same list); exits on
+// a malformed list
+peerRing_t *create_peer_ring(const char *self, const char *siblings);
+// the member to fetch a key's miss from, NULL if this node owns the key or
+// its owner is being passed over
+peerNode_t *peer_owner(peerRing_t *ring, unsigned long keyHash);
+// pass a member over for PEER_RETRY seconds after a forward to it failed
+void peer_failed(peerNode_t *peer);
+
+#endif
@@ -0,0 +1,385 @@
+/*
+Offline trace replay. A request log is streamed through the cache code the
+proxy runs on, one cache per capacity and replacement policy asked for, to
+see how each would have done without serving any traffic. Lines are either
+the proxy's own, logged with -T, or Common/Combined Log Format access log
+lines, which say nothing of freshness and are replayed as cacheable for
+ever. The cache clock follows the trace's timestamps, so max-age, the stale
+windows and the timer wheel behave as they did, however fast the trace is
+read. Bodies are accounted for at their size but never allocated.
+*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "freshness.h"
+#include "metrics.h"
+#include "replay.h"
+#include "sockets.h"
+
+#define TRACE_PREFIX "Trace "
+#define FIELD_BLANKS " \t\r\n"
+// what an access log line does not say about its request
+#define ACCESS_LOG_HOST "-"
+#define ACCESS_LOG_PORT "80"
+#define ACCESS_LOG_TIME "%d/%b/%Y:%H:%M:%S %z"
+
+// one request of a trace, pointing into the line it was read from
+typedef struct traceRequest traceRequest_t;
+struct traceRequest {
+    time_t time;
+    char *host;
+    char *port;
+    char *path;
+    int isGet;
+    int statusCode;
+    long bytes;
+    char *cacheControl;
+};
+
+// one cache the trace is replayed through, and what it served
+typedef struct replayRun replayRun_t;
+struct replayRun {
+    cache_t *cache;
+    size_t capacity;
+    const cachePolicy_t *policy;
+    unsigned long hits;
+    unsigned long hitBytes;
+    long ns;
+};
+
+/*****************************************************************************/
+// the next blank-separated field from *cursor, terminated in place; NULL if
+// the line has no more
+static char *next_field(char **cursor) {
+    char *field = *cursor + strspn(*cursor, FIELD_BLANKS);
+    if (*field == '\0') {
+        return NULL;
+    }
+    char *end = field + strcspn(field, FIELD_BLANKS);
+    *cursor = end + (*end != '\0');
+    *end = '\0';
+    return field;
+}
+
+// split "host:port" in place at its last colon
+static int split_authority(char *authority, traceRequest_t *request) {
+    char *colon = strrchr(authority, ':');
+    if (!colon || colon == authority || colon[1] == '\0') {
+        return 0;
+    }
+    *colon = '\0';
+    request->host = authority;
+    request->port = colon + 1;
+    return 1;
+}
+
+// "Trace <time> <host>:<port> <path> <status> <bytes> <freshness>", as the
+// proxy logs with -T
+static int parse_proxy_trace(char *line, traceRequest_t *request) {
+    if (strncmp(line, TRACE_PREFIX, strlen(TRACE_PREFIX)) != 0) {
+        return 0;
+    }
+    char *cursor = line + strlen(TRACE_PREFIX);
+    char *seconds = next_field(&cursor), *authority = next_field(&cursor);
+    char *path = next_field(&cursor), *status = next_field(&cursor);
+    char *bytes = next_field(&cursor), *freshness = next_field(&cursor);
+    if (!freshness || !split_authority(authority, request)) {
+        return 0;
+    }
+    request->time = strtol(seconds, NULL, 10);
+    request->path = path;
+    request->isGet = 1;
+    request->statusCode = atoi(status);
+    request->bytes = strtol(bytes, NULL, 10);
+    request->cacheControl = (strcmp(freshness, "-") == 0) ? NULL : freshness;
+    return 1;
+}
+
+// host ident user [date] "method target version" status bytes ..., the
+// Common Log Format and the Combined one that extends it. Absolute targets,
+// as a forward proxy logs them, name their host.
+static int parse_access_log(char *line, traceRequest_t *request) {
+    char *date = strchr(line, '[');
+    char *dateEnd = date ? strchr(date, ']') : NULL;
+    char *quote = dateEnd ? strchr(dateEnd, '"') : NULL;
+    char *endQuote = quote ? strchr(quote + 1, '"') : NULL;
+    if (!endQuote) {
+        return 0;
+    }
+    *dateEnd = *endQuote = '\0';
+    struct tm parsed = {0};
+    if (!strptime(date + 1, ACCESS_LOG_TIME, &parsed)) {
+        return 0;
+    }
+    request->time = timegm(&parsed) - parsed.tm_gmtoff;
+
+    char *cursor = quote + 1;
+    char *method = next_field(&cursor), *target = next_field(&cursor);
+    cursor = endQuote + 1;
+    char *status = next_field(&cursor), *bytes = next_field(&cursor);
+    if (!method || !target || !status) {
+        return 0;
+    }
+    request->host = ACCESS_LOG_HOST;
+    request->port = ACCESS_LOG_PORT;
+    request->path = target;
+    char *scheme = strstr(target, "://");
+    char *authority = scheme ? scheme + strlen("://") : NULL;
+    char *slash = authority ? strchr(authority, '/') : NULL;
+    if (slash) {
+        // the authority moves over the scheme, so it can end in place
+        // without cutting the slash off the path
+        int length = slash - authority;
+        memmove(target, authority, length);
+        target[length] = '\0';
+        request->host = target;
+        request->path = slash;
+        char *colon = strrchr(target, ':');
+        if (colon) {
+            *colon = '\0';
+            request->port = colon + 1;
+        }
+    }
+    request->isGet = strcmp(method, "GET") == 0;
+    request->statusCode = atoi(status);
+    request->bytes = (bytes && strcmp(bytes, "-") != 0)
+                         ? strtol(bytes, NULL, 10)
+                         : 0;
+    request->cacheControl = NULL;
+    return 1;
+}
+
+/*****************************************************************************/
+// the entry a response to request would be cached as, with its body only
+// accounted for, as a memfd body is
+static cacheEntry_t *traced_entry(traceRequest_t *request) {
+    cacheEntry_t *entry = create_cache_entry();
+    set_cache_key(entry, request->host, strlen(request->host), request->port,
+                  strlen(request->port), request->path, strlen(request->path));
+    entry->statusCode = request->statusCode;
+    if (request->cacheControl) {
+        validateCache(entry, request->cacheControl,
+                      strlen(request->cacheControl));
+    } else {
+        set_status_freshness(entry);
+    }
+    entry->hasContentLength = 1;
+    entry->responseContentLength = request->bytes;
+    entry->bodyLength = entry->responseTotalBytes = request->bytes;
+    entry->cachedTime = cache_clock();
+    return entry;
+}
+
+// answer request from one run's cache as the proxy would: a fresh entry,
+// or a stale one within its stale-while-revalidate window, is a hit; a
+// miss (or the refresh after a stale hit) caches the response if it may be
+// cached
+static void replay_request(replayRun_t *run, traceRequest_t *request,
+                           cacheEntry_t *probe, int cacheable) {
+    cache_t *cache = run->cache;
+    int inCache = 0;
+    // only a GET is looked up
+    if (!request->isGet) {
+        return;
+    }
+    cacheEntry_t *stale = check_stale_cache(cache, probe);
+    if (!stale) {
+        perform_policy(cache, probe, NULL, &inCache);
+        if (inCache) {
+            run->hits++;
+            run->hitBytes += request->bytes;
+            return;
+        }
+    } else if (cache_clock() - stale->cachedTime <
+               (time_t)stale->maxAge + stale->staleWhileRevalidate) {
+        run->hits++;
+        run->hitBytes += request->bytes;
+    }
+    if (!cacheable) {
+        if (stale) {
+            perform_policy(cache, probe, stale, &inCache);
+        }
+        return;
+    }
+    cacheEntry_t *existing = lookup_cache(cache, probe);
+    if (existing) {
+        remove_cache_entry(cache, existing);
+        release_cache_entry(existing);
+    }
+    cacheEntry_t *entry = traced_entry(request);
+    if (!enqueue_cache(cache, entry)) {
+        release_cache_entry(entry);
+    }
+}
+
+/*****************************************************************************/
+// the runs for every capacity and policy in the comma-separated lists,
+// defaulting to -m spread over powers of two and to -P; exits on a bad
+// list
+static int plan_runs(proxyOptions_t *options, replayRun_t *runs) {
+    size_t capacities[MAX_REPLAY_RUNS];
+    int nCapacities = 0;
+    if (options->replayCapacities) {
+        char *list = strdup(options->replayCapacities), *save = NULL;
+        for (char *size = strtok_r(list, ",", &save); size;
+             size = strtok_r(NULL, ",", &save)) {
+            if (nCapacities == MAX_REPLAY_RUNS ||
+                (capacities[nCapacities++] = parse_byte_size(size)) == 0) {
+                fprintf(stderr, "Error: --capacities must look like "
+                                "256K,1M,4M\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(list);
+    } else {
+        for (int factor = REPLAY_CAPACITY_SPREAD; factor > 1; factor /= 2) {
+            capacities[nCapacities++] = options->capacity / factor;
+        }
+        for (int factor = 1; factor <= REPLAY_CAPACITY_SPREAD; factor *= 2) {
+            capacities[nCapacities++] = options->capacity * factor;
+        }
+    }
+
+    const cachePolicy_t *policies[MAX_REPLAY_RUNS];
+    int nPolicies = 0;
+    if (options->replayPolicies) {
+        char *list = strdup(options->replayPolicies), *save = NULL;
+        for (char *name = strtok_r(list, ",", &save); name;
+             name = strtok_r(NULL, ",", &save)) {
+            if (nPolicies == MAX_REPLAY_RUNS ||
+                !(policies[nPolicies++] = find_cache_policy(name))) {
+                fprintf(stderr, "Error: --policies must name lru or s3fifo\n");
+                exit(EXIT_FAILURE);
+            }
+        }
+        free(list);
+    } else {
+        policies[nPolicies++] = options->policy;
+    }
+
+    if (nCapacities * nPolicies > MAX_REPLAY_RUNS) {
+        fprintf(stderr, "Error: at most %d capacities and policies together\n",
+                MAX_REPLAY_RUNS);
+        exit(EXIT_FAILURE);
+    }
+    int nRuns = 0;
+    for (int i = 0; i < nPolicies; i++) {
+        for (int j = 0; j < nCapacities; j++) {
+            runs[nRuns++] = (replayRun_t){.capacity = capacities[j],
+                                          .policy = policies[i]};
+        }
+    }
+    return nRuns;
+}
+
+// a byte count the way -m takes it, such as 512M
+static void format_size(size_t size, char *text, int length) {
+    const char *units = "BKMG";
+    int unit = 0;
+    while (unit < 3 && size >= 1024 && size % 1024 == 0) {
+        size /= 1024;
+        unit++;
+    }
+    snprintf(text, length, "%zu%c", size, units[unit]);
+}
+
+// print what every run served, one line each
+static void report_replay(replayRun_t *runs, int nRuns, unsigned long requests,
+                          unsigned long bytes, unsigned long skipped,
+                          time_t first, time_t last) {
+    printf("Replayed %lu requests (%lu bytes) over %ld seconds of trace, "
+           "%lu lines skipped\n",
+           requests, bytes, (long)(last - first), skipped);
+    printf("%-8s %10s %10s %10s %10s %12s %12s\n", "policy", "capacity",
+           "hit ratio", "byte hits", "evictions", "expirations", "ops/s");
+    for (int i = 0; i < nRuns; i++) {
+        replayRun_t *run = &runs[i];
+        char capacity[32];
+        format_size(run->capacity, capacity, sizeof(capacity));
+        printf("%-8s %10s %9.2f%% %9.2f%% %10lu %12lu %12.0f\n",
+               run->policy->name, capacity,
+               requests ? 100.0 * run->hits / requests : 0.0,
+               bytes ? 100.0 * run->hitBytes / bytes : 0.0,
+               run->cache ? run->cache->evictions : 0,
+               run->cache ? run->cache->expirations : 0,
+               run->ns ? requests * 1e9 / run->ns : 0.0);
+    }
+}
+
+/*****************************************************************************/
+// feed the trace at options->replayPath (or stdin for "-") through one
+// cache per capacity and policy asked for, on the trace's own clock, and
+// print the hit ratio, byte hit ratio, evictions and speed of each; returns
+// the exit status
+int run_replay(proxyOptions_t *options) {
+    replayRun_t runs[MAX_REPLAY_RUNS];
+    int nRuns = plan_runs(options, runs);
+    FILE *trace = (strcmp(options->replayPath, "-") == 0)
+                      ? stdin
+                      : fopen(options->replayPath, "r");
+    if (!trace) {
+        perror("fopen");
+        return EXIT_FAILURE;
+    }
+
+    unsigned long requests = 0, bytes = 0, skipped = 0;
+    time_t first = 0, now = 0;
+    char *line = NULL;
+    size_t size = 0;
+    while (getline(&line, &size, trace) > 0) {
+        traceRequest_t request;
+        if (!parse_proxy_trace(line, &request) &&
+            !parse_access_log(line, &request)) {
+            skipped++;
+            continue;
+        }
+        // the clock never goes back, for lines logged slightly out of order
+        if (requests == 0) {
+            first = now = request.time;
+            set_cache_clock(now);
+            for (int i = 0; i < nRuns; i++) {
+                runs[i].cache = create_cache(runs[i].capacity, runs[i].policy);
+            }
+        } else if (request.time > now) {
+            now = request.time;
+            set_cache_clock(now);
+            for (int i = 0; i < nRuns; i++) {
+                long start = now_ns();
+                while (expire_cache(runs[i].cache, now)) {
+                }
+                runs[i].ns += now_ns() - start;
+            }
+        }
+        requests++;
+        bytes += request.bytes;
+
+        cacheEntry_t *probe = traced_entry(&request);
+        int cacheable = request.isGet && probe->isCachable &&
+                        request.statusCode != 206 &&
+                        request.bytes <= (long)options->objectLimit;
+        for (int i = 0; i < nRuns; i++) {
+            long start = now_ns();
+            replay_request(&runs[i], &request, probe, cacheable);
+            runs[i].ns += now_ns() - start;
+        }
+        release_cache_entry(probe);
+    }
+    free(line);
+    if (trace != stdin) {
+        fclose(trace);
+    }
+
+    report_replay(runs, nRuns, requests, bytes, skipped, first, now);
+    for (int i = 0; i < nRuns; i++) {
+        if (runs[i].cache) {
+            free_cache(runs[i].cache);
+        }
+    }
+    return EXIT_SUCCESS;
+}
+
+/*****************************************************************************/
@@ -0,0 +1,18 @@
+#ifndef REPLAY
+#define REPLAY
+
+#include "eventLoop.h"
+
+// most capacity and policy combinations replayed in one pass
+#define MAX_REPLAY_RUNS 32
+// capacities tried by default, as -m divided and multiplied by powers of
+// two up to this factor
+#define REPLAY_CAPACITY_SPREAD 4
+
+// feed the trace at options->replayPath (or stdin for "-") through one
+// cache per capacity and policy asked for, on the trace's own clock, and
+// print the hit ratio, byte hit ratio, evictions and speed of each; returns
+// the exit status
+int run_replay(proxyOptions_t *options);
+
+#endif
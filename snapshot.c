@@ -0,0 +1,392 @@
+/*
+On-disk snapshot of the cache for warm restarts. A snapshot is a header
+(magic, version, entry count, payload size and an FNV-1a checksum of the
+payload) followed by one record per entry, in queue order, each
+holding the entry's host, port, path, freshness and response bytes. It is
+written to a temporary file that is renamed over the old snapshot, and read
+back through mmap; a snapshot whose header or checksum does not match is
+skipped whole rather than half-loaded. The same records, packed one at a
+time, are what the disk tier stores.
+*/
+
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logger.h"
+#include "memPool.h"
+#include "snapshot.h"
+#include "sockets.h"
+
+#define SNAPSHOT_MAGIC "HTPXSNAP"
+#define SNAPSHOT_COPY 65536
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+typedef struct snapshotHeader snapshotHeader_t;
+struct snapshotHeader {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t payloadBytes;
+    uint64_t checksum;
+};
+
+// fixed part of one entry, followed by host, port, path and response bytes
+typedef struct snapshotRecord snapshotRecord_t;
+struct snapshotRecord {
+    int64_t cachedTime;
+    uint64_t responseLength;
+    int64_t contentLength;
+    uint32_t maxAge;
+    uint32_t staleWhileRevalidate;
+    uint32_t staleIfError;
+    uint32_t hostLength;
+    uint32_t portLength;
+    uint32_t pathLength;
+    int32_t statusCode;
+    int32_t headerLength;
+    uint8_t isStalable;
+    uint8_t hasContentLength;
+    uint8_t isChunked;
+    uint8_t keepAlive;
+};
+
+// buffered output that checksums the payload as it goes
+typedef struct snapshotWriter snapshotWriter_t;
+struct snapshotWriter {
+    FILE *file;
+    uint64_t checksum;
+    uint64_t bytes;
+    int failed;
+};
+
+/*****************************************************************************/
+// FNV-1a over more bytes, continuing from hash
+static uint64_t checksum_bytes(uint64_t hash, const void *data, size_t length) {
+    const unsigned char *bytes = data;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= bytes[i];
+        hash *= FNV_PRIME;
+    }
+    return hash;
+}
+
+static void write_bytes(snapshotWriter_t *writer, const void *data,
+                        size_t length) {
+    if (writer->failed || length == 0) {
+        return;
+    }
+    if (fwrite(data, 1, length, writer->file) != length) {
+        writer->failed = 1;
+        return;
+    }
+    writer->checksum = checksum_bytes(writer->checksum, data, length);
+    writer->bytes += length;
+}
+
+// write an entry's response in storage order: first block, segments, then
+// a memfd body
+static void write_response(snapshotWriter_t *writer, cacheEntry_t *entry) {
+    long firstLength =
+        entry->responseTotalBytes - entry->bodyLength - entry->segmentBytes;
+    write_bytes(writer, entry->response, firstLength);
+    for (responseSegment_t *segment = entry->segments; segment;
+         segment = segment->next) {
+        write_bytes(writer, segment->data, segment->length);
+    }
+    char copy[SNAPSHOT_COPY];
+    for (off_t offset = 0; offset < entry->bodyLength;) {
+        size_t want = entry->bodyLength - offset;
+        want = (want < sizeof(copy)) ? want : sizeof(copy);
+        ssize_t got = pread(entry->bodyFd, copy, want, offset);
+        if (got <= 0) {
+            writer->failed = 1;
+            return;
+        }
+        write_bytes(writer, copy, got);
+        offset += got;
+    }
+}
+
+static void write_entry(snapshotWriter_t *writer, cacheEntry_t *entry) {
+    snapshotRecord_t record = {
+        .cachedTime = entry->cachedTime,
+        .responseLength = entry->responseTotalBytes,
+        .maxAge = entry->maxAge,
+        .staleWhileRevalidate = entry->staleWhileRevalidate,
+        .staleIfError = entry->staleIfError,
+        .hostLength = strlen(entry->host),
+        .portLength = strlen(entry->targetPort),
+        .pathLength = strlen(entry->path),
+        .statusCode = entry->statusCode,
+        .contentLength = entry->responseContentLength,
+        .headerLength = entry->responseHeaderLength,
+        .isStalable = entry->isStalable,
+        .hasContentLength = entry->hasContentLength,
+        .isChunked = entry->isChunked,
+        .keepAlive = entry->responseKeepAlive};
+    write_bytes(writer, &record, sizeof(record));
+    write_bytes(writer, entry->host, record.hostLength);
+    write_bytes(writer, entry->targetPort, record.portLength);
+    write_bytes(writer, entry->path, record.pathLength);
+    write_response(writer, entry);
+}
+
+// hold every cached entry in queue order (oldest first, the small queue
+// before the main one), so they can be written without keeping the shards
+// locked
+static cacheEntry_t **hold_all_entries(shardedCache_t *cache, int *count) {
+    cacheEntry_t **entries = NULL;
+    int capacity = 0;
+    *count = 0;
+    for (unsigned long i = 0; i < cache->nShards; i++) {
+        cache_t *shard = cache->shards[i];
+        pthread_mutex_lock(&shard->lock);
+        if (*count + shard->count > capacity) {
+            capacity = *count + shard->count;
+            entries = realloc(entries, capacity * sizeof(cacheEntry_t *));
+            assert(entries);
+        }
+        for (int queue = 0; queue < NUM_QUEUES; queue++) {
+            for (cacheEntry_t *entry = shard->queues[queue].head; entry;
+                 entry = entry->next) {
+                hold_cache_entry(entry);
+                entries[(*count)++] = entry;
+            }
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    return entries;
+}
+
+/*****************************************************************************/
+// write every cached entry, in queue order, to path
+int save_snapshot(shardedCache_t *cache, const char *path) {
+    char tempPath[4096];
+    snprintf(tempPath, sizeof(tempPath), "%s.tmp", path);
+    int count = 0;
+    cacheEntry_t **entries = hold_all_entries(cache, &count);
+
+    snapshotWriter_t writer = {.file = fopen(tempPath, "wb"),
+                               .checksum = FNV_OFFSET};
+    snapshotHeader_t header = {.version = SNAPSHOT_VERSION, .count = count};
+    memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic));
+    if (!writer.file ||
+        fwrite(&header, sizeof(header), 1, writer.file) != 1) {
+        writer.failed = 1;
+    }
+    for (int i = 0; i < count; i++) {
+        write_entry(&writer, entries[i]);
+        release_cache_entry(entries[i]);
+    }
+    free(entries);
+
+    // the header is completed last, so a torn write never looks valid
+    header.payloadBytes = writer.bytes;
+    header.checksum = writer.checksum;
+    if (writer.file && !writer.failed &&
+        (fseek(writer.file, 0, SEEK_SET) != 0 ||
+         fwrite(&header, sizeof(header), 1, writer.file) != 1 ||
+         fflush(writer.file) != 0 || fsync(fileno(writer.file)) != 0)) {
+        writer.failed = 1;
+    }
+    if (writer.file && fclose(writer.file) != 0) {
+        writer.failed = 1;
+    }
+    if (writer.failed || rename(tempPath, path) != 0) {
+        perror("Error: Cannot write cache snapshot");
+        unlink(tempPath);
+        return -1;
+    }
+    log_line("Snapshot: saved %d entries to %s\n", count, path);
+    return count;
+}
+
+// rebuild one entry from its record, copying the response into a first
+// block and segments like a relayed response
+static cacheEntry_t *read_entry(const snapshotRecord_t *record,
+                                const char *strings) {
+    const char *host = strings;
+    const char *port = host + record->hostLength;
+    const char *path = port + record->portLength;
+    const char *response = path + record->pathLength;
+
+    cacheEntry_t *entry = create_cache_entry();
+    set_cache_key(entry, host, record->hostLength, port, record->portLength,
+                  path, record->pathLength);
+    long length = record->responseLength;
+    long firstLength =
+        (length < MAX_RESPONSE_BUFFER) ? length : MAX_RESPONSE_BUFFER;
+    entry->response = pool_alloc(firstLength);
+    entry->blockLength = firstLength;
+    memcpy(entry->response, response, firstLength);
+    for (long offset = firstLength; offset < length;) {
+        responseSegment_t *segment = writable_segment(entry);
+        long take = length - offset;
+        take = (take < SEGMENT_DATA) ? take : SEGMENT_DATA;
+        memcpy(segment->data, response + offset, take);
+        segment->length = take;
+        entry->segmentBytes += take;
+        offset += take;
+    }
+    // validators are offsets into the header, found again by parsing it;
+    // the record's own fields then take precedence
+    httpParser_t parser;
+    reset_http_parser(&parser);
+    if (feed_http_parser(&parser, entry->response, firstLength) > 0) {
+        extract_headers(entry, &parser, 0);
+    }
+    entry->responseTotalBytes = length;
+    entry->cachedTime = record->cachedTime;
+    entry->maxAge = record->maxAge;
+    entry->staleWhileRevalidate = record->staleWhileRevalidate;
+    entry->staleIfError = record->staleIfError;
+    entry->isStalable = record->isStalable;
+    entry->statusCode = record->statusCode;
+    entry->responseContentLength = record->contentLength;
+    entry->responseHeaderLength = record->headerLength;
+    entry->hasContentLength = record->hasContentLength;
+    entry->isChunked = record->isChunked;
+    entry->responseKeepAlive = record->keepAlive;
+    return entry;
+}
+
+// true if every record fits inside the payload
+static int records_fit(const char *payload, uint64_t payloadBytes,
+                       uint32_t count) {
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < count; i++) {
+        snapshotRecord_t record;
+        if (payloadBytes - offset < sizeof(record)) {
+            return 0;
+        }
+        memcpy(&record, payload + offset, sizeof(record));
+        offset += sizeof(record);
+        uint64_t variable = (uint64_t)record.hostLength + record.portLength +
+                            record.pathLength + record.responseLength;
+        if (record.pathLength == 0 || record.responseLength > INT32_MAX ||
+            payloadBytes - offset < variable) {
+            return 0;
+        }
+        offset += variable;
+    }
+    return offset == payloadBytes;
+}
+
+// fill the cache from a snapshot at path
+int load_snapshot(shardedCache_t *cache, const char *path) {
+    int fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat info;
+    snapshotHeader_t header;
+    if (fstat(fd, &info) < 0 || (size_t)info.st_size < sizeof(header)) {
+        close(fd);
+        fprintf(stderr, "Snapshot %s is truncated, skipping it\n", path);
+        return -1;
+    }
+    char *mapped = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) {
+        perror("Error: Cannot map cache snapshot");
+        return -1;
+    }
+    madvise(mapped, info.st_size, MADV_SEQUENTIAL);
+
+    memcpy(&header, mapped, sizeof(header));
+    const char *payload = mapped + sizeof(header);
+    if (memcmp(header.magic, SNAPSHOT_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SNAPSHOT_VERSION) {
+        fprintf(stderr, "Snapshot %s is not a version %d snapshot, skipping it\n",
+                path, SNAPSHOT_VERSION);
+        munmap(mapped, info.st_size);
+        return -1;
+    }
+    if (header.payloadBytes != info.st_size - sizeof(header) ||
+        checksum_bytes(FNV_OFFSET, payload, header.payloadBytes) !=
+            header.checksum ||
+        !records_fit(payload, header.payloadBytes, header.count)) {
+        fprintf(stderr, "Snapshot %s is corrupt, skipping it\n", path);
+        munmap(mapped, info.st_size);
+        return -1;
+    }
+
+    // entries the timer wheel would have reclaimed while the proxy was down
+    // are not loaded; stale ones still inside their stale windows, or kept
+    // to be revalidated, are
+    time_t now = time(NULL);
+    int loaded = 0;
+    uint64_t offset = 0;
+    for (uint32_t i = 0; i < header.count; i++) {
+        snapshotRecord_t record;
+        memcpy(&record, payload + offset, sizeof(record));
+        offset += sizeof(record);
+        const char *strings = payload + offset;
+        offset += (uint64_t)record.hostLength + record.portLength +
+                  record.pathLength + record.responseLength;
+        cacheEntry_t *entry = read_entry(&record, strings);
+        if (entry->isStalable && now >= reclaim_time(entry)) {
+            release_cache_entry(entry);
+            continue;
+        }
+        cache_t *shard = cache_shard(cache, entry);
+        pthread_mutex_lock(&shard->lock);
+        cacheEntry_t *existing = lookup_cache(shard, entry);
+        if (existing) {
+            remove_cache_entry(shard, existing);
+            release_cache_entry(existing);
+        }
+        if (enqueue_cache(shard, entry)) {
+            loaded++;
+        } else {
+            release_cache_entry(entry);
+        }
+        pthread_mutex_unlock(&shard->lock);
+    }
+    munmap(mapped, info.st_size);
+    log_line("Snapshot: loaded %d entries from %s\n", loaded, path);
+    return loaded;
+}
+
+// one entry as a snapshot record in a malloced buffer of *length bytes,
+// with the record's checksum; NULL if it could not be written
+char *pack_entry(cacheEntry_t *entry, size_t *length, uint64_t *checksum) {
+    char *record = NULL;
+    snapshotWriter_t writer = {.file = open_memstream(&record, length),
+                               .checksum = FNV_OFFSET};
+    if (!writer.file) {
+        return NULL;
+    }
+    write_entry(&writer, entry);
+    if (fclose(writer.file) != 0 || writer.failed) {
+        free(record);
+        return NULL;
+    }
+    *checksum = writer.checksum;
+    return record;
+}
+
+// rebuild an entry from a record made by pack_entry(), NULL if the bytes
+// are not exactly one record with that checksum
+cacheEntry_t *unpack_entry(const char *record, size_t length,
+                           uint64_t checksum) {
+    if (checksum_bytes(FNV_OFFSET, record, length) != checksum ||
+        !records_fit(record, length, 1)) {
+        return NULL;
+    }
+    snapshotRecord_t fixed;
+    memcpy(&fixed, record, sizeof(fixed));
+    return read_entry(&fixed, record + sizeof(fixed));
+}
+
+/*****************************************************************************/
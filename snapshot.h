@@ -0,0 +1,26 @@
+#ifndef SNAPSHOT
+#define SNAPSHOT
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "dataStruct.h"
+
+#define DEFAULT_SNAPSHOT_INTERVAL 300
+#define SNAPSHOT_VERSION 3
+
+// write every cached entry, in queue order, to path; returns the
+// number of entries written or -1 if the snapshot could not be written
+int save_snapshot(shardedCache_t *cache, const char *path);
+// fill the cache from a snapshot at path, skipping it whole if it is
+// missing, corrupt or from another version; returns entries loaded or -1
+int load_snapshot(shardedCache_t *cache, const char *path);
+// one entry as a snapshot record in a malloced buffer of *length bytes,
+// with the record's checksum; NULL if it could not be written
+char *pack_entry(cacheEntry_t *entry, size_t *length, uint64_t *checksum);
+// rebuild an entry from a record made by pack_entry(), NULL if the bytes
+// are not exactly one record with that checksum
+cacheEntry_t *unpack_entry(const char *record, size_t length,
+                           uint64_t checksum);
+
+#endif
@@ -9,8 +9,6 @@ obtained from various online sources such as:
 - Adapting memmem() from <stddef.h> to check if a substring exists in longer
     string https://www.capitalware.com/rl_blog/?p=5847
 - memcpy from https://www.geeksforgeeks.org/memcpy-in-cc/
-- strtok from
-https://www.geeksforgeeks.org/strtok-strtok_r-functions-c-examples/
 - strncasecmp from
 https://www.ibm.com/docs/en/zos/2.4.0?topic=functions-strncasecmp-case-insensitive-string-comparison
 */
@@ -18,9 +16,11 @@ https://www.ibm.com/docs/en/zos/2.4.0?topic=functions-strncasecmp-case-insensiti
 /**********************************************************************/
 
 #define _POSIX_C_SOURCE 200112L
+#define _DEFAULT_SOURCE
 #include <arpa/inet.h>
 #include <assert.h>
-#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
 #include <netdb.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -28,45 +28,50 @@ https://www.ibm.com/docs/en/zos/2.4.0?topic=functions-strncasecmp-case-insensiti
 #include <strings.h>
 #include <unistd.h>
 
+#include "compression.h"
+#include "freshness.h"
+#include "logger.h"
+#include "memPool.h"
 #include "sockets.h"
 
-#define BACKLOG 10
-#define MAX_BYTE 102400
-#define BUFFER_SIZE 4096
-#define MAX_REQUEST_LENGTH 2000
-#define MALFORMED 10
+#define BACKLOG 128
+#define DEFAULT_HOST_PORT "80"
 
-#define MALFORMED_END "\n\n\n"
-#define EMPTY_LINE "\r\n\r\n"
-#define HEADER_END "\r\n"
 #define GET "GET"
-#define HOST "Host:"
-#define CONTENT "Content-Length:"
-#define CACHE "Cache-Control:"
+#define CONNECT "CONNECT "
+#define HOST "Host"
+#define CONTENT "Content-Length"
+#define CACHE "Cache-Control"
+#define CONNECTION "Connection"
+#define TRANSFER "Transfer-Encoding"
+#define ETAG "ETag"
+#define LAST_MODIFIED "Last-Modified"
+#define DATE "Date"
+#define EXPIRES "Expires"
+#define AGE "Age"
+#define ACCEPT_ENCODING "Accept-Encoding"
+#define CONTENT_ENCODING "Content-Encoding"
+#define HTTP_1_0 "HTTP/1.0"
 
 /**********************************************************************/
 
 // create a listening socket to all interfaces (including ipv4 and ipv6)
 // adapted from Workshop 8 (week 8) and
 // https://man7.org/linux/man-pages/man3/getaddrinfo.3.html
-// host == NULL for client and host != NULL for domain server
-int create_listening_socket(char *tcpPort, char *host) {
+// The socket is non-blocking so it can be driven by the event loop.
+int create_listening_socket(char *tcpPort) {
 
-    int listenfd = 0, enable = 1;
+    int listenfd = -1, enable = 1;
     struct addrinfo hints, *res, *ptr;
 
     // Create address we're going to listen on
     memset(&hints, 0, sizeof hints);
-    if (host == NULL) {
-        hints.ai_family = AF_INET6; // since VM disables IPV6_ONLY, Ed#909
-        hints.ai_flags = AI_PASSIVE;
-    } else {
-        hints.ai_family = AF_UNSPEC; // IPv4 or IPv6
-    }
+    hints.ai_family = AF_INET6; // since VM disables IPV6_ONLY, Ed#909
+    hints.ai_flags = AI_PASSIVE;
     hints.ai_socktype = SOCK_STREAM;
 
     // NULL means any interface, service (port)
-    if (getaddrinfo(host, tcpPort, &hints, &res) != 0) {
+    if (getaddrinfo(NULL, tcpPort, &hints, &res) != 0) {
         perror("Error: Cannot get address of server\n");
         exit(EXIT_FAILURE);
     }
@@ -78,230 +83,347 @@ int create_listening_socket(char *tcpPort, char *host) {
             continue;
         }
 
-        // listening socket to client
-        if (host == NULL) {
-            // Reuse port if possible and try to bind address to socket
-            if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &enable,
-                           sizeof(int)) < 0 ||
-                bind(listenfd, ptr->ai_addr, ptr->ai_addrlen) < 0) {
-                close(listenfd);
-                continue;
-            }
-        } else if (connect(listenfd, ptr->ai_addr, ptr->ai_addrlen) < 0) {
-            // listening socket to host origin
+        // Reuse port if possible and try to bind address to socket.
+        // SO_REUSEPORT lets every worker bind its own socket to the
+        // same port and have the kernel balance clients between them.
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &enable,
+                       sizeof(int)) < 0 ||
+            setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &enable,
+                       sizeof(int)) < 0 ||
+            bind(listenfd, ptr->ai_addr, ptr->ai_addrlen) < 0) {
             close(listenfd);
             continue;
         }
-
         break;
     }
     freeaddrinfo(res);
+    if (ptr == NULL) {
+        perror("Error: Cannot bind to any address\n");
+        exit(EXIT_FAILURE);
+    }
 
     // accepting client connections
-    if (host == NULL && listen(listenfd, BACKLOG) < 0) {
+    if (listen(listenfd, BACKLOG) < 0) {
         perror("Error: Failed to listen for any connection\n");
         close(listenfd);
         exit(EXIT_FAILURE);
     }
-
+    set_nonblocking(listenfd);
     return listenfd;
 }
 
-// read client's request or read host's response then send back to client
-// forwardRequest = 1 means sending to host server instead of client
-// isHeader = 1 means it is reading header instead of body
-void read_message(cacheEntry_t *cacheEntry, int serverfd, int *cacheable,
-                  int forwardRequest, int clientfd, int isHeader) {
+// start a non-blocking connection to the first usable resolved address of
+// an origin; the connection may still be in progress when this returns
+int connect_to_origin(dnsAddress_t *addresses, int count) {
+    for (int i = 0; i < count; i++) {
+        int originfd = socket(addresses[i].family, SOCK_STREAM, 0);
+        if (originfd < 0) {
+            continue;
+        }
+        set_nonblocking(originfd);
+        if (connect(originfd, (struct sockaddr *)&addresses[i].address,
+                    addresses[i].length) < 0 &&
+            errno != EINPROGRESS) {
+            close(originfd);
+            continue;
+        }
+        return originfd;
+    }
+    return -1;
+}
 
-    // initialise for different tasks: sending header or body, to host or client
-    char *line =
-        (forwardRequest == 1) ? cacheEntry->request : cacheEntry->response;
-    char buffer[BUFFER_SIZE];
-    int totalBytes = 0, bytesRead, remainingBytes = 1;
-    // if reading body of host's response
-    if (isHeader == 0) {
-        remainingBytes = cacheEntry->responseContentLength -
-                         cacheEntry->responseTotalBytes +
-                         cacheEntry->responseHeaderLength;
-        totalBytes = cacheEntry->responseTotalBytes;
+// make a socket non-blocking
+void set_nonblocking(int fd) {
+    int flags = fcntl(fd, F_GETFL, 0);
+    if (flags < 0 || fcntl(fd, F_SETFL, flags | O_NONBLOCK) < 0) {
+        perror("Error: Cannot make socket non-blocking\n");
+        exit(EXIT_FAILURE);
     }
+}
 
-    // Read messages and store them in cache entry. Adapted from
-    // https://gamedev.net/forums/topic/651197-calling-recv-in-a-loop/
-    while (remainingBytes > 0) {
-        bytesRead = recv(serverfd, buffer, BUFFER_SIZE, 0);
-        // errors while reading
-        if (bytesRead <= 0 || (forwardRequest == 0 &&
-                               (send(clientfd, buffer, bytesRead, 0) < 0))) {
-            break;
+// extract headers in both request and response from the spans the parser
+// recorded, without copying or modifying the message
+void extract_headers(cacheEntry_t *cacheEntry, httpParser_t *parser,
+                     int isRequest) {
+    const char *document =
+        isRequest ? cacheEntry->request : cacheEntry->response;
+    if (!document || !parser->headerEnd) {
+        return;
+    }
+
+    // HTTP/1.1 connections persist unless either side says otherwise
+    const char *startLine = document;
+    int startLength = parser->startLineLength;
+    int keepAlive =
+        startLength > 0 && http_find(startLine, startLength, HTTP_1_0) < 0;
+    if (!isRequest && startLength > 0) {
+        int space = http_find(startLine, startLength, " ");
+        if (space > -1) {
+            cacheEntry->statusCode = http_to_long(
+                startLine + space, startLength - space);
         }
-        // store messages in cache within max bytes
-        if (totalBytes + bytesRead <= MAX_BYTE) {
-            memcpy(line + totalBytes, buffer, bytesRead);
-        } else {
-            *cacheable = 0;
+    }
+
+    // extracting relevant data, host and path are kept as spans
+    const char *path = NULL, *host = "", *port = DEFAULT_HOST_PORT;
+    int pathLength = 0, hostLength = 0, portLength = strlen(port);
+    if (isRequest && startLength > (int)strlen(GET) &&
+        strncasecmp(startLine, GET, strlen(GET)) == 0) {
+        path = startLine + strlen(GET);
+        while (*path == ' ') {
+            path++;
         }
-        totalBytes += bytesRead;
-        // track the ending of either a header or a body
-        if (isHeader == 1) {
-            // handle malformed header
-            if (strstr(line, MALFORMED_END) && totalBytes < MALFORMED) {
-                cacheEntry->requestLength = totalBytes;
-                return;
+        int pathSpace = http_find(path, startLength - (path - startLine), " ");
+        pathLength = (pathSpace > -1) ? pathSpace
+                                      : startLength - (path - startLine);
+    }
+    freshness_t freshness;
+    reset_freshness(&freshness);
+    for (int i = 0; i < parser->nHeaders; i++) {
+        httpHeader_t *header = &parser->headers[i];
+        const char *value = document + header->value;
+        int length = header->valueLength;
+        if (http_header_is(document, header, HOST)) {
+            int colon = http_find(value, length, ":");
+            host = value;
+            hostLength = (colon > -1) ? colon : length;
+            if (colon > -1) {
+                port = value + colon + 1;
+                portLength = length - colon - 1;
             }
-            cacheEntry->responseHeaderLength =
-                my_memmem(line, totalBytes, EMPTY_LINE, strlen(EMPTY_LINE));
-            if (cacheEntry->responseHeaderLength > -1) {
-                break;
+        } else if (http_header_is(document, header, CONTENT)) {
+            long contentLength = http_to_long(value, length);
+            if (contentLength < 0) {
+                cacheEntry->badContentLength = 1;
+            } else {
+                cacheEntry->responseContentLength = contentLength;
+                cacheEntry->hasContentLength = 1;
             }
-        } else {
-            remainingBytes -= bytesRead;
+        } else if (http_header_is(document, header, CONNECTION)) {
+            if (http_find(value, length, "close") > -1) {
+                keepAlive = 0;
+            } else if (http_find(value, length, "keep-alive") > -1) {
+                keepAlive = 1;
+            }
+        } else if (http_header_is(document, header, TRANSFER)) {
+            cacheEntry->isChunked = http_find(value, length, "chunked") > -1;
+        } else if (http_header_is(document, header, CACHE)) {
+            parse_cache_control(&freshness, value, length);
+        } else if (!isRequest && http_header_is(document, header, ETAG)) {
+            cacheEntry->etag = header->value;
+            cacheEntry->etagLength = length;
+        } else if (!isRequest &&
+                   http_header_is(document, header, LAST_MODIFIED)) {
+            cacheEntry->lastModified = header->value;
+            cacheEntry->lastModifiedLength = length;
+            freshness.lastModified = parse_http_date(value, length);
+        } else if (!isRequest && http_header_is(document, header, DATE)) {
+            freshness.date = parse_http_date(value, length);
+        } else if (!isRequest && http_header_is(document, header, EXPIRES)) {
+            freshness.expires = parse_http_date(value, length);
+            freshness.hasExpires = 1;
+        } else if (!isRequest && http_header_is(document, header, AGE)) {
+            // an Age too large to hold is as old as an age can be
+            long age = http_to_long(value, length);
+            freshness.age = (age < 0) ? MAX_DELTA_SECONDS : age;
+        } else if (!isRequest &&
+                   http_header_is(document, header, CONTENT_ENCODING)) {
+            cacheEntry->isEncoded = http_find(value, length, "identity") < 0;
+            cacheEntry->isGzip = http_find(value, length, "gzip") > -1;
+        } else if (isRequest &&
+                   http_header_is(document, header, ACCEPT_ENCODING)) {
+            cacheEntry->acceptsGzip = accepts_gzip(value, length);
+        } else if (isRequest && http_header_is(document, header, RANGE)) {
+            cacheEntry->range = header->value;
+            cacheEntry->rangeLength = length;
+        } else if (isRequest && http_header_is(document, header, IF_RANGE)) {
+            cacheEntry->ifRange = header->value;
+            cacheEntry->ifRangeLength = length;
         }
     }
 
-    // extract header for request
-    if (forwardRequest == 1) {
-        cacheEntry->requestLength = totalBytes;
-        if (cacheEntry->requestLength >= MAX_REQUEST_LENGTH) {
-            *cacheable = 0;
-        }
-        extract_headers(cacheEntry, 1);
-        return;
-    }
-    // extract header for response and print out body length
-    cacheEntry->responseTotalBytes = totalBytes;
-    if (isHeader == 0) {
+    if (!isRequest) {
+        cacheEntry->responseKeepAlive = keepAlive;
+        set_freshness(cacheEntry, &freshness);
         return;
     }
-    extract_headers(cacheEntry, 0);
-    read_message(cacheEntry, serverfd, cacheable, 0, clientfd, 0);
-    printf("Response body length %d\n", cacheEntry->responseContentLength);
-    fflush(stdout);
-}
-
-// extract headers in both request and response
-void extract_headers(cacheEntry_t *cacheEntry, int isRequest) {
-
-    char headerLines[MAX_BYTE];
-    char *document = NULL;
-    int length = -1;
-    // create a copy of either a request or a response
-    if (isRequest == 1) {
-        document = cacheEntry->request;
-        length = cacheEntry->requestLength;
-    } else {
-        document = cacheEntry->response;
-        length = cacheEntry->responseHeaderLength;
+    // a client asking not to store the response, or not to be answered
+    // from the cache, keeps its response out of it
+    if (freshness.noStore || freshness.noCache || freshness.maxAge == 0) {
+        cacheEntry->isCachable = 0;
     }
-    memcpy(headerLines, document, length);
-    headerLines[length] = '\0';
-
-    // extracting relevant data
-    char *line = strtok(headerLines, HEADER_END);
-    char *lastLineptr = NULL;
-    while (line) {
-        lastLineptr = line;
-        if (strncasecmp(line, GET, strlen(GET)) == 0) {
-            sscanf(line + strlen(GET), " %s", cacheEntry->path);
+    // a CONNECT names the far end of its tunnel as host:port in place of a
+    // path, whatever its Host line says
+    if (startLength > (int)strlen(CONNECT) &&
+        strncasecmp(startLine, CONNECT, strlen(CONNECT)) == 0) {
+        const char *target = startLine + strlen(CONNECT);
+        while (*target == ' ') {
+            target++;
+        }
+        int rest = startLength - (target - startLine);
+        int space = http_find(target, rest, " ");
+        int targetLength = (space > -1) ? space : rest;
+        int colon = targetLength - 1;
+        while (colon > 0 && target[colon] != ':') {
+            colon--;
         }
-        if (strncasecmp(line, HOST, strlen(HOST)) == 0) {
-            sscanf(line + strlen(HOST), " %[^:]:%s", cacheEntry->host,
-                   cacheEntry->targetPort);
+        if (colon > 0 && colon < targetLength - 1) {
+            host = target;
+            hostLength = colon;
+            port = target + colon + 1;
+            portLength = targetLength - colon - 1;
+            // an IPv6 literal is bracketed only to set its port apart
+            if (hostLength > 2 && host[0] == '[' &&
+                host[hostLength - 1] == ']') {
+                host++;
+                hostLength -= 2;
+            }
+            path = "";
+            cacheEntry->isTunnel = 1;
+            cacheEntry->isCachable = 0;
         }
-        if (strncasecmp(line, CONTENT, strlen(CONTENT)) == 0) {
-            sscanf(line + strlen(CONTENT), " %d",
-                   &cacheEntry->responseContentLength);
+    }
+    cacheEntry->requestKeepAlive = keepAlive;
+    if (path && (pathLength > 0 || cacheEntry->isTunnel)) {
+        set_cache_key(cacheEntry, host, hostLength, port, portLength, path,
+                      pathLength);
+    }
+    // printing the last line of a request
+    const char *lastLine = startLine;
+    int lastLength = startLength;
+    if (parser->nHeaders > 0) {
+        httpHeader_t *header = &parser->headers[parser->nHeaders - 1];
+        lastLine = document + header->line;
+        lastLength = header->lineLength;
+    }
+    log_line("Request tail %.*s\n", lastLength, lastLine);
+}
+
+// a copy of the header parsed from document with the start line replaced
+// by startLine (unless it is NULL), the lines named in the NULL-terminated
+// drop left out, and extra lines added before the empty line; length is
+// set to its size
+char *rewrite_header(const char *document, httpParser_t *parser,
+                     const char *startLine, const char **drop,
+                     const char *extra, int *length) {
+    int startLength = startLine ? (int)strlen(startLine)
+                                : parser->startLineLength;
+    // bare line feeds become CRLF, one more byte a line at most
+    char *header = pool_alloc(parser->headerEnd + startLength +
+                              parser->nHeaders + strlen(extra) +
+                              strlen(EMPTY_LINE) + 1);
+    int used = sprintf(header, "%.*s\r\n", startLength,
+                       startLine ? startLine : document);
+    for (int i = 0; i < parser->nHeaders; i++) {
+        httpHeader_t *line = &parser->headers[i];
+        int dropped = 0;
+        for (const char **name = drop; *name && !dropped; name++) {
+            dropped = http_header_is(document, line, *name);
         }
-        if (strncasecmp(line, CACHE, strlen(CACHE)) == 0) {
-            validateCache(cacheEntry, line);
+        if (!dropped) {
+            used += sprintf(header + used, "%.*s\r\n", line->lineLength,
+                            document + line->line);
         }
-        // continue looping through each line
-        line = strtok(NULL, HEADER_END);
     }
+    used += sprintf(header + used, "%s\r\n", extra);
+    *length = used;
+    return header;
+}
 
-    if (!isRequest) {
-        return;
+// make a request that ends at its header conditional on a stale entry's
+// validators, so an unchanged object comes back as a bodiless 304
+void add_validators(cacheEntry_t *entry, cacheEntry_t *stale) {
+    // the new lines go before the empty line that ends the header
+    int length = entry->requestLength - strlen("\r\n");
+    int needed = length + strlen(IF_NONE_MATCH) + stale->etagLength +
+                 strlen(IF_MODIFIED_SINCE) + stale->lastModifiedLength +
+                 strlen(": \r\n: \r\n\r\n") + 1;
+    char *request = pool_alloc(needed);
+    memcpy(request, entry->request, length);
+    if (stale->etagLength > 0) {
+        length += sprintf(request + length, "%s: %.*s\r\n", IF_NONE_MATCH,
+                          stale->etagLength, stale->response + stale->etag);
+    }
+    if (stale->lastModifiedLength > 0) {
+        length += sprintf(request + length, "%s: %.*s\r\n",
+                          IF_MODIFIED_SINCE, stale->lastModifiedLength,
+                          stale->response + stale->lastModified);
     }
-    // extracting the last line of a request
-    memcpy(cacheEntry->request_lastLine, lastLineptr, strlen(lastLineptr) + 1);
-    printf("Request tail %s\n", cacheEntry->request_lastLine);
-    fflush(stdout);
+    length += sprintf(request + length, "\r\n");
+    pool_free(entry->request);
+    entry->request = request;
+    entry->requestLength = length;
 }
 
-// Function to forward request to target host and get response
-int forward_request(cacheEntry_t *cacheEntry) {
-    int originfd =
-        create_listening_socket(cacheEntry->targetPort, cacheEntry->host);
-    // Send the request to host origin server
-    if (send(originfd, cacheEntry->request, cacheEntry->requestLength, 0) < 0) {
-        perror("Error: Failed to send to host\n");
-        close(originfd);
-        exit(EXIT_FAILURE);
+// add a Via line naming this proxy to a request that ends at its header
+void add_via(cacheEntry_t *entry, const char *name, const char *token) {
+    // the new line goes before the empty line that ends the header
+    int length = entry->requestLength - strlen("\r\n");
+    int needed = length + strlen(VIA) + strlen(name) + strlen(token) +
+                 strlen(": 1.1  \r\n\r\n") + 1;
+    char *request = pool_alloc(needed);
+    memcpy(request, entry->request, length);
+    length += sprintf(request + length, "%s: 1.1 %s %s\r\n\r\n", VIA, name,
+                      token);
+    pool_free(entry->request);
+    entry->request = request;
+    entry->requestLength = length;
+}
+
+// Function to start forwarding a request to host:port (its origin, or the
+// cluster member that owns its key), reusing an idle keep-alive connection
+// from the pool when there is one and otherwise connecting to the host's
+// cached addresses. The connection is non-blocking; the caller sends the
+// request once it becomes writable. Returns FORWARD_RESOLVING if the host
+// is still being resolved.
+int forward_request(cacheEntry_t *cacheEntry, char *host, char *port,
+                    upstreamPool_t *pool, dnsCache_t *dns, int *reused) {
+    int originfd = -1;
+    if (pool) {
+        originfd = checkout_upstream(pool, host, port);
+    }
+    *reused = originfd >= 0;
+    if (originfd < 0) {
+        dnsAddress_t addresses[MAX_DNS_ADDRESSES];
+        int count = resolve_cached(dns, host, port, addresses);
+        if (count == DNS_PENDING) {
+            return FORWARD_RESOLVING;
+        }
+        originfd = connect_to_origin(addresses, count);
+    }
+    if (originfd < 0) {
+        fprintf(stderr, "Error: Failed to connect to %s\n", host);
+        return FORWARD_FAILED;
     }
     // output result to stdout
-    printf("GETting %s %s\n", cacheEntry->host, cacheEntry->path);
-    fflush(stdout);
+    if (cacheEntry->isTunnel) {
+        log_line("Tunnelling to %s:%s\n", host, port);
+    } else {
+        log_line("GETting %s %s\n", cacheEntry->host, cacheEntry->path);
+    }
     return originfd;
 }
 
 /*****************************************************************************/
 
-// check if cache is stale
+// check if cache is stale, against the clock the workers tick
 cacheEntry_t *check_stale_cache(cache_t *cache, cacheEntry_t *newEntry) {
-    if (!cache->head) {
-        return NULL;
-    }
-    cacheEntry_t *curr = cache->head;
-    while (curr) {
-        if (strcmp(curr->request, newEntry->request) == 0 && curr->isStalable) {
-            if (time(NULL) - curr->cachedTime >= curr->maxAge) {
-                printf("Stale entry for %s %s\n", curr->host, curr->path);
-                fflush(stdout);
-                return curr;
-            }
-        }
-        curr = curr->next;
+    cacheEntry_t *curr = lookup_cache(cache, newEntry);
+    if (curr && curr->isStalable &&
+        cache_clock() - curr->cachedTime >= curr->maxAge) {
+        log_line("Stale entry for %s %s\n", curr->host, curr->path);
+        return curr;
     }
     return NULL;
 }
 
-// extract cache-control header
-// strstr from
-// https://www.tutorialspoint.com/c_standard_library/c_function_strstr.htm
-void validateCache(cacheEntry_t *entry, char *headerLine) {
-    char *cacheControlDirectory[] = {"private",         "no-store",
-                                     "no-cache",        "max-age=0",
-                                     "must-revalidate", "proxy-revalidate"};
-    int size = 6;
-    // lower headerLine
-    for (int i = 0; headerLine[i]; i++) {
-        headerLine[i] = tolower(headerLine[i]);
-    }
-    // extract max-age
-    char *maxAge = strstr(headerLine, "max-age=");
-    if (maxAge) {
-        sscanf(maxAge, "max-age= %d", &entry->maxAge);
-        if (entry->maxAge != 0) {
-            entry->isStalable = 1;
-        }
-    }
-    // not cachable
-    for (int i = 0; i < size; i++) {
-        if (strstr(headerLine, cacheControlDirectory[i])) {
-            entry->isCachable = 0;
-            entry->isStalable = 0;
-            entry->maxAge = 0;
-            return;
-        }
-    }
-}
-
-// get un-stale cache
-void fetch_cache(cacheEntry_t *entry, int clientfd, cache_t *cache) {
-    printf("Serving %s %s from cache\n", entry->host, entry->path);
-    fflush(stdout);
-    send(clientfd, cache->tail->response, cache->tail->responseTotalBytes, 0);
-    free(entry);
+// get un-stale cache for the request in entry, held for the caller to send
+cacheEntry_t *fetch_cache(cacheEntry_t *entry, cache_t *cache) {
+    log_line("Serving %s %s from cache\n", entry->host, entry->path);
+    cacheEntry_t *cached = lookup_cache(cache, entry);
+    release_cache_entry(entry);
+    hold_cache_entry(cached);
+    return cached;
 }
 
 /*****************************************************************************/
@@ -2,23 +2,57 @@
 #define SOCKETS
 
 #include "dataStruct.h"
+#include "dnsCache.h"
+#include "httpParser.h"
+#include "upstreamPool.h"
 
-// forward request to host
-int forward_request(cacheEntry_t *cacheEntry);
-// create a listening socket
-int create_listening_socket(char *tcpPort, char *host);
-// extract cache-control header
-void validateCache(cacheEntry_t *entry, char *headerLine);
+#define MAX_BYTE 102400
+#define MAX_REQUEST_LENGTH 2000
+#define MALFORMED 10
+
+#define MALFORMED_END "\n\n\n"
+#define EMPTY_LINE "\r\n\r\n"
+
+#define IF_NONE_MATCH "If-None-Match"
+#define IF_MODIFIED_SINCE "If-Modified-Since"
+#define RANGE "Range"
+#define IF_RANGE "If-Range"
+#define VIA "Via"
+
+#define FORWARD_FAILED -1
+#define FORWARD_RESOLVING -2
+
+// start or reuse a non-blocking connection to host:port for the request;
+// FORWARD_FAILED or FORWARD_RESOLVING if there is no socket yet, and reused
+// is set if it came from the pool
+int forward_request(cacheEntry_t *cacheEntry, char *host, char *port,
+                    upstreamPool_t *pool, dnsCache_t *dns, int *reused);
+// create a non-blocking listening socket
+int create_listening_socket(char *tcpPort);
+// start a non-blocking connection to the first usable address, -1 if none
+int connect_to_origin(dnsAddress_t *addresses, int count);
+// make a socket non-blocking
+void set_nonblocking(int fd);
 // check is cache is stale
 cacheEntry_t *check_stale_cache(cache_t *cache, cacheEntry_t *newEntry);
 // check if a substring exists in a longer string
 int my_memmem(char *string, int stringlen, char *substring, int sublen);
-// extract headers in both request and response
-void extract_headers(cacheEntry_t *cacheEntry, int isRequest);
-// read headers and body of both request and response
-void read_message(cacheEntry_t *cacheEntry, int serverfd, int *cacheable,
-                  int forwardToClient, int clientfd, int isHeader);
-// get un-stale cache
-void fetch_cache(cacheEntry_t *entry, int clientfd, cache_t *cache);
+// extract headers in both request and response from a parsed header
+void extract_headers(cacheEntry_t *cacheEntry, httpParser_t *parser,
+                     int isRequest);
+// a copy of the header parsed from document with the start line replaced
+// by startLine (unless it is NULL), the lines named in the NULL-terminated
+// drop left out, and extra lines added before the empty line; length is
+// set to its size
+char *rewrite_header(const char *document, httpParser_t *parser,
+                     const char *startLine, const char **drop,
+                     const char *extra, int *length);
+// make a request that ends at its header conditional on a stale entry's
+// ETag and Last-Modified
+void add_validators(cacheEntry_t *entry, cacheEntry_t *stale);
+// add a Via line naming this proxy to a request that ends at its header
+void add_via(cacheEntry_t *entry, const char *name, const char *token);
+// get un-stale cache, held for the caller to send
+cacheEntry_t *fetch_cache(cacheEntry_t *entry, cache_t *cache);
 
-#endif
\ No newline at end of file
+#endif
@@ -0,0 +1,161 @@
+/*
+Pool of idle HTTP/1.1 keep-alive connections to origin servers, keyed by
+host:port. Each worker owns its own pool. Connections are checked for a
+close or unexpected bytes from the origin before reuse, and expire after
+the idle timeout.
+*/
+
+#define _DEFAULT_SOURCE
+#include <assert.h>
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "memPool.h"
+#include "upstreamPool.h"
+
+#define POOL_BUCKETS 64
+#define FNV_OFFSET 14695981039346656037UL
+#define FNV_PRIME 1099511628211UL
+
+/*****************************************************************************/
+// malloc and initialise an empty pool
+upstreamPool_t *create_upstream_pool(int maxPerHost, int idleTimeout) {
+    upstreamPool_t *pool = malloc(sizeof(upstreamPool_t));
+    assert(pool);
+    pool->nBuckets = POOL_BUCKETS;
+    pool->buckets = calloc(pool->nBuckets, sizeof(upstreamHost_t *));
+    assert(pool->buckets);
+    pool->maxPerHost = maxPerHost;
+    pool->idleTimeout = idleTimeout;
+    return pool;
+}
+
+// find the record for host:port, creating it if asked to
+static upstreamHost_t *find_host(upstreamPool_t *pool, char *host, char *port,
+                                 int create) {
+    char key[BUFSIZ];
+    int keyLength = snprintf(key, sizeof(key), "%s:%s", host, port);
+    unsigned long hash = FNV_OFFSET;
+    for (int i = 0; key[i]; i++) {
+        hash ^= (unsigned char)key[i];
+        hash *= FNV_PRIME;
+    }
+
+    unsigned long bucket = hash & (pool->nBuckets - 1);
+    for (upstreamHost_t *curr = pool->buckets[bucket]; curr;
+         curr = curr->next) {
+        if (curr->hash == hash && strcmp(curr->key, key) == 0) {
+            return curr;
+        }
+    }
+    if (!create) {
+        return NULL;
+    }
+    upstreamHost_t *record = malloc(sizeof(upstreamHost_t));
+    assert(record);
+    record->key = malloc(keyLength + 1);
+    assert(record->key);
+    memcpy(record->key, key, keyLength + 1);
+    record->hash = hash;
+    record->count = 0;
+    record->idle = NULL;
+    record->next = pool->buckets[bucket];
+    pool->buckets[bucket] = record;
+    return record;
+}
+
+// an idle origin connection is stale if the origin closed it, reset it,
+// or sent bytes nobody asked for
+static int is_stale(int fd) {
+    char peek;
+    ssize_t peeked = recv(fd, &peek, 1, MSG_PEEK | MSG_DONTWAIT);
+    return !(peeked < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+}
+
+/*****************************************************************************/
+// take a live idle connection to host:port, -1 if there is none
+int checkout_upstream(upstreamPool_t *pool, char *host, char *port) {
+    upstreamHost_t *record = find_host(pool, host, port, 0);
+    if (!record) {
+        return -1;
+    }
+    while (record->idle) {
+        idleUpstream_t *idle = record->idle;
+        record->idle = idle->next;
+        (record->count)--;
+        int fd = idle->fd;
+        pool_free(idle);
+        if (!is_stale(fd)) {
+            return fd;
+        }
+        close(fd);
+    }
+    return -1;
+}
+
+// keep a finished connection for reuse, closing it if the host is full
+void checkin_upstream(upstreamPool_t *pool, char *host, char *port, int fd) {
+    upstreamHost_t *record = find_host(pool, host, port, 1);
+    if (record->count >= pool->maxPerHost) {
+        close(fd);
+        return;
+    }
+    idleUpstream_t *idle = pool_alloc(sizeof(idleUpstream_t));
+    idle->fd = fd;
+    idle->idleSince = time(NULL);
+    idle->next = record->idle;
+    record->idle = idle;
+    (record->count)++;
+}
+
+// close connections idle for longer than the pool's idle timeout. Lists are
+// most recently used first, so everything after the first expired one has
+// expired too.
+void expire_idle_upstreams(upstreamPool_t *pool, time_t now) {
+    for (unsigned long i = 0; i < pool->nBuckets; i++) {
+        for (upstreamHost_t *record = pool->buckets[i]; record;
+             record = record->next) {
+            idleUpstream_t **link = &record->idle;
+            while (*link && now - (*link)->idleSince < pool->idleTimeout) {
+                link = &(*link)->next;
+            }
+            while (*link) {
+                idleUpstream_t *expired = *link;
+                *link = expired->next;
+                close(expired->fd);
+                pool_free(expired);
+                (record->count)--;
+            }
+        }
+    }
+}
+
+// close every idle connection and free the pool
+void free_upstream_pool(upstreamPool_t *pool) {
+    if (!pool) {
+        return;
+    }
+    for (unsigned long i = 0; i < pool->nBuckets; i++) {
+        upstreamHost_t *record = pool->buckets[i];
+        while (record) {
+            upstreamHost_t *next = record->next;
+            while (record->idle) {
+                idleUpstream_t *idle = record->idle;
+                record->idle = idle->next;
+                close(idle->fd);
+                pool_free(idle);
+            }
+            free(record->key);
+            free(record);
+            record = next;
+        }
+    }
+    free(pool->buckets);
+    free(pool);
+}
+
+/*****************************************************************************/
@@ -0,0 +1,47 @@
+#ifndef UPSTREAMPOOL
+#define UPSTREAMPOOL
+
+#include <time.h>
+
+#define DEFAULT_UPSTREAM_PER_HOST 8
+#define DEFAULT_UPSTREAM_IDLE 30
+
+// keep-alive origin connection waiting for its next request
+typedef struct idleUpstream idleUpstream_t;
+struct idleUpstream {
+    int fd;
+    time_t idleSince;
+    idleUpstream_t *next;
+};
+
+// idle connections to one host:port, most recently used first
+typedef struct upstreamHost upstreamHost_t;
+struct upstreamHost {
+    char *key;
+    unsigned long hash;
+    int count;
+    idleUpstream_t *idle;
+    upstreamHost_t *next;
+};
+
+// per-worker pool of idle origin connections, so needs no locking
+typedef struct upstreamPool upstreamPool_t;
+struct upstreamPool {
+    upstreamHost_t **buckets;
+    unsigned long nBuckets;
+    int maxPerHost;
+    int idleTimeout;
+};
+
+// malloc and initialise an empty pool
+upstreamPool_t *create_upstream_pool(int maxPerHost, int idleTimeout);
+// take a live idle connection to host:port, -1 if there is none
+int checkout_upstream(upstreamPool_t *pool, char *host, char *port);
+// keep a finished connection for reuse, closing it if the host is full
+void checkin_upstream(upstreamPool_t *pool, char *host, char *port, int fd);
+// close connections idle for longer than the pool's idle timeout
+void expire_idle_upstreams(upstreamPool_t *pool, time_t now);
+// close every idle connection and free the pool
+void free_upstream_pool(upstreamPool_t *pool);
+
+#endif